@@ -285,7 +285,7 @@ private:
                "-cluster <simmat> ... <simmat> <aggressiveness> {csv}\n"
                "-makeMask <target_gallery> <query_gallery> {mask}\n"
                "-makePairwiseMask <target_gallery> <query_gallery> {mask}\n"
-               "-combineMasks <mask> ... <mask> {mask} (And|Or)\n"
+               "-combineMasks <mask> ... <mask> {mask} (And|Or|Majority)\n"
                "-cat <gallery> ... <gallery> {gallery}\n"
                "-convert (Format|Gallery|Output) <input_file> {output_file}\n"
                "-evalClassification <predicted_gallery> <truth_gallery> <predicted property name> <ground truth proprty name>\n"
@@ -0,0 +1,590 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \ingroup cli
+ * \page cli_bench Benchmarks
+ * \brief Microbenchmarks for distances, galleries, outputs, transforms, detection grouping and evaluation.
+ *
+ * All inputs are synthetic so results are comparable across machines and versions.
+ * Results are written as JSON, either to stdout or to the file given by -json.
+ * \code
+ * $ br_bench -dimensions 256 -gallery 4096 -queries 64 -iterations 5 -filter "distance|gallery" -json bench.json
+ * \endcode
+ */
+
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRegExp>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <limits>
+#include <stdio.h>
+#include <string.h>
+#include <openbr/openbr_plugin.h>
+#include <openbr/core/bee.h>
+#include <openbr/core/eval.h>
+#include <openbr/core/numa.h>
+#include <openbr/core/opencvutils.h>
+#include <openbr/core/qtutils.h>
+
+using namespace br;
+
+struct BenchConfig
+{
+    int dimensions;
+    int gallerySize;
+    int querySize;
+    int subjects;
+    int imageSize;
+    int iterations;
+    QRegExp filter;
+    QString json;
+
+    BenchConfig()
+        : dimensions(128), gallerySize(2048), querySize(32), subjects(64),
+          imageSize(256), iterations(5), filter(".*") {}
+};
+
+// Synthetic feature vectors, labeled round-robin by subject
+static TemplateList syntheticTemplates(int count, int dimensions, int type, int subjects, const QString &prefix, int seed)
+{
+    cv::RNG rng(seed);
+    TemplateList templates;
+    templates.reserve(count);
+    for (int i=0; i<count; i++) {
+        cv::Mat m(1, dimensions, type);
+        if (type == CV_8UC1) rng.fill(m, cv::RNG::UNIFORM, 0, 256);
+        else                 rng.fill(m, cv::RNG::UNIFORM, 0.f, 1.f);
+        File file(QString("%1/%2.jpg").arg(prefix, QString::number(i)));
+        file.set("Label", QString::number(i % subjects));
+        file.set("Rects", QVariantList() << QRectF(rng.uniform(0, 100), rng.uniform(0, 100), 64, 64));
+        templates.append(Template(file, m));
+    }
+    return templates;
+}
+
+// Synthetic color images with a few landmarks, for transform chains
+static TemplateList syntheticImages(int count, int size, int seed)
+{
+    cv::RNG rng(seed);
+    TemplateList templates;
+    templates.reserve(count);
+    for (int i=0; i<count; i++) {
+        cv::Mat m(size, size, CV_8UC3);
+        rng.fill(m, cv::RNG::UNIFORM, 0, 256);
+        File file(QString("image/%1.jpg").arg(i));
+        file.set("Affine_0", QPointF(size * 0.35, size * 0.4));
+        file.set("Affine_1", QPointF(size * 0.65, size * 0.4));
+        templates.append(Template(file, m));
+    }
+    return templates;
+}
+
+class Bench
+{
+    const BenchConfig &config;
+    QJsonArray results;
+
+public:
+    Bench(const BenchConfig &config) : config(config) {}
+
+    QJsonArray benchmarks() const { return results; }
+
+    // Runs body once to warm up, then config.iterations times, recording the median time.
+    // items is the number of work units one call of body performs.
+    template <typename Function>
+    void run(const QString &group, const QString &name, qint64 items, Function body)
+    {
+        const QString id = group + "/" + name;
+        if (config.filter.indexIn(id) == -1)
+            return;
+
+        body();
+
+        QList<double> seconds;
+        QElapsedTimer timer;
+        for (int i=0; i<config.iterations; i++) {
+            timer.start();
+            body();
+            seconds.append(timer.nsecsElapsed() / 1e9);
+        }
+        std::sort(seconds.begin(), seconds.end());
+        const double median = seconds[seconds.size()/2];
+
+        QJsonObject result;
+        result.insert("group", group);
+        result.insert("name", name);
+        result.insert("items", double(items));
+        result.insert("iterations", config.iterations);
+        result.insert("median_seconds", median);
+        result.insert("min_seconds", seconds.first());
+        result.insert("max_seconds", seconds.last());
+        result.insert("items_per_second", median > 0 ? items / median : 0);
+        results.append(result);
+
+        fprintf(stderr, "%-48s %12.0f items/s\n", qPrintable(id), median > 0 ? items / median : 0);
+    }
+};
+
+struct DistanceBody
+{
+    QSharedPointer<Distance> distance;
+    const TemplateList *targets, *queries;
+    void operator()() const
+    {
+        foreach (const Template &query, *queries)
+            distance->compare(*targets, query);
+    }
+};
+
+struct GalleryWriteBody
+{
+    QString file;
+    const TemplateList *templates;
+    void operator()() const
+    {
+        QFile::remove(file);
+        QScopedPointer<Gallery> gallery(Gallery::make(file));
+        gallery->writeBlock(*templates);
+    }
+};
+
+struct GalleryReadBody
+{
+    QString file;
+    void operator()() const
+    {
+        QScopedPointer<Gallery> gallery(Gallery::make(file));
+        bool done = false;
+        while (!done) gallery->readBlock(&done);
+    }
+};
+
+struct ConvertBody
+{
+    QString input, output;
+    void operator()() const
+    {
+        br::Convert(File("Gallery"), input, output);
+    }
+};
+
+struct OutputBody
+{
+    QString file;
+    FileList targetFiles, queryFiles;
+    const cv::Mat *scores;
+    void operator()() const
+    {
+        QScopedPointer<Output> output(Output::make(file, targetFiles, queryFiles));
+        output->setBlock(0, 0);
+        for (int i=0; i<scores->rows; i++)
+            output->setRelativeRow(scores->ptr<float>(i), NULL, i, 0, scores->cols);
+    }
+};
+
+struct TransformBody
+{
+    QSharedPointer<Transform> transform;
+    const TemplateList *templates;
+    void operator()() const
+    {
+        TemplateList dst;
+        transform->project(*templates, dst);
+    }
+};
+
+struct SuppressBody
+{
+    const QList<cv::Rect> *rects;
+    const QList<float> *confidences;
+    OpenCVUtils::Suppression method;
+    void operator()() const
+    {
+        QList<cv::Rect> r = *rects;
+        QList<float> c = *confidences;
+        OpenCVUtils::suppress(r, c, method, -std::numeric_limits<float>::max(), 3, 0.2f, 0.3f);
+    }
+};
+
+struct EvalBody
+{
+    const cv::Mat *scores, *mask;
+    void operator()() const
+    {
+        Evaluate(*scores, *mask);
+    }
+};
+
+struct GalleryEvalBody
+{
+    enum Kind { Classification, Regression, Detection };
+    Kind kind;
+    QString predicted, truth;
+    void operator()() const
+    {
+        if      (kind == Classification) EvalClassification(predicted, truth);
+        else if (kind == Regression)     EvalRegression(predicted, truth, "Regressor", "Regressand", false);
+        else                             EvalDetection(predicted, truth);
+    }
+};
+
+// Templates normalized to sum to one
+static TemplateList unitHistograms(const TemplateList &templates)
+{
+    TemplateList histograms;
+    histograms.reserve(templates.size());
+    foreach (const Template &t, templates)
+        histograms.append(Template(t.file, cv::Mat(t.m() / cv::sum(t.m())[0])));
+    return histograms;
+}
+
+// Templates holding two feature matrices, for fused distances
+static TemplateList twoComponentTemplates(const TemplateList &templates)
+{
+    TemplateList fused;
+    fused.reserve(templates.size());
+    foreach (const Template &t, templates)
+        fused.append(Template(t.file, QList<cv::Mat>() << t.m() << t.m()));
+    return fused;
+}
+
+static void benchDistances(Bench &bench, const BenchConfig &config)
+{
+    const TemplateList floatTargets = syntheticTemplates(config.gallerySize, config.dimensions, CV_32FC1, config.subjects, "target", 1);
+    const TemplateList floatQueries = syntheticTemplates(config.querySize, config.dimensions, CV_32FC1, config.subjects, "query", 2);
+    const TemplateList byteTargets = syntheticTemplates(config.gallerySize, config.dimensions, CV_8UC1, config.subjects, "target", 3);
+    const TemplateList byteQueries = syntheticTemplates(config.querySize, config.dimensions, CV_8UC1, config.subjects, "query", 4);
+    const TemplateList fusedTargets = twoComponentTemplates(floatTargets);
+    const TemplateList fusedQueries = twoComponentTemplates(floatQueries);
+
+    // Histograms of unit mass, which EMD compares in closed form
+    const TemplateList emdTargets = unitHistograms(floatTargets);
+    const TemplateList emdQueries = unitHistograms(floatQueries);
+
+    const QStringList floatDistances = QStringList() << "L1" << "L2"
+        << "Dist(Correlation)" << "Dist(ChiSquared)" << "Dist(Intersection)" << "Dist(Bhattacharyya)"
+        << "Dist(INF)" << "Dist(L1)" << "Dist(L2)" << "Dist(Cosine)" << "Dist(Dot)";
+    const QStringList byteDistances = QStringList() << "ByteL1" << "Identical";
+
+    foreach (const QString &description, floatDistances + byteDistances + (QStringList() << "EMD" << "Fuse([Dist(L2),Dist(Cosine)])")) {
+        DistanceBody body;
+        body.distance = QSharedPointer<Distance>(Distance::make(description, NULL));
+        if (byteDistances.contains(description)) {
+            body.targets = &byteTargets;
+            body.queries = &byteQueries;
+        } else if (description == "EMD") {
+            body.targets = &emdTargets;
+            body.queries = &emdQueries;
+        } else if (description.startsWith("Fuse")) {
+            body.targets = &fusedTargets;
+            body.queries = &fusedQueries;
+        } else {
+            body.targets = &floatTargets;
+            body.queries = &floatQueries;
+        }
+        bench.run("distance", description, qint64(body.targets->size()) * body.queries->size(), body);
+    }
+}
+
+// Galleries that only store metadata must still read back every name and key they were given
+static void checkMetadataRoundTrip(const QString &file, const TemplateList &templates)
+{
+    QFile::remove(file);
+    {
+        QScopedPointer<Gallery> gallery(Gallery::make(file));
+        gallery->writeBlock(templates);
+    }
+
+    const TemplateList read = TemplateList::fromGallery(file);
+    if (read.size() != templates.size())
+        qFatal("%s read back %d templates, expected %d.", qPrintable(file), read.size(), templates.size());
+    for (int i=0; i<templates.size(); i++) {
+        if (read[i].file.name != templates[i].file.name)
+            qFatal("%s read back the name %s, expected %s.", qPrintable(file), qPrintable(read[i].file.name), qPrintable(templates[i].file.name));
+        foreach (const QString &key, templates[i].file.localKeys())
+            if (read[i].file.value(key) != templates[i].file.value(key))
+                qFatal("%s read back %s=%s for %s, expected %s.", qPrintable(file), qPrintable(key), qPrintable(QtUtils::toString(read[i].file.value(key))),
+                       qPrintable(templates[i].file.name), qPrintable(QtUtils::toString(templates[i].file.value(key))));
+    }
+}
+
+static void benchGalleries(Bench &bench, const BenchConfig &config, const QString &scratch)
+{
+    const TemplateList templates = syntheticTemplates(config.gallerySize, config.dimensions, CV_32FC1, config.subjects, "gallery", 5);
+
+    foreach (const QString &suffix, QStringList() << "gal" << "mem" << "csv" << "json" << "col" << "xml") {
+        const QString file = scratch + "/bench." + suffix;
+
+        GalleryWriteBody write;
+        write.file = file;
+        write.templates = &templates;
+        bench.run("gallery", suffix + "/write", templates.size(), write);
+
+        GalleryReadBody read;
+        read.file = file;
+        bench.run("gallery", suffix + "/read", templates.size(), read);
+    }
+
+    checkMetadataRoundTrip(scratch + "/roundtrip.json", templates);
+
+    foreach (const QString &suffix, QStringList() << "gal" << "csv") {
+        ConvertBody convert;
+        convert.input = scratch + "/bench.gal";
+        convert.output = scratch + "/converted." + suffix;
+        bench.run("gallery", "gal/convert/" + suffix, templates.size(), convert);
+    }
+}
+
+static void benchOutputs(Bench &bench, const BenchConfig &config, const QString &scratch)
+{
+    const FileList targetFiles = syntheticTemplates(config.gallerySize, 1, CV_32FC1, config.subjects, "target", 6).files();
+    const FileList queryFiles = syntheticTemplates(config.querySize, 1, CV_32FC1, config.subjects, "query", 7).files();
+    cv::Mat scores(queryFiles.size(), targetFiles.size(), CV_32FC1);
+    cv::randu(scores, 0.f, 1.f);
+
+    foreach (const QString &suffix, QStringList() << "mtx" << "csv" << "csv[gzip=true]" << "txt" << "null") {
+        OutputBody body;
+        body.file = scratch + "/bench." + suffix;
+        body.targetFiles = targetFiles;
+        body.queryFiles = queryFiles;
+        body.scores = &scores;
+        bench.run("output", suffix, scores.total(), body);
+    }
+}
+
+static void benchTransforms(Bench &bench, const BenchConfig &config)
+{
+    const TemplateList images = syntheticImages(std::max(1, config.querySize), config.imageSize, 8);
+
+    const QStringList chains = QStringList()
+        << "Cvt(Gray)"
+        << "Cvt(Gray)+Resize(64,64)+CvtFloat"
+        << "Cvt(Gray)+Affine(88,88,0.25,0.35)"
+        << "Cvt(Gray)+Blur(1.1)+Gamma(0.2)+ContrastEq(10,0.1)"
+        << "Cvt(Gray)+LBP(1,2)+RectRegions(8,8,6,6)+Hist(59)"
+        << "(Cvt(Gray)+Affine(88,88,0.25,0.35)+CvtFloat)/(Cvt(Gray)+Affine(88,88,0.25,0.35)+LBP(1,2))";
+
+    foreach (const QString &chain, chains) {
+        TransformBody body;
+        body.transform = QSharedPointer<Transform>(Transform::make(chain, NULL));
+        body.templates = &images;
+        bench.run("transform", chain, images.size(), body);
+    }
+
+    // Two class SVMs scoring a whole gallery
+    const TemplateList features = syntheticTemplates(config.gallerySize, config.dimensions, CV_32FC1, 2, "svm", 12);
+    foreach (const QString &svm, QStringList() << "SVM(Linear,C_SVC,1,1)" << "SVM(RBF,C_SVC,1,0.01)") {
+        TransformBody body;
+        body.transform = QSharedPointer<Transform>(Transform::make(svm, NULL));
+        body.transform->train(features);
+        body.templates = &features;
+        bench.run("transform", svm, features.size(), body);
+    }
+}
+
+static void benchSearch(Bench &bench, const BenchConfig &config)
+{
+    const TemplateList targets = syntheticTemplates(config.gallerySize, config.dimensions, CV_32FC1, config.subjects, "target", 11);
+    const TemplateList queries = syntheticTemplates(config.querySize, config.dimensions, CV_32FC1, config.subjects, "query", 12);
+
+    const QStringList searches = QStringList()
+        << "GalleryCompare(L2)"
+        << "GalleryCompare(L2,topK=100)"
+        << "GalleryCompare(L2,numa=true)"
+        << "GalleryCompare(L2,numa=true,topK=100)"
+        << "GalleryCompare(L2,numa=true,replicate=true,topK=100)";
+
+    foreach (const QString &search, searches) {
+        TransformBody body;
+        body.transform = QSharedPointer<Transform>(Transform::make(search, NULL));
+        body.transform->train(targets);
+        body.templates = &queries;
+        bench.run("search", search, qint64(targets.size()) * queries.size(), body);
+    }
+}
+
+// Raw sliding window detections: clusters of jittered windows around objects at several scales
+static void syntheticDetections(int count, int imageSize, QList<cv::Rect> &rects, QList<float> &confidences)
+{
+    cv::RNG rng(13);
+    const int perObject = 16;
+    for (int i=0; i<count; i++) {
+        const int size = rng.uniform(20, std::max(21, imageSize/4));
+        const int x = rng.uniform(0, std::max(1, imageSize - size));
+        const int y = rng.uniform(0, std::max(1, imageSize - size));
+        const float confidence = rng.uniform(0.f, 10.f);
+        const int jitter = std::max(1, size/10);
+        for (int j=0; j<perObject; j++) {
+            const int s = size + rng.uniform(-jitter, jitter+1);
+            rects.append(cv::Rect(x + rng.uniform(-jitter, jitter+1), y + rng.uniform(-jitter, jitter+1), s, s));
+            confidences.append(confidence + rng.uniform(-1.f, 1.f));
+        }
+    }
+}
+
+static void benchDetection(Bench &bench, const BenchConfig &config)
+{
+    QList<cv::Rect> rects;
+    QList<float> confidences;
+    syntheticDetections(config.gallerySize, config.imageSize * 4, rects, confidences);
+
+    const char *names[] = { "Group", "Greedy", "Soft" };
+    for (int method=OpenCVUtils::Group; method<=OpenCVUtils::Soft; method++) {
+        SuppressBody body;
+        body.rects = &rects;
+        body.confidences = &confidences;
+        body.method = static_cast<OpenCVUtils::Suppression>(method);
+        bench.run("detection", names[method], rects.size(), body);
+    }
+}
+
+static void writeGallery(const QString &file, const TemplateList &templates)
+{
+    QFile::remove(file);
+    QScopedPointer<Gallery> gallery(Gallery::make(file));
+    gallery->writeBlock(templates);
+}
+
+// Truth and predicted metadata galleries for the classification, regression and detection evaluations
+static void syntheticEvalGalleries(int count, int subjects, const QString &predictedGallery, const QString &truthGallery)
+{
+    cv::RNG rng(14);
+    TemplateList truth = syntheticTemplates(count, 1, CV_32FC1, subjects, "eval", 15);
+    TemplateList predicted;
+    predicted.reserve(truth.size());
+    for (int i=0; i<truth.size(); i++) {
+        const QRectF rect = truth[i].file.rects().first();
+        const float regressand = rng.uniform(0.f, 100.f);
+        truth[i].file.set("Regressand", regressand);
+
+        File file(truth[i].file.name);
+        file.set("Label", rng.uniform(0.f, 1.f) < 0.8f ? truth[i].file.get<QString>("Label") : QString::number(rng.uniform(0, subjects)));
+        file.set("Regressor", regressand + rng.gaussian(5));
+        file.set("Rects", QVariantList() << rect.translated(rng.uniform(-8, 9), rng.uniform(-8, 9))
+                                         << QRectF(rng.uniform(0, 100), rng.uniform(0, 100), 64, 64));
+        file.setList<float>("Confidences", QList<float>() << rng.uniform(0.5f, 1.f) << rng.uniform(0.f, 0.5f));
+        predicted.append(Template(file));
+    }
+    writeGallery(predictedGallery, predicted);
+    writeGallery(truthGallery, truth);
+}
+
+static void benchEval(Bench &bench, const BenchConfig &config, const QString &scratch)
+{
+    const FileList targetFiles = syntheticTemplates(config.gallerySize, 1, CV_32FC1, config.subjects, "target", 9).files();
+    const FileList queryFiles = syntheticTemplates(config.querySize, 1, CV_32FC1, config.subjects, "query", 10).files();
+    cv::Mat scores(queryFiles.size(), targetFiles.size(), CV_32FC1);
+    cv::randu(scores, 0.f, 1.f);
+
+    const cv::Mat mask = BEE::makeMask(targetFiles, queryFiles);
+
+    EvalBody body;
+    body.scores = &scores;
+    body.mask = &mask;
+    bench.run("eval", "Evaluate", scores.total(), body);
+
+    const QString predicted = scratch + "/predicted.gal", truth = scratch + "/truth.gal";
+    syntheticEvalGalleries(config.gallerySize, config.subjects, predicted, truth);
+    const char *names[] = { "EvalClassification", "EvalRegression", "EvalDetection" };
+    for (int kind=GalleryEvalBody::Classification; kind<=GalleryEvalBody::Detection; kind++) {
+        GalleryEvalBody gallery;
+        gallery.kind = static_cast<GalleryEvalBody::Kind>(kind);
+        gallery.predicted = predicted;
+        gallery.truth = truth;
+        bench.run("eval", names[kind], config.gallerySize, gallery);
+    }
+}
+
+static void help()
+{
+    printf("br_bench [options]\n"
+           "\n"
+           "-dimensions <int>   Feature vector length (default 128)\n"
+           "-gallery <int>      Number of gallery templates (default 2048)\n"
+           "-queries <int>      Number of query templates (default 32)\n"
+           "-subjects <int>     Number of distinct labels (default 64)\n"
+           "-imageSize <int>    Side length of synthetic images (default 256)\n"
+           "-iterations <int>   Timed repetitions per benchmark (default 5)\n"
+           "-filter <regexp>    Only run benchmarks whose group/name matches\n"
+           "-json <file>        Write results to file instead of stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+    br_initialize(argc, argv, "", false);
+    Globals->quiet = true;
+
+    BenchConfig config;
+    for (int i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        const bool hasValue = (i+1 < argc);
+        if      (!strcmp(arg, "-help"))                     { help(); br_finalize(); return 0; }
+        else if (!strcmp(arg, "-dimensions") && hasValue)   config.dimensions = atoi(argv[++i]);
+        else if (!strcmp(arg, "-gallery") && hasValue)      config.gallerySize = atoi(argv[++i]);
+        else if (!strcmp(arg, "-queries") && hasValue)      config.querySize = atoi(argv[++i]);
+        else if (!strcmp(arg, "-subjects") && hasValue)     config.subjects = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(arg, "-imageSize") && hasValue)    config.imageSize = atoi(argv[++i]);
+        else if (!strcmp(arg, "-iterations") && hasValue)   config.iterations = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(arg, "-filter") && hasValue)       config.filter = QRegExp(argv[++i]);
+        else if (!strcmp(arg, "-json") && hasValue)         config.json = argv[++i];
+        else    qFatal("Unrecognized argument: %s, try 'br_bench -help'", arg);
+    }
+
+    QTemporaryDir scratch;
+    if (!scratch.isValid())
+        qFatal("Unable to create scratch directory.");
+
+    Bench bench(config);
+    benchDistances(bench, config);
+    benchGalleries(bench, config, scratch.path());
+    benchOutputs(bench, config, scratch.path());
+    benchTransforms(bench, config);
+    benchSearch(bench, config);
+    benchDetection(bench, config);
+    benchEval(bench, config, scratch.path());
+
+    QJsonObject configuration;
+    configuration.insert("dimensions", config.dimensions);
+    configuration.insert("gallery", config.gallerySize);
+    configuration.insert("queries", config.querySize);
+    configuration.insert("subjects", config.subjects);
+    configuration.insert("imageSize", config.imageSize);
+    configuration.insert("iterations", config.iterations);
+    configuration.insert("parallelism", Globals->parallelism);
+    configuration.insert("numaNodes", NUMA::nodes());
+
+    QJsonObject root;
+    root.insert("version", QString(br_version()));
+    root.insert("configuration", configuration);
+    root.insert("benchmarks", bench.benchmarks());
+    const QByteArray json = QJsonDocument(root).toJson();
+
+    if (config.json.isEmpty()) {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    } else {
+        QFile file(config.json);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Unable to write %s", qPrintable(config.json));
+        file.write(json);
+    }
+
+    br_finalize();
+    return 0;
+}
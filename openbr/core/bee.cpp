@@ -15,9 +15,13 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtCore>
+#include <QtConcurrent>
 #ifndef BR_EMBEDDED
 #include <QtXml>
 #endif // BR_EMBEDDED
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bee.h"
 #include "opencvutils.h"
@@ -256,123 +260,285 @@ void makePairwiseMask(const QString &targetInput, const QString &queryInput, con
     }
 }
 
+// Labels, partitions and file names reduced to integers so mask cells compare ints rather than strings
+struct MaskKeys
+{
+    QVector<int> files, labels, partitions;
+
+    MaskKeys(const FileList &files, QHash<QString,int> &fileIds, QHash<QString,int> &labelIds)
+    {
+        // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
+        // doing string comparisons (but that isn't implemented yet for FileList) -cao
+        const QStringList labelStrings = File::get<QString>(files, "Label", "-1");
+        partitions = files.crossValidationPartitions().toVector();
+        this->files.reserve(files.size());
+        this->labels.reserve(files.size());
+        for (int i=0; i<files.size(); i++) {
+            this->files.append(id(files[i], fileIds));
+            this->labels.append(labelStrings[i] == "-1" ? -1 : id(labelStrings[i], labelIds));
+        }
+    }
+
+    static int id(const QString &value, QHash<QString,int> &ids)
+    {
+        QHash<QString,int>::const_iterator it = ids.constFind(value);
+        if (it != ids.constEnd()) return it.value();
+        const int next = ids.size();
+        ids.insert(value, next);
+        return next;
+    }
+};
+
+static inline MaskValue maskValue(const MaskKeys &queries, int i, const MaskKeys &targets, int j, int partition)
+{
+    if      (queries.files[i] == targets.files[j])   return DontCare;
+    else if (queries.labels[i] == -1)                return DontCare;
+    else if (targets.labels[j] == -1)                return DontCare;
+    else if (queries.partitions[i] != partition)     return DontCare;
+    else if (targets.partitions[j] == -1)            return NonMatch;
+    else if (targets.partitions[j] != partition)     return DontCare;
+    else if (queries.labels[i] == targets.labels[j]) return Match;
+    else                                             return NonMatch;
+}
+
+// Fill rows, a block of the mask starting at query firstQuery
+static void makeMaskRows(const MaskKeys *targets, const MaskKeys *queries, Mat rows, int partition, int firstQuery)
+{
+    for (int i=0; i<rows.rows; i++) {
+        MaskValue *row = rows.ptr<MaskValue>(i);
+        for (int j=0; j<rows.cols; j++)
+            row[j] = maskValue(*queries, firstQuery+i, *targets, j, partition);
+    }
+}
+
 Mat makePairwiseMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
+    QHash<QString,int> fileIds, labelIds;
+    const MaskKeys targetKeys(targets, fileIds, labelIds);
+    const MaskKeys queryKeys(queries, fileIds, labelIds);
 
     Mat mask(queries.size(), 1, CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        const QString &fileB = targets[i];
-        const QString labelB = targetLabels[i];
-        const int partitionB = targetPartitions[i];
-
-        MaskValue val;
-        if      (fileA == fileB)           val = DontCare;
-        else if (labelA == "-1")           val = DontCare;
-        else if (labelB == "-1")           val = DontCare;
-        else if (partitionA != partition)  val = DontCare;
-        else if (partitionB == -1)         val = NonMatch;
-        else if (partitionB != partition)  val = DontCare;
-        else if (labelA == labelB)         val = Match;
-        else                               val = NonMatch;
-        mask.at<MaskValue>(i,0) = val;
-    }
+    for (int i=0; i<queries.size(); i++)
+        mask.at<MaskValue>(i,0) = maskValue(queryKeys, i, targetKeys, i, partition);
 
     return mask;
 }
 
 Mat makeMask(const FileList &targets, const FileList &queries, int partition)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
+    QHash<QString,int> fileIds, labelIds;
+    const MaskKeys targetKeys(targets, fileIds, labelIds);
+    const MaskKeys queryKeys(queries, fileIds, labelIds);
 
     Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
-
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
+    const int step = std::max(1, (int)ceil(float(queries.size()) / std::max(1, Globals->parallelism)));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<queries.size(); i+=step)
+        futures.addFuture(QtConcurrent::run(makeMaskRows, &targetKeys, &queryKeys, mask.rowRange(i, std::min(i+step, queries.size())), partition, i));
+    futures.waitForFinished();
+
+    return mask;
+}
+
+// A BEE matrix mapped into memory, rows are paged in from disk as they are used
+struct MappedMatrix
+{
+    QFile file;
+    QString targetSigset, querySigset;
+    int rows, cols;
+    bool isMask;
+    const uchar *data;
+
+    explicit MappedMatrix(const QString &fileName)
+        : file(fileName), rows(0), cols(0), isMask(false), data(NULL)
+    {
+        if (!file.open(QFile::ReadOnly))
+            qFatal("Unable to open %s for reading.", qPrintable(fileName));
+
+        const QByteArray format = file.readLine();
+        if ((format.size() < 2) || (format[1] != '2'))
+            qFatal("Invalid matrix header.");
+        targetSigset = file.readLine().simplified();
+        querySigset = file.readLine().simplified();
+
+        const QStringList words = QString(file.readLine()).split(" ");
+        rows = words[1].toInt();
+        cols = words[2].toInt();
+        isMask = words[0][1] == 'B';
+
+        const qint64 size = qint64(rows) * cols * (isMask ? sizeof(MaskValue) : sizeof(SimmatValue));
+        if (file.size() - file.pos() != size)
+            qFatal("Unexpected matrix size in %s.", qPrintable(fileName));
+        if (size > 0) {
+            data = file.map(file.pos(), size);
+            if (data == NULL)
+                qFatal("Unable to map %s.", qPrintable(fileName));
         }
     }
+};
 
-    return mask;
+// An input to combineMasks in the orientation of the first mask, cells outside the mask are DontCare
+struct MaskInput
+{
+    const uchar *data;
+    int rows, cols;
+    bool transposed;
+};
+
+enum CombineMethod { CombineAnd, CombineOr, CombineMajority };
+
+// Flag the Match, NonMatch and DontCare cells of one mask row and count the labelled (Match or NonMatch) ones
+static void accumulateMaskRow(const uchar *row, uchar *match, uchar *nonMatch, uchar *dontCare, uchar *labelled, int n)
+{
+    int j = 0;
+#ifdef __SSE2__
+    const __m128i matchValue = _mm_set1_epi8(char(Match));
+    const __m128i nonMatchValue = _mm_set1_epi8(char(NonMatch));
+    const __m128i dontCareValue = _mm_set1_epi8(char(DontCare));
+    const __m128i one = _mm_set1_epi8(1);
+    for (; j+16<=n; j+=16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(row+j));
+        const __m128i isMatch = _mm_cmpeq_epi8(v, matchValue);
+        const __m128i isNonMatch = _mm_cmpeq_epi8(v, nonMatchValue);
+        __m128i *m = (__m128i*)(match+j), *nm = (__m128i*)(nonMatch+j), *dc = (__m128i*)(dontCare+j), *l = (__m128i*)(labelled+j);
+        _mm_storeu_si128(m, _mm_or_si128(_mm_loadu_si128(m), isMatch));
+        _mm_storeu_si128(nm, _mm_or_si128(_mm_loadu_si128(nm), isNonMatch));
+        _mm_storeu_si128(dc, _mm_or_si128(_mm_loadu_si128(dc), _mm_cmpeq_epi8(v, dontCareValue)));
+        _mm_storeu_si128(l, _mm_adds_epu8(_mm_loadu_si128(l), _mm_and_si128(_mm_or_si128(isMatch, isNonMatch), one)));
+    }
+#endif
+    for (; j<n; j++) {
+        const bool isMatch = row[j] == Match, isNonMatch = row[j] == NonMatch;
+        match[j] |= isMatch ? 0xff : 0;
+        nonMatch[j] |= isNonMatch ? 0xff : 0;
+        dontCare[j] |= (row[j] == DontCare) ? 0xff : 0;
+        if ((isMatch || isNonMatch) && (labelled[j] < 0xff)) labelled[j]++;
+    }
+}
+
+// Write the combined row, returns false if a cell is both a genuine and an imposter
+static bool resolveMaskRow(const uchar *match, const uchar *nonMatch, const uchar *dontCare, const uchar *labelled, uchar *dst, int n, int method, int masks)
+{
+    // A strict majority of the masks must label the cell
+    const int quorum = masks/2 + 1;
+    uchar conflict = 0;
+    int j = 0;
+#ifdef __SSE2__
+    const __m128i nonMatchValue = _mm_set1_epi8(char(NonMatch));
+    const __m128i quorumValue = _mm_set1_epi8(char(quorum));
+    __m128i conflicts = _mm_setzero_si128();
+    for (; j+16<=n; j+=16) {
+        const __m128i m = _mm_loadu_si128((const __m128i*)(match+j));
+        const __m128i nm = _mm_loadu_si128((const __m128i*)(nonMatch+j));
+        conflicts = _mm_or_si128(conflicts, _mm_and_si128(m, nm));
+        __m128i v = _mm_or_si128(m, _mm_and_si128(nm, nonMatchValue));
+        if (method == CombineAnd) {
+            v = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(dontCare+j)), v);
+        } else if (method == CombineMajority) {
+            const __m128i l = _mm_loadu_si128((const __m128i*)(labelled+j));
+            v = _mm_and_si128(v, _mm_cmpeq_epi8(_mm_max_epu8(l, quorumValue), l));
+        }
+        _mm_storeu_si128((__m128i*)(dst+j), v);
+    }
+    conflict = _mm_movemask_epi8(conflicts) ? 0xff : 0;
+#endif
+    for (; j<n; j++) {
+        conflict |= match[j] & nonMatch[j];
+        uchar v = match[j] | (nonMatch[j] & NonMatch);
+        if      (method == CombineAnd)      v &= ~dontCare[j];
+        else if (method == CombineMajority) v &= (labelled[j] >= quorum) ? 0xff : 0;
+        dst[j] = v;
+    }
+    return conflict == 0;
+}
+
+static bool combineMaskRows(const QList<MaskInput> &inputs, Mat combined, int method, int begin, int end)
+{
+    const int cols = combined.cols;
+
+    // Orient the part of each input covering rows [begin, end) of the output
+    QList<Mat> blocks;
+    foreach (const MaskInput &input, inputs) {
+        const Mat src(input.rows, input.cols, CV_8UC1, (void*)input.data);
+        Mat block;
+        if (input.transposed) {
+            if (begin < input.cols) transpose(src.colRange(begin, std::min(end, input.cols)), block);
+        } else {
+            if (begin < input.rows) block = src.rowRange(begin, std::min(end, input.rows));
+        }
+        blocks.append(block);
+    }
+
+    QVector<uchar> padded(cols), match(cols), nonMatch(cols), dontCare(cols), labelled(cols);
+    bool ok = true;
+    for (int i=begin; i<end; i++) {
+        match.fill(0); nonMatch.fill(0); dontCare.fill(0); labelled.fill(0);
+        for (int k=0; k<blocks.size(); k++) {
+            const Mat &block = blocks[k];
+            const int r = i - begin;
+            const uchar *row;
+            if ((r < block.rows) && (block.cols == cols)) {
+                row = block.ptr<uchar>(r);
+            } else {
+                padded.fill(DontCare);
+                if (r < block.rows)
+                    memcpy(padded.data(), block.ptr<uchar>(r), std::min(block.cols, cols));
+                row = padded.data();
+            }
+            accumulateMaskRow(row, match.data(), nonMatch.data(), dontCare.data(), labelled.data(), cols);
+        }
+        ok &= resolveMaskRow(match.data(), nonMatch.data(), dontCare.data(), labelled.data(), combined.ptr<uchar>(i), cols, method, blocks.size());
+    }
+    return ok;
 }
 
 void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
 {
     qDebug("Combining %d masks to %s with method %s", inputMasks.size(), qPrintable(outputMask), qPrintable(method));
 
-    bool AND = true;
-    if      (method == "And") AND = true;
-    else if (method == "Or")  AND = false;
-    else                      qFatal("Invalid method.");
+    CombineMethod combine = CombineAnd;
+    if      (method == "And")      combine = CombineAnd;
+    else if (method == "Or")       combine = CombineOr;
+    else if (method == "Majority") combine = CombineMajority;
+    else                           qFatal("Invalid method.");
 
-    QList<Mat> masks;
-    foreach (const QString &inputMask, inputMasks)
-        masks.append(readMatrix(inputMask));
-    if (masks.size() < 2)
+    if (inputMasks.size() < 2)
         qFatal("Expected at least two masks.");
 
-    const int rows = masks.first().rows;
-    const int columns = masks.first().cols;
-    Mat combinedMask(rows, columns, CV_8UC1);
-    for (int i=0; i<rows; i++) {
-        for (int j=0; j<columns; j++) {
-            int genuineCount = 0;
-            int imposterCount = 0;
-            int dontcareCount = 0;
-            for (int k=0; k<masks.size(); k++) {
-                switch (masks[k].at<MaskValue>(i,j)) {
-                  case Match:
-                    genuineCount++;
-                    break;
-                  case NonMatch:
-                    imposterCount++;
-                    break;
-                  case DontCare:
-                    dontcareCount++;
-                    break;
-                }
-            }
-            if ((genuineCount != 0) && (imposterCount != 0)) qFatal("Comparison is both a genuine and an imposter.");
-
-            MaskValue val;
-            if      (genuineCount > 0)  val = Match;
-            else if (imposterCount > 0) val = NonMatch;
-            else                        val = DontCare;
-            if (AND && (dontcareCount > 0)) val = DontCare;
-            combinedMask.at<MaskValue>(i,j) = val;
-        }
+    QList< QSharedPointer<MappedMatrix> > matrices;
+    foreach (const QString &inputMask, inputMasks) {
+        matrices.append(QSharedPointer<MappedMatrix>(new MappedMatrix(inputMask)));
+        if (!matrices.last()->isMask)
+            qFatal("%s is not a mask.", qPrintable(inputMask));
     }
 
+    // Masks whose target and query sigsets are swapped relative to the first mask are read transposed,
+    // the combined mask covers the union of all masks
+    const MappedMatrix &first = *matrices.first();
+    QList<MaskInput> inputs;
+    int rows = 0, cols = 0;
+    foreach (const QSharedPointer<MappedMatrix> &matrix, matrices) {
+        MaskInput input;
+        input.data = matrix->data;
+        input.rows = matrix->rows;
+        input.cols = matrix->cols;
+        input.transposed = (matrix->targetSigset != matrix->querySigset) &&
+                           (matrix->targetSigset == first.querySigset) &&
+                           (matrix->querySigset == first.targetSigset);
+        inputs.append(input);
+        rows = std::max(rows, input.transposed ? input.cols : input.rows);
+        cols = std::max(cols, input.transposed ? input.rows : input.cols);
+    }
+
+    Mat combinedMask(rows, cols, CV_8UC1);
+    const int blockSize = 256;
+    QList< QFuture<bool> > futures;
+    for (int i=0; i<rows; i+=blockSize)
+        futures.append(QtConcurrent::run(combineMaskRows, inputs, combinedMask, int(combine), i, std::min(i+blockSize, rows)));
+    foreach (const QFuture<bool> &future, futures)
+        if (!future.result())
+            qFatal("Comparison is both a genuine and an imposter.");
+
     writeMatrix(combinedMask, outputMask, "Combined_Targets", "Combined_Queries");
 }
 
@@ -0,0 +1,392 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDataStream>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+
+#include "columns.h"
+#include "qtutils.h"
+
+using namespace br;
+
+static const quint32 ColumnsMagic = 0x42524331; // "BRC1"
+
+QVariant MetadataColumns::Column::value(int row) const
+{
+    if (!present[row])
+        return QVariant();
+
+    switch (storage) {
+      case Integer: {
+        QVariant v(integers[row]);
+        v.convert(type);
+        return v;
+      }
+      case Real: {
+        QVariant v(reals[row]);
+        v.convert(type);
+        return v;
+      }
+      case String:
+        return dictionary[codes[row]];
+      default:
+        return variants[row];
+    }
+}
+
+QString MetadataColumns::Column::string(int row) const
+{
+    if (!present[row])
+        return QString();
+    if (storage == String)
+        return dictionary[codes[row]];
+    return value(row).toString();
+}
+
+QStringList MetadataColumns::keys() const
+{
+    QStringList keys;
+    foreach (const Column &column, columns)
+        keys.append(column.key);
+    return keys;
+}
+
+const MetadataColumns::Column *MetadataColumns::column(const QString &key) const
+{
+    for (int i=0; i<columns.size(); i++)
+        if (columns[i].key == key)
+            return &columns[i];
+    return NULL;
+}
+
+static bool isInteger(int type)
+{
+    return (type == QMetaType::Int) || (type == QMetaType::UInt) || (type == QMetaType::LongLong) ||
+           (type == QMetaType::Bool) || (type == QMetaType::Short) || (type == QMetaType::Char);
+}
+
+static bool isReal(int type)
+{
+    return (type == QMetaType::Float) || (type == QMetaType::Double);
+}
+
+MetadataColumns MetadataColumns::fromFiles(const FileList &files)
+{
+    MetadataColumns result;
+    result.names.reserve(files.size());
+
+    // Every key in order of first appearance, with the common type of its values
+    QHash<QString, int> indices;
+    bool anyFTE = false;
+    foreach (const File &file, files) {
+        result.names.append(file.name);
+        anyFTE = anyFTE || file.fte;
+        const QVariantMap metadata = file.localMetadata();
+        for (QVariantMap::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            const int type = it.value().userType();
+            if (!indices.contains(it.key())) {
+                indices.insert(it.key(), result.columns.size());
+                Column column;
+                column.key = it.key();
+                column.type = type;
+                result.columns.append(column);
+            } else if (result.columns[indices[it.key()]].type != type) {
+                result.columns[indices[it.key()]].type = QMetaType::QVariant;
+            }
+        }
+    }
+
+    if (anyFTE && !indices.contains("FTE")) {
+        indices.insert("FTE", result.columns.size());
+        Column column;
+        column.key = "FTE";
+        column.type = QMetaType::Bool;
+        result.columns.append(column);
+    }
+
+    for (int c=0; c<result.columns.size(); c++) {
+        Column &column = result.columns[c];
+        if      (isInteger(column.type))            column.storage = Column::Integer;
+        else if (isReal(column.type))               column.storage = Column::Real;
+        else if (column.type == QMetaType::QString) column.storage = Column::String;
+        else                                        column.storage = Column::Variant;
+
+        column.present = QByteArray(files.size(), 0);
+        switch (column.storage) {
+          case Column::Integer: column.integers.resize(files.size()); break;
+          case Column::Real:    column.reals.resize(files.size());    break;
+          case Column::String:  column.codes.resize(files.size());    break;
+          case Column::Variant:
+            for (int i=0; i<files.size(); i++)
+                column.variants.append(QVariant());
+            break;
+        }
+
+        QHash<QString, qint32> dictionary;
+        for (int i=0; i<files.size(); i++) {
+            const QVariantMap metadata = files[i].localMetadata();
+            QVariant value;
+            if (metadata.contains(column.key)) value = metadata.value(column.key);
+            else if (column.key == "FTE")      value = files[i].fte;
+            else                               continue;
+
+            column.present[i] = 1;
+            switch (column.storage) {
+              case Column::Integer: column.integers[i] = value.toLongLong(); break;
+              case Column::Real:    column.reals[i] = value.toDouble();      break;
+              case Column::String: {
+                const QString string = value.toString();
+                QHash<QString, qint32>::const_iterator it = dictionary.constFind(string);
+                if (it == dictionary.constEnd()) {
+                    it = dictionary.insert(string, column.dictionary.size());
+                    column.dictionary.append(string);
+                }
+                column.codes[i] = it.value();
+              } break;
+              case Column::Variant: column.variants[i] = value; break;
+            }
+        }
+    }
+
+    return result;
+}
+
+static void resizeColumn(MetadataColumns::Column &column, int rows)
+{
+    const int size = column.present.size();
+    column.present.append(QByteArray(rows - size, 0));
+    switch (column.storage) {
+      case MetadataColumns::Column::Integer: column.integers.resize(rows); break;
+      case MetadataColumns::Column::Real:    column.reals.resize(rows);    break;
+      case MetadataColumns::Column::String:  column.codes.resize(rows);    break;
+      case MetadataColumns::Column::Variant:
+        for (int i=size; i<rows; i++)
+            column.variants.append(QVariant());
+        break;
+    }
+}
+
+static void toVariants(MetadataColumns::Column &column)
+{
+    if (column.storage == MetadataColumns::Column::Variant)
+        return;
+
+    QVariantList variants;
+    for (int i=0; i<column.present.size(); i++)
+        variants.append(column.value(i));
+    column.variants = variants;
+    column.integers.clear();
+    column.reals.clear();
+    column.codes.clear();
+    column.dictionary.clear();
+    column.storage = MetadataColumns::Column::Variant;
+    column.type = QMetaType::QVariant;
+}
+
+void MetadataColumns::append(const MetadataColumns &other)
+{
+    const int offset = rows();
+    names.append(other.names);
+
+    foreach (Column source, other.columns) {
+        int index = 0;
+        while ((index < columns.size()) && (columns[index].key != source.key))
+            index++;
+        if (index == columns.size()) {
+            Column column;
+            column.key = source.key;
+            column.storage = source.storage;
+            column.type = source.type;
+            resizeColumn(column, offset);
+            columns.append(column);
+        }
+
+        Column &target = columns[index];
+        if ((target.storage != source.storage) || (target.type != source.type)) {
+            toVariants(target);
+            toVariants(source);
+        }
+
+        target.present.append(source.present);
+        switch (target.storage) {
+          case Column::Integer: target.integers += source.integers; break;
+          case Column::Real:    target.reals += source.reals;       break;
+          case Column::String: {
+            // Translate the segment's codes into the merged dictionary
+            QHash<QString, qint32> dictionary;
+            for (int i=0; i<target.dictionary.size(); i++)
+                dictionary.insert(target.dictionary[i], i);
+            QVector<qint32> codes(source.dictionary.size());
+            for (int i=0; i<source.dictionary.size(); i++) {
+                QHash<QString, qint32>::const_iterator it = dictionary.constFind(source.dictionary[i]);
+                if (it == dictionary.constEnd()) {
+                    it = dictionary.insert(source.dictionary[i], target.dictionary.size());
+                    target.dictionary.append(source.dictionary[i]);
+                }
+                codes[i] = it.value();
+            }
+            for (int i=0; i<source.codes.size(); i++)
+                target.codes.append(source.present[i] ? codes[source.codes[i]] : 0);
+          } break;
+          case Column::Variant: target.variants += source.variants; break;
+        }
+    }
+
+    // Keys missing from the other segment are unset in its rows
+    for (int i=0; i<columns.size(); i++)
+        resizeColumn(columns[i], rows());
+}
+
+File MetadataColumns::file(int row) const
+{
+    File file(names[row]);
+    foreach (const Column &column, columns)
+        if (column.present[row])
+            file.set(column.key, column.value(row));
+    file.fte = file.getBool("FTE", false);
+    return file;
+}
+
+FileList MetadataColumns::files(const QVector<int> &rows) const
+{
+    FileList files;
+    files.reserve(rows.size());
+    foreach (int row, rows)
+        files.append(file(row));
+    return files;
+}
+
+QVector<int> MetadataColumns::select(const QHash<QString, QStringList> &filters) const
+{
+    QByteArray selected(rows(), 1);
+    for (QHash<QString, QStringList>::const_iterator it = filters.constBegin(); it != filters.constEnd(); ++it) {
+        const Column *column = this->column(it.key());
+        if (!column)
+            return QVector<int>();
+
+        const QSet<QString> allowed = it.value().toSet();
+        const char *present = column->present.constData();
+        char *rowSelected = selected.data();
+        if (column->storage == Column::String) {
+            // Resolve the allowed strings to codes once, then scan the codes
+            QByteArray allowedCodes(column->dictionary.size(), 0);
+            for (int i=0; i<column->dictionary.size(); i++)
+                allowedCodes[i] = allowed.contains(column->dictionary[i]);
+            const qint32 *codes = column->codes.constData();
+            for (int i=0; i<rows(); i++)
+                rowSelected[i] &= present[i] & allowedCodes[codes[i]];
+        } else if ((column->storage == Column::Integer) && (column->type != QMetaType::Bool)) {
+            QSet<qint64> allowedValues;
+            foreach (const QString &value, allowed) {
+                bool ok;
+                const qint64 integer = value.toLongLong(&ok);
+                if (ok) allowedValues.insert(integer);
+            }
+            const qint64 *integers = column->integers.constData();
+            for (int i=0; i<rows(); i++)
+                rowSelected[i] &= present[i] & char(allowedValues.contains(integers[i]));
+        } else {
+            for (int i=0; i<rows(); i++)
+                rowSelected[i] &= present[i] & char(allowed.contains(column->string(i)));
+        }
+    }
+
+    QVector<int> result;
+    for (int i=0; i<rows(); i++)
+        if (selected[i])
+            result.append(i);
+    return result;
+}
+
+void MetadataColumns::write(const QString &file, bool append) const
+{
+    QFile f(file);
+    QtUtils::touchDir(f);
+    if (!f.open(append ? QFile::Append : QFile::WriteOnly))
+        qFatal("Failed to open %s for writing.", qPrintable(file));
+
+    QDataStream stream(&f);
+    stream << ColumnsMagic << names << quint32(columns.size());
+    foreach (const Column &column, columns) {
+        stream << column.key << qint32(column.storage) << qint32(column.type) << column.present;
+        switch (column.storage) {
+          case Column::Integer: stream << column.integers; break;
+          case Column::Real:    stream << column.reals;    break;
+          case Column::String:  stream << column.dictionary << column.codes; break;
+          case Column::Variant: stream << column.variants; break;
+        }
+    }
+}
+
+bool MetadataColumns::read(const QString &file)
+{
+    QFile f(file);
+    if (!f.open(QFile::ReadOnly))
+        return false;
+
+    names.clear();
+    columns.clear();
+    QDataStream stream(&f);
+    while (!stream.atEnd()) {
+        quint32 magic, size;
+        stream >> magic;
+        if (magic != ColumnsMagic) {
+            qWarning("%s is not a columnar gallery.", qPrintable(file));
+            return false;
+        }
+
+        MetadataColumns segment;
+        stream >> segment.names >> size;
+        for (quint32 i=0; i<size; i++) {
+            Column column;
+            qint32 storage, type;
+            stream >> column.key >> storage >> type >> column.present;
+            column.storage = Column::Storage(storage);
+            column.type = type;
+            switch (column.storage) {
+              case Column::Integer: stream >> column.integers; break;
+              case Column::Real:    stream >> column.reals;    break;
+              case Column::String:  stream >> column.dictionary >> column.codes; break;
+              case Column::Variant: stream >> column.variants; break;
+            }
+            segment.columns.append(column);
+        }
+        if (stream.status() != QDataStream::Ok)
+            return false;
+
+        if (names.isEmpty() && columns.isEmpty()) *this = segment;
+        else                                      append(segment);
+    }
+    return true;
+}
+
+QString MetadataColumns::companion(const QString &gallery)
+{
+    const File file(gallery);
+    const QFileInfo info(file.name);
+    if (info.suffix() == "col")
+        return info.exists() ? file.name : QString();
+
+    // A stale companion, or one that can't honor the gallery's arguments, would silently change the results
+    if (!Globals->file.getBool("useColumns") || !file.localKeys().isEmpty() || !info.exists())
+        return QString();
+    const QFileInfo companion(info.path() + "/" + info.completeBaseName() + ".col");
+    if (!companion.exists() || (companion.lastModified() <= info.lastModified()))
+        return QString();
+    return companion.filePath();
+}
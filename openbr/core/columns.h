@@ -0,0 +1,84 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_COLUMNS_H
+#define BR_COLUMNS_H
+
+#include <QHash>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Gallery metadata stored one typed column per key.
+ *
+ * Integer, boolean and floating point values are stored as flat arrays and strings are dictionary
+ * encoded, so that scanning one key across every template touches only that key's data.
+ * Keys whose values have mixed or complex types fall back to a column of QVariants.
+ */
+class BR_EXPORT MetadataColumns
+{
+public:
+    struct Column
+    {
+        enum Storage { Integer, Real, String, Variant };
+
+        QString key;
+        Storage storage;
+        int type; // QMetaType of the values, or QMetaType::QVariant for mixed columns
+        QByteArray present; // One byte per row, non-zero where the key is set
+        QVector<qint64> integers;
+        QVector<double> reals;
+        QVector<qint32> codes; // Index into dictionary
+        QStringList dictionary;
+        QVariantList variants;
+
+        QVariant value(int row) const;
+        QString string(int row) const;
+    };
+
+    QStringList names;
+    QList<Column> columns;
+
+    int rows() const { return names.size(); }
+    QStringList keys() const;
+    const Column *column(const QString &key) const;
+
+    static MetadataColumns fromFiles(const FileList &files);
+    void append(const MetadataColumns &other);
+    File file(int row) const;
+    FileList files(const QVector<int> &rows) const;
+
+    // Rows whose value for every filtered key is one of that key's values, as in Globals->filters
+    QVector<int> select(const QHash<QString, QStringList> &filters) const;
+
+    // A file holds one or more segments, each written by a call to write, that read concatenates
+    void write(const QString &file, bool append = false) const;
+    bool read(const QString &file);
+
+    // The columnar companion of a gallery, the same path with the suffix col, if the global useColumns is set,
+    // the gallery has no arguments, and the companion was written after the gallery
+    static QString companion(const QString &gallery);
+};
+
+} // namespace br
+
+#endif // BR_COLUMNS_H
@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureInterface>
+#include <QtConcurrent>
+#include <QWaitCondition>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
@@ -21,6 +24,69 @@
 #include "qtutils.h"
 #include "../plugins/openbr_internal.h"
 
+using namespace br;
+
+static TemplateList readGalleryBlock(Gallery *gallery, bool *done)
+{
+    return gallery->readBlock(done);
+}
+
+// Writes each block while the next one is read, holding at most two blocks in memory
+static void streamGallery(Gallery *input, Gallery *output)
+{
+    bool done = false;
+    QFuture<TemplateList> block = QtConcurrent::run(readGalleryBlock, input, &done);
+    while (true) {
+        const TemplateList templates = block.result();
+        const bool last = done;
+        if (!last)
+            block = QtConcurrent::run(readGalleryBlock, input, &done);
+        output->writeBlock(templates);
+        if (last)
+            break;
+    }
+}
+
+static QByteArray readChunk(QFile *file)
+{
+    return file->read(1 << 24);
+}
+
+// Galleries whose files are a plain sequence of records, so that copying or concatenating the bytes is a valid gallery
+static bool rawCopyable(const File &input, const File &output)
+{
+    const QStringList devices = QStringList() << "stdin" << "stdout" << "stderr";
+    return (input.suffix() == "gal") && (output.suffix() == "gal")
+           && input.localKeys().isEmpty() && output.localKeys().isEmpty()
+           && !devices.contains(input.baseName()) && !devices.contains(output.baseName());
+}
+
+// Appends the bytes of input to output, reading the next chunk while the current one is written
+static void appendBytes(const QString &input, QFile &output)
+{
+    QFile file(input);
+    if (!file.open(QFile::ReadOnly))
+        qFatal("Can't open gallery: %s for reading", qPrintable(input));
+
+    QFuture<QByteArray> chunk = QtConcurrent::run(readChunk, &file);
+    while (true) {
+        const QByteArray bytes = chunk.result();
+        if (bytes.isEmpty())
+            break;
+        chunk = QtConcurrent::run(readChunk, &file);
+        if (output.write(bytes) != bytes.size())
+            qFatal("Failed to write %s.", qPrintable(output.fileName()));
+    }
+}
+
+static void openForWriting(QFile &file, const QString &name)
+{
+    file.setFileName(name);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Can't open gallery: %s for writing", qPrintable(name));
+}
+
 namespace br {
 
 void noDelete(Transform *target)
@@ -115,6 +181,12 @@ struct AlgorithmCore
         if (transform.isNull())
             return;
 
+        // A compiled plan flattens the transform tree in place of simplify(). Time varying transforms keep their tree.
+        if (Globals->file.getBool("compile", false) && !transform->timeVarying()) {
+            simplifiedTransform = QSharedPointer<Transform>(wrapTransform(transform.data(), "Compiled"));
+            return;
+        }
+
         bool newTForm = false;
         Transform *temp = transform->simplify(newTForm);
         if (newTForm)
@@ -312,10 +384,10 @@ struct AlgorithmCore
         realOutput->set_blockRows(INT_MAX);
         realOutput->set_blockCols(INT_MAX);
         realOutput->setBlock(0,0);
-        for (int i=0; i < queries.length(); i++) {
-            float res = distance->compare(queries[i], targets[i]);
-            realOutput->setRelative(res, 0,i);
-        }
+        QVector<float> scores(queries.length());
+        for (int i=0; i < queries.length(); i++)
+            scores[i] = distance->compare(queries[i], targets[i]);
+        realOutput->setRelativeRow(scores.constData(), NULL, 0, 0, scores.size());
     }
 
     void deduplicate(const File &inputGallery, const File &outputGallery, const float threshold)
@@ -447,9 +519,8 @@ struct AlgorithmCore
             // type conversion for it.
             else {
                 QScopedPointer<Gallery> readColGallery(Gallery::make(colGallery));
-                TemplateList templates = readColGallery->read();
                 QScopedPointer<Gallery> enrolledColOutput(Gallery::make(colEnrolledGallery));
-                enrolledColOutput->writeBlock(templates);
+                streamGallery(readColGallery.data(), enrolledColOutput.data());
             }
         }
 
@@ -602,8 +673,6 @@ private:
 
 } // namespace br
 
-using namespace br;
-
 class AlgorithmManager : public Initializer
 {
     Q_OBJECT
@@ -642,6 +711,181 @@ QMutex AlgorithmManager::algorithmsLock;
 
 BR_REGISTER(Initializer, AlgorithmManager)
 
+// Coalesces concurrent EnrollAsync() submissions against one algorithm into
+// batches, so that callers submitting a handful of templates at a time still
+// get the parallelism of enrolling a full block.
+class EnrollQueue : public QThread
+{
+    struct Request
+    {
+        TemplateList templates;
+        QFutureInterface<TemplateList> future;
+        EnrollCallback callback;
+        void *context;
+    };
+
+    QString algorithm;
+    int batchSize, maxLatency;
+
+    QMutex queueLock;
+    QWaitCondition submitted, drained;
+    QList<Request *> queue;
+    int queuedTemplates;
+    bool busy, stopping;
+
+public:
+    EnrollQueue(const QString &algorithm)
+        : algorithm(algorithm), queuedTemplates(0), busy(false), stopping(false)
+    {
+        batchSize = Globals->file.get<int>("enrollBatchSize", 16 * Globals->parallelism);
+        maxLatency = Globals->file.get<int>("enrollBatchLatency", 5);
+        start();
+    }
+
+    ~EnrollQueue()
+    {
+        queueLock.lock();
+        stopping = true;
+        submitted.wakeAll();
+        queueLock.unlock();
+        wait();
+    }
+
+    QFuture<TemplateList> submit(const TemplateList &templates, EnrollCallback callback, void *context)
+    {
+        Request *request = new Request();
+        request->templates = templates;
+        request->callback = callback;
+        request->context = context;
+        request->future.reportStarted();
+        const QFuture<TemplateList> future = request->future.future();
+
+        QMutexLocker locker(&queueLock);
+        queue.append(request);
+        queuedTemplates += templates.size();
+        submitted.wakeAll();
+        return future;
+    }
+
+    void waitForDrained()
+    {
+        QMutexLocker locker(&queueLock);
+        while (busy || !queue.isEmpty())
+            drained.wait(&queueLock);
+    }
+
+protected:
+    void run()
+    {
+        forever {
+            QMutexLocker locker(&queueLock);
+            while (queue.isEmpty() && !stopping)
+                submitted.wait(&queueLock);
+            if (queue.isEmpty())
+                return;
+
+            // Give concurrent submitters a short window to fill the batch
+            QElapsedTimer timer;
+            timer.start();
+            while ((queuedTemplates < batchSize) && !stopping && (timer.elapsed() < maxLatency))
+                submitted.wait(&queueLock, maxLatency - timer.elapsed());
+
+            QList<Request *> batch;
+            int batchTemplates = 0;
+            while (!queue.isEmpty() && (batch.isEmpty() || (batchTemplates + queue.first()->templates.size() <= batchSize))) {
+                batchTemplates += queue.first()->templates.size();
+                batch.append(queue.takeFirst());
+            }
+            queuedTemplates -= batchTemplates;
+            busy = true;
+            locker.unlock();
+
+            process(batch);
+
+            locker.relock();
+            busy = false;
+            if (queue.isEmpty())
+                drained.wakeAll();
+        }
+    }
+
+private:
+    void process(const QList<Request *> &batch)
+    {
+        // Tag each template with its request so results can be routed back
+        // even if the algorithm expands or drops templates
+        TemplateList data;
+        for (int i=0; i<batch.size(); i++)
+            foreach (const Template &t, batch[i]->templates) {
+                data.append(t);
+                data.last().file.set("EnrollQueueIndex", i);
+            }
+
+        if (!data.isEmpty())
+            AlgorithmManager::getAlgorithm(algorithm)->enroll(data);
+
+        QVector<TemplateList> results(batch.size());
+        for (int i=0; i<data.size(); i++) {
+            const int index = data[i].file.get<int>("EnrollQueueIndex", -1);
+            if ((index < 0) || (index >= batch.size()))
+                continue;
+            data[i].file.remove("EnrollQueueIndex");
+            results[index].append(data[i]);
+        }
+
+        for (int i=0; i<batch.size(); i++) {
+            Request *request = batch[i];
+            if (request->callback)
+                request->callback(results[i], request->context);
+            request->future.reportResult(results[i]);
+            request->future.reportFinished();
+            delete request;
+        }
+    }
+};
+
+class EnrollQueueManager : public Initializer
+{
+    Q_OBJECT
+
+public:
+    static QHash<QString, QSharedPointer<EnrollQueue> > queues;
+    static QMutex queuesLock;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&queuesLock);
+        queues.clear();
+    }
+
+    static QSharedPointer<EnrollQueue> getQueue(const QString &algorithm)
+    {
+        // Construct the algorithm outside the lock, it may be recursive
+        AlgorithmManager::getAlgorithm(algorithm);
+
+        QMutexLocker locker(&queuesLock);
+        if (!queues.contains(algorithm))
+            queues.insert(algorithm, QSharedPointer<EnrollQueue>(new EnrollQueue(algorithm)));
+        return queues[algorithm];
+    }
+
+    static void waitForAll()
+    {
+        queuesLock.lock();
+        const QList<QSharedPointer<EnrollQueue> > all = queues.values();
+        queuesLock.unlock();
+        foreach (const QSharedPointer<EnrollQueue> &queue, all)
+            queue->waitForDrained();
+    }
+};
+
+QHash<QString, QSharedPointer<EnrollQueue> > EnrollQueueManager::queues;
+QMutex EnrollQueueManager::queuesLock;
+
+BR_REGISTER(Initializer, EnrollQueueManager)
+
 bool br::IsClassifier(const QString &algorithm)
 {
     qDebug("Checking if %s is a classifier", qPrintable(algorithm));
@@ -669,6 +913,17 @@ void br::Enroll(TemplateList &tl)
     AlgorithmManager::getAlgorithm(alg)->enroll(tl);
 }
 
+QFuture<TemplateList> br::EnrollAsync(const TemplateList &tl, EnrollCallback callback, void *context)
+{
+    const QString alg = tl.isEmpty() ? Globals->algorithm : tl.first().file.get<QString>("algorithm");
+    return EnrollQueueManager::getQueue(alg)->submit(tl, callback, context);
+}
+
+void br::EnrollAsyncWait()
+{
+    EnrollQueueManager::waitForAll();
+}
+
 void br::Compare(const File &targetGallery, const File &queryGallery, const File &output)
 {
     AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->compare(targetGallery, queryGallery, output);
@@ -695,10 +950,16 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
         QScopedPointer<Format> after(Factory<Format>::make(outputFile));
         after->write(before->read());
     } else if (fileType == "Gallery") {
+        if (rawCopyable(inputFile, outputFile) && (inputFile.name != outputFile.name)) {
+            QFile output;
+            openForWriting(output, outputFile.name);
+            appendBytes(inputFile.name, output);
+            return;
+        }
+
         QScopedPointer<Gallery> before(Gallery::make(inputFile));
         QScopedPointer<Gallery> after(Gallery::make(outputFile));
-        bool done = false;
-        while (!done) after->writeBlock(before->readBlock(&done));
+        streamGallery(before.data(), after.data());
     } else if (fileType == "Output") {
         QString target, query;
         cv::Mat m = BEE::readMatrix(inputFile, &target, &query);
@@ -720,9 +981,7 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
         }
 
         o->setBlock(0,0);
-        for (int i=0; i < m.rows; i++)
-            for (int j=0; j < m.cols; j++)
-                o->setRelative(m.at<float>(i,j), i, j);
+        o->setRelativeTile(m, cv::Mat(), 0, 0);
     } else {
         qFatal("Unrecognized file type %s.", qPrintable(fileType.flat()));
     }
@@ -734,11 +993,22 @@ void br::Cat(const QStringList &inputGalleries, const QString &outputGallery)
     foreach (const QString &inputGallery, inputGalleries)
         if (inputGallery == outputGallery)
             qFatal("outputGallery must not be in inputGalleries.");
+
+    bool raw = true;
+    foreach (const QString &inputGallery, inputGalleries)
+        raw = raw && rawCopyable(inputGallery, outputGallery);
+    if (raw) {
+        QFile output;
+        openForWriting(output, outputGallery);
+        foreach (const QString &inputGallery, inputGalleries)
+            appendBytes(inputGallery, output);
+        return;
+    }
+
     QScopedPointer<Gallery> og(Gallery::make(outputGallery));
     foreach (const QString &inputGallery, inputGalleries) {
         QScopedPointer<Gallery> ig(Gallery::make(inputGallery));
-        bool done = false;
-        while (!done) og->writeBlock(ig->readBlock(&done));
+        streamGallery(ig.data(), og.data());
     }
 }
 
@@ -18,6 +18,9 @@
 #define DISTANCE_SSE_H
 
 #include <QDebug>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 
 #ifdef __SSE__
 
@@ -72,4 +75,176 @@ inline float packed_l1(const uchar *a, const uchar *b, int size)
     return distance;
 }
 
+// Float kernels, each vectorized over four lanes with a scalar tail.
+// Like compareHist, they accumulate in double so long vectors don't lose precision.
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+// The four lanes of v as two pairs of doubles
+inline void to_double(__m128 v, __m128d &low, __m128d &high)
+{
+    low = _mm_cvtps_pd(v);
+    high = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+}
+
+inline double horizontal_sum(__m128d low, __m128d high)
+{
+    double buff[2];
+    _mm_storeu_pd(buff, _mm_add_pd(low, high));
+    return buff[0] + buff[1];
+}
+
+#endif
+
+inline double float_sum(const float *a, int size)
+{
+    int i = 0;
+    double result = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d A0, A1;
+        to_double(_mm_loadu_ps(a+i), A0, A1);
+        low = _mm_add_pd(low, A0);
+        high = _mm_add_pd(high, A1);
+    }
+    result = horizontal_sum(low, high);
+#endif
+    for (; i<size; i++)
+        result += a[i];
+    return result;
+}
+
+inline double float_dot(const float *a, const float *b, int size)
+{
+    int i = 0;
+    double result = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d A0, A1, B0, B1;
+        to_double(_mm_loadu_ps(a+i), A0, A1);
+        to_double(_mm_loadu_ps(b+i), B0, B1);
+        low = _mm_add_pd(low, _mm_mul_pd(A0, B0));
+        high = _mm_add_pd(high, _mm_mul_pd(A1, B1));
+    }
+    result = horizontal_sum(low, high);
+#endif
+    for (; i<size; i++)
+        result += double(a[i]) * b[i];
+    return result;
+}
+
+// Dot product and both squared norms in one pass
+inline double float_dot_norms(const float *a, const float *b, int size, double *aa, double *bb)
+{
+    int i = 0;
+    double ab = 0;
+    *aa = *bb = 0;
+#ifdef __SSE2__
+    __m128d lowAB = _mm_setzero_pd(), highAB = _mm_setzero_pd();
+    __m128d lowAA = _mm_setzero_pd(), highAA = _mm_setzero_pd();
+    __m128d lowBB = _mm_setzero_pd(), highBB = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d A0, A1, B0, B1;
+        to_double(_mm_loadu_ps(a+i), A0, A1);
+        to_double(_mm_loadu_ps(b+i), B0, B1);
+        lowAB = _mm_add_pd(lowAB, _mm_mul_pd(A0, B0));
+        highAB = _mm_add_pd(highAB, _mm_mul_pd(A1, B1));
+        lowAA = _mm_add_pd(lowAA, _mm_mul_pd(A0, A0));
+        highAA = _mm_add_pd(highAA, _mm_mul_pd(A1, A1));
+        lowBB = _mm_add_pd(lowBB, _mm_mul_pd(B0, B0));
+        highBB = _mm_add_pd(highBB, _mm_mul_pd(B1, B1));
+    }
+    ab = horizontal_sum(lowAB, highAB);
+    *aa = horizontal_sum(lowAA, highAA);
+    *bb = horizontal_sum(lowBB, highBB);
+#endif
+    for (; i<size; i++) {
+        ab += double(a[i]) * b[i];
+        *aa += double(a[i]) * a[i];
+        *bb += double(b[i]) * b[i];
+    }
+    return ab;
+}
+
+#ifdef __SSE2__
+
+// Sum over the lanes where |a| > DBL_EPSILON of (a - b)^2 / a
+inline __m128d chi_squared_terms(__m128d A, __m128d B)
+{
+    const __m128d sign = _mm_set1_pd(-0.), epsilon = _mm_set1_pd(DBL_EPSILON);
+    const __m128d difference = _mm_sub_pd(A, B);
+    const __m128d term = _mm_div_pd(_mm_mul_pd(difference, difference), A);
+    return _mm_and_pd(_mm_cmpgt_pd(_mm_andnot_pd(sign, A), epsilon), term);
+}
+
+#endif
+
+// Same as compareHist(HISTCMP_CHISQR), bins where a is zero are skipped
+inline double float_chi_squared(const float *a, const float *b, int size)
+{
+    int i = 0;
+    double result = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d A0, A1, B0, B1;
+        to_double(_mm_loadu_ps(a+i), A0, A1);
+        to_double(_mm_loadu_ps(b+i), B0, B1);
+        low = _mm_add_pd(low, chi_squared_terms(A0, B0));
+        high = _mm_add_pd(high, chi_squared_terms(A1, B1));
+    }
+    result = horizontal_sum(low, high);
+#endif
+    for (; i<size; i++)
+        if (fabs(a[i]) > DBL_EPSILON) {
+            const double difference = double(a[i]) - b[i];
+            result += difference * difference / a[i];
+        }
+    return result;
+}
+
+inline double float_intersection(const float *a, const float *b, int size)
+{
+    int i = 0;
+    double result = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d M0, M1;
+        to_double(_mm_min_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)), M0, M1);
+        low = _mm_add_pd(low, M0);
+        high = _mm_add_pd(high, M1);
+    }
+    result = horizontal_sum(low, high);
+#endif
+    for (; i<size; i++)
+        result += std::min(a[i], b[i]);
+    return result;
+}
+
+// Sum of sqrt(a*b), the Bhattacharyya coefficient of unnormalized histograms
+inline double float_sqrt_dot(const float *a, const float *b, int size)
+{
+    int i = 0;
+    double result = 0;
+#ifdef __SSE2__
+    __m128d low = _mm_setzero_pd(), high = _mm_setzero_pd();
+    for (; i+4<=size; i+=4) {
+        __m128d A0, A1, B0, B1;
+        to_double(_mm_loadu_ps(a+i), A0, A1);
+        to_double(_mm_loadu_ps(b+i), B0, B1);
+        low = _mm_add_pd(low, _mm_sqrt_pd(_mm_mul_pd(A0, B0)));
+        high = _mm_add_pd(high, _mm_sqrt_pd(_mm_mul_pd(A1, B1)));
+    }
+    result = horizontal_sum(low, high);
+#endif
+    for (; i<size; i++)
+        result += sqrt(double(a[i]) * b[i]);
+    return result;
+}
+
 #endif // DISTANCE_SSE_H
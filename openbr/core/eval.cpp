@@ -16,6 +16,7 @@
 
 #include "bee.h"
 #include "eval.h"
+#include "openbr/core/columns.h"
 #include "openbr/core/common.h"
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
@@ -745,6 +746,31 @@ float InplaceEval(const QString &simmat, const QString &mask, const QString &csv
     return result;
 }
 
+// Names and the requested keys of a gallery, from its columnar companion when one exists
+static TemplateList metadataFromGallery(const QString &gallery, const QStringList &keys)
+{
+    MetadataColumns columns;
+    const QString companion = MetadataColumns::companion(gallery);
+    if (companion.isEmpty() || !columns.read(companion))
+        return TemplateList::fromGallery(gallery);
+
+    QList<const MetadataColumns::Column*> selected;
+    foreach (const QString &key, keys)
+        if (const MetadataColumns::Column *column = columns.column(key))
+            selected.append(column);
+
+    TemplateList templates;
+    templates.reserve(columns.rows());
+    for (int i=0; i<columns.rows(); i++) {
+        File file(columns.names[i]);
+        foreach (const MetadataColumns::Column *column, selected)
+            if (column->present[i])
+                file.set(column->key, column->value(i));
+        templates.append(file);
+    }
+    return templates;
+}
+
 void EvalClassification(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty, QString truthProperty)
 {
     qDebug("Evaluating classification of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
@@ -759,8 +785,8 @@ void EvalClassification(const QString &predictedGallery, const QString &truthGal
     if (truthProperty.isEmpty())
         truthProperty = "Label";
 
-    TemplateList predicted(TemplateList::fromGallery(predictedGallery));
-    TemplateList truth(TemplateList::fromGallery(truthGallery));
+    TemplateList predicted(metadataFromGallery(predictedGallery, QStringList() << predictedProperty));
+    TemplateList truth(metadataFromGallery(truthGallery, QStringList() << truthProperty));
     if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
 
     QHash<QString, Counter> counters;
@@ -1295,11 +1321,11 @@ void EvalRegression(const QString &predictedGallery, const QString &truthGallery
     if (truthProperty.isEmpty())
         predictedProperty = "Regressand";
 
-    const TemplateList predicted(TemplateList::fromGallery(predictedGallery));
+    const TemplateList predicted(metadataFromGallery(predictedGallery, QStringList() << predictedProperty << truthProperty));
     if (predictedGallery == truthGallery) {
         EvalRegression(predicted, predicted, predictedProperty, truthProperty, generatePlot);
     } else {
-        const TemplateList truth = TemplateList::fromGallery(truthGallery);
+        const TemplateList truth = metadataFromGallery(truthGallery, QStringList() << truthProperty);
         if (predicted.size() != truth.size()) qFatal("Input size mismatch.");
         EvalRegression(predicted, truth, predictedProperty, truthProperty, generatePlot);
     }
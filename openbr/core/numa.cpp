@@ -0,0 +1,142 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QStringList>
+#include <QThreadStorage>
+#include <QtGlobal>
+#include <algorithm>
+
+#ifdef Q_OS_LINUX
+#include <sched.h>
+#endif
+
+#include "numa.h"
+
+namespace
+{
+
+struct Topology
+{
+    QList< QList<int> > cpus;
+
+    Topology()
+    {
+        const QDir dir("/sys/devices/system/node");
+        foreach (const QString &entry, dir.entryList(QStringList() << "node*", QDir::Dirs)) {
+            bool ok;
+            const int node = entry.mid(4).toInt(&ok);
+            if (!ok) continue;
+
+            QFile file(dir.absoluteFilePath(entry + "/cpulist"));
+            if (!file.open(QFile::ReadOnly)) continue;
+
+            // cpulist is a comma separated list of ranges, e.g. "0-7,16-23"
+            QList<int> list;
+            foreach (const QString &range, QString(file.readAll()).trimmed().split(',', QString::SkipEmptyParts)) {
+                const QStringList bounds = range.split('-');
+                const int first = bounds.first().toInt(), last = bounds.last().toInt();
+                for (int cpu=first; cpu<=last; cpu++)
+                    list.append(cpu);
+            }
+
+            while (cpus.size() <= node)
+                cpus.append(QList<int>());
+            cpus[node] = list;
+        }
+
+        // Drop memory-only nodes so every node index can run threads
+        for (int i=cpus.size()-1; i>=0; i--)
+            if (cpus[i].isEmpty())
+                cpus.removeAt(i);
+    }
+};
+
+const Topology &topology()
+{
+    static const Topology topology;
+    return topology;
+}
+
+// Node the calling thread is bound to, offset by one so the default-constructed value means unbound
+QThreadStorage<int> boundNode;
+QAtomicInt nextNode;
+
+} // namespace
+
+int NUMA::nodes()
+{
+    return std::max(topology().cpus.size(), 1);
+}
+
+QList<int> NUMA::cpus(int node)
+{
+    if (node < 0 || node >= topology().cpus.size())
+        return QList<int>();
+    return topology().cpus[node];
+}
+
+int NUMA::currentNode()
+{
+#ifdef Q_OS_LINUX
+    const int cpu = sched_getcpu();
+    for (int i=0; i<topology().cpus.size(); i++)
+        if (topology().cpus[i].contains(cpu))
+            return i;
+#endif
+    return 0;
+}
+
+bool NUMA::bind(int node)
+{
+    if (boundNode.hasLocalData() && boundNode.localData() == node + 1)
+        return true;
+
+#ifdef Q_OS_LINUX
+    const QList<int> nodeCpus = cpus(node);
+    if (nodeCpus.isEmpty())
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    foreach (int cpu, nodeCpus)
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        qWarning("Failed to bind thread to NUMA node %d.", node);
+        return false;
+    }
+
+    boundNode.setLocalData(node + 1);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int NUMA::bindNext()
+{
+    if (boundNode.hasLocalData() && boundNode.localData() > 0)
+        return boundNode.localData() - 1;
+
+    // Remember the assignment even if binding is unsupported so threads keep a stable node
+    const int node = nextNode.fetchAndAddRelaxed(1) % nodes();
+    bind(node);
+    boundNode.setLocalData(node + 1);
+    return node;
+}
@@ -0,0 +1,47 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_NUMA_H
+#define BR_NUMA_H
+
+#include <QList>
+
+#include <openbr/openbr_export.h>
+
+/*!
+ * NUMA topology and thread placement.
+ *
+ * The topology is read once from /sys/devices/system/node. Memory placement relies on the
+ * kernel's default first-touch policy: data allocated and written by a thread bound to a node
+ * is backed by that node's memory. On platforms without the sysfs topology every function
+ * behaves as if there were a single node and binding is a no-op.
+ */
+namespace NUMA
+{
+    BR_EXPORT int nodes(); // Number of memory nodes, at least 1
+    BR_EXPORT QList<int> cpus(int node); // Logical CPUs attached to a node
+    BR_EXPORT int currentNode(); // Node of the CPU the calling thread is running on
+
+    // Restrict the calling thread to the CPUs of a node, returns false if binding is unsupported or fails.
+    // Repeated calls from a thread already bound to the node are free.
+    BR_EXPORT bool bind(int node);
+
+    // Bind the calling thread to the next node in round-robin order, unless it is already bound.
+    // Returns the node the thread is bound to.
+    BR_EXPORT int bindNext();
+}
+
+#endif // BR_NUMA_H
@@ -25,6 +25,8 @@
 #include "common.h"
 
 #include <QTemporaryFile>
+#include <functional>
+#include <queue>
 
 using namespace cv;
 using namespace std;
@@ -113,6 +115,78 @@ void OpenCVUtils::cvtUChar(const Mat &src, Mat &dst)
     }
 }
 
+// Image dimensions from a PNG IHDR chunk or JPEG start of frame segment, or an empty size if neither is found
+static Size encodedSize(const uchar *data, size_t length)
+{
+    static const uchar png[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if ((length >= 24) && !memcmp(data, png, 8))
+        return Size((data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19],
+                    (data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23]);
+
+    if ((length < 4) || (data[0] != 0xFF) || (data[1] != 0xD8))
+        return Size();
+
+    size_t i = 2;
+    while (i + 8 < length) {
+        if (data[i] != 0xFF) return Size();
+        const uchar marker = data[i+1];
+        if ((marker == 0xFF) || (marker == 0x01) || ((marker >= 0xD0) && (marker <= 0xD8))) {
+            // Fill bytes and markers without a payload
+            i += (marker == 0xFF) ? 1 : 2;
+            continue;
+        }
+        if ((marker >= 0xC0) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8) && (marker != 0xCC))
+            return Size((data[i+7] << 8) | data[i+8], (data[i+5] << 8) | data[i+6]);
+        i += 2 + ((data[i+2] << 8) | data[i+3]);
+    }
+    return Size();
+}
+
+int OpenCVUtils::decodeReduction(const Mat &encoded, int minShortSide, int minLongSide)
+{
+    if ((minShortSide <= 0) && (minLongSide <= 0))
+        return 1;
+
+    const Size size = encodedSize(encoded.ptr<uchar>(), encoded.total() * encoded.elemSize());
+    if (size.area() <= 0)
+        return 1;
+
+    const int shortSide = std::min(size.width, size.height);
+    const int longSide = std::max(size.width, size.height);
+    for (int reduction = 8; reduction > 1; reduction /= 2)
+        if ((shortSide / reduction >= minShortSide) && (longSide / reduction >= minLongSide))
+            return reduction;
+    return 1;
+}
+
+Mat OpenCVUtils::decode(const Mat &encoded, int flags, int minShortSide, int minLongSide)
+{
+    // IMREAD_REDUCED_COLOR_N is IMREAD_REDUCED_GRAYSCALE_N | IMREAD_COLOR
+    if ((flags == IMREAD_COLOR) || (flags == IMREAD_GRAYSCALE)) {
+        switch (decodeReduction(encoded, minShortSide, minLongSide)) {
+          case 2: flags |= IMREAD_REDUCED_GRAYSCALE_2; break;
+          case 4: flags |= IMREAD_REDUCED_GRAYSCALE_4; break;
+          case 8: flags |= IMREAD_REDUCED_GRAYSCALE_8; break;
+          default: break;
+        }
+    }
+    return imdecode(encoded, flags);
+}
+
+Mat OpenCVUtils::read(const QString &file, int flags, int minShortSide, int minLongSide)
+{
+    if (((minShortSide <= 0) && (minLongSide <= 0)) || ((flags != IMREAD_COLOR) && (flags != IMREAD_GRAYSCALE)))
+        return imread(file.toStdString(), flags);
+
+    QFile f(file);
+    if (!f.open(QFile::ReadOnly))
+        return Mat();
+    QByteArray data = f.readAll();
+    if (data.isEmpty())
+        return Mat();
+    return decode(Mat(1, data.size(), CV_8UC1, data.data()), flags, minShortSide, minLongSide);
+}
+
 Mat OpenCVUtils::toMat(const QList<float> &src, int rows)
 {
     if (rows == -1) rows = src.size();
@@ -429,12 +503,61 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
     return false;
 }
 
-// class for grouping object candidates, detected by Cascade Classifier, HOG etc.
-// instance of the class is to be passed to cv::partition (see cxoperations.hpp)
+// Rectangles in the same bucket of a spatial hash are sorted together, so each bucket is one
+// contiguous range of candidates
+class RectBuckets
+{
+    vector< pair<quint64,int> > entries;
+    QHash< quint64, QPair<int,int> > ranges;
+
+public:
+    RectBuckets(const QVector<quint64> &keys)
+    {
+        entries.reserve(keys.size());
+        for (int i=0; i<keys.size(); i++)
+            entries.push_back(pair<quint64,int>(keys[i], i));
+        std::sort(entries.begin(), entries.end());
+
+        for (int begin=0, end; begin<int(entries.size()); begin=end) {
+            for (end=begin+1; end<int(entries.size()) && entries[end].first == entries[begin].first; end++);
+            ranges.insert(entries[begin].first, QPair<int,int>(begin, end));
+        }
+    }
+
+    inline bool find(quint64 key, int &begin, int &end) const
+    {
+        QHash< quint64, QPair<int,int> >::const_iterator it = ranges.find(key);
+        if (it == ranges.end())
+            return false;
+        begin = it.value().first;
+        end = it.value().second;
+        return true;
+    }
+
+    inline int at(int position) const { return entries[position].second; }
+};
+
+// Wrapping bucket coordinates only puts unrelated rectangles in the same bucket, which costs a
+// comparison but never a result
+static inline quint64 bucketKey(int level0, int level1, int x, int y)
+{
+    return (quint64(level0 & 0xFFF) << 52) | (quint64(level1 & 0xFFF) << 40) | (quint64(x & 0xFFFFF) << 20) | quint64(y & 0xFFFFF);
+}
+
+// Buckets for the similarity test cv::groupRectangles uses. Similar rectangles have mean sides
+// (width+height)/2 within a factor of 1+2*epsilon of each other and origins within
+// epsilon*min(mean side) of each other, so they fall in neighbouring scale levels and, with
+// cells as large as that distance, in neighbouring cells.
 class SimilarRects
 {
+    double eps, logBase;
+
+    inline int level(const Rect &r) const { return cvFloor(log(max(0.5*(r.width + r.height), 1.0)) / logBase); }
+    inline double cell(int level) const { return max(1.0, eps * exp((level+1) * logBase)); }
+
 public:
-    SimilarRects(double _eps) : eps(_eps) {}
+    SimilarRects(double _eps) : eps(_eps), logBase(log(1.001 * (1 + 2*max(_eps, 0.01)))) {}
+
     inline bool operator()(const Rect& r1, const Rect& r2) const
     {
         double delta = eps*(std::min(r1.width, r2.width) + std::min(r1.height, r2.height))*0.5;
@@ -443,9 +566,163 @@ public:
             std::abs(r1.x + r1.width - r2.x - r2.width) <= delta &&
             std::abs(r1.y + r1.height - r2.y - r2.height) <= delta;
     }
-    double eps;
+
+    inline quint64 key(const Rect &r) const
+    {
+        const int l = level(r);
+        const double c = cell(l);
+        return bucketKey(l, 0, cvFloor(r.x / c), cvFloor(r.y / c));
+    }
+
+    // Keys of every bucket that may hold a rectangle similar to r, returns their count
+    inline int neighbors(const Rect &r, quint64 *keys) const
+    {
+        int count = 0;
+        const int l = level(r);
+        for (int dl=-1; dl<=1; dl++) {
+            const double c = cell(l + dl);
+            const int x = cvFloor(r.x / c), y = cvFloor(r.y / c);
+            for (int dy=-1; dy<=1; dy++)
+                for (int dx=-1; dx<=1; dx++)
+                    keys[count++] = bucketKey(l + dl, 0, x + dx, y + dy);
+        }
+        return count;
+    }
+};
+
+// Buckets for intersection over union tests. Rectangles overlapping by more than t have widths,
+// and heights, within a factor of 1/t of each other and origins closer than the larger of the
+// two, so they fall in neighbouring width and height levels and, with cells as large as any
+// rectangle two levels up, in neighbouring cells. Below t=0.01 the levels stop paying for
+// themselves and every rectangle shares one bucket.
+class OverlappingRects
+{
+    bool coarse;
+    double logBase;
+
+    inline int level(int side) const { return cvFloor(log(double(max(side, 1))) / logBase); }
+    inline double cell(int level) const { return exp((level+2) * logBase); }
+
+public:
+    OverlappingRects(float overlap) : coarse(overlap < 0.01f), logBase(log(1.001 / min(max(overlap, 0.01f), 0.99f))) {}
+
+    static inline float overlap(const Rect &r1, const Rect &r2)
+    {
+        const int intersection = (r1 & r2).area();
+        return intersection == 0 ? 0 : float(intersection) / (r1.area() + r2.area() - intersection);
+    }
+
+    inline quint64 key(const Rect &r) const
+    {
+        if (coarse)
+            return 0;
+        const int lw = level(r.width), lh = level(r.height);
+        return bucketKey(lw, lh, cvFloor(r.x / cell(lw)), cvFloor(r.y / cell(lh)));
+    }
+
+    // Keys of every bucket that may hold a rectangle overlapping r, returns their count
+    inline int neighbors(const Rect &r, quint64 *keys) const
+    {
+        if (coarse) {
+            keys[0] = 0;
+            return 1;
+        }
+
+        int count = 0;
+        const int lw = level(r.width), lh = level(r.height);
+        for (int dw=-1; dw<=1; dw++) {
+            const double cw = cell(lw + dw);
+            const int x = cvFloor(r.x / cw);
+            for (int dh=-1; dh<=1; dh++) {
+                const double ch = cell(lh + dh);
+                const int y = cvFloor(r.y / ch);
+                for (int dy=-1; dy<=1; dy++)
+                    for (int dx=-1; dx<=1; dx++)
+                        keys[count++] = bucketKey(lw + dw, lh + dh, x + dx, y + dy);
+            }
+        }
+        return count;
+    }
+};
+
+// Disjoint sets with path halving and union by size
+class RectSets
+{
+    QVector<int> parent, size;
+
+public:
+    RectSets(int n) : parent(n), size(n, 1)
+    {
+        for (int i=0; i<n; i++)
+            parent[i] = i;
+    }
+
+    inline int find(int i)
+    {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    inline void merge(int i, int j)
+    {
+        i = find(i); j = find(j);
+        if (i == j)
+            return;
+        if (size[i] < size[j])
+            std::swap(i, j);
+        parent[j] = i;
+        size[i] += size[j];
+    }
+
+    // Labels numbered by the first member of each set, as cv::partition numbers them
+    int labels(vector<int> &labels)
+    {
+        const int n = parent.size();
+        labels.resize(n);
+        QVector<int> rootLabel(n, -1);
+        int nClasses = 0;
+        for (int i=0; i<n; i++) {
+            const int root = find(i);
+            if (rootLabel[root] == -1)
+                rootLabel[root] = nClasses++;
+            labels[i] = rootLabel[root];
+        }
+        return nClasses;
+    }
 };
 
+// Equivalent to cv::partition with SimilarRects, comparing each rectangle only against those in
+// neighbouring buckets
+static int partitionRects(const QList<Rect> &rects, vector<int> &labels, float epsilon)
+{
+    const SimilarRects similar(epsilon);
+    QVector<quint64> keys(rects.size());
+    for (int i=0; i<rects.size(); i++)
+        keys[i] = similar.key(rects[i]);
+    const RectBuckets buckets(keys);
+
+    RectSets sets(rects.size());
+    quint64 neighbors[27];
+    for (int i=0; i<rects.size(); i++) {
+        const int count = similar.neighbors(rects[i], neighbors);
+        for (int k=0; k<count; k++) {
+            int begin, end;
+            if (!buckets.find(neighbors[k], begin, end))
+                continue;
+            for (int p=begin; p<end; p++) {
+                const int j = buckets.at(p);
+                if ((j > i) && similar(rects[i], rects[j]))
+                    sets.merge(i, j);
+            }
+        }
+    }
+
+    return sets.labels(labels);
+}
+
 // TODO: Make sure case where no confidences are inputted works.
 void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float confidenceThreshold, int minNeighbors, float epsilon, bool useMax, QList<int> *maxIndices)
 {
@@ -453,7 +730,7 @@ void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float con
         return;
 
     vector<int> labels;
-    int nClasses = cv::partition(rects.toVector().toStdVector(), labels, SimilarRects(epsilon));
+    int nClasses = partitionRects(rects, labels, epsilon);
 
     // Rect for each class (class meaning identity assigned by partition)
     vector<Rect> rrects(nClasses);
@@ -502,6 +779,13 @@ void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float con
     rects.clear();
     confidences.clear();
 
+    // Only classes with more neighbors can absorb a class below, so visit those first and stop
+    // at the first class without
+    vector< pair<int,int> > byNeighbors(nClasses);
+    for (int i = 0; i < nClasses; i++)
+        byNeighbors[i] = pair<int,int>(neighbors[i], i);
+    std::sort(byNeighbors.begin(), byNeighbors.end(), std::greater< pair<int,int> >());
+
     // Aggregate by comparing average rectangles against other average rectangles
     for (int i = 0; i < nClasses; i++)
     {
@@ -520,12 +804,11 @@ void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float con
             continue;
 
         // filter out small face rectangles inside large rectangles
-        int j;
-        for (j = 0; j < nClasses; j++)
+        int k;
+        for (k = 0; k < nClasses && byNeighbors[k].first > n1; k++)
         {
+            const int j = byNeighbors[k].second;
             const int n2 = neighbors[j];
-            if (j == i || n2 < minNeighbors)
-                continue;
 
             const Rect r2 = rrects[j];
 
@@ -543,7 +826,7 @@ void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float con
                break;
         }
 
-        if( j == nClasses )
+        if( k == nClasses || byNeighbors[k].first <= n1 )
         {
             rects.append(r1);
             confidences.append(w1);
@@ -553,6 +836,123 @@ void OpenCVUtils::group(QList<Rect> &rects, QList<float> &confidences, float con
     }
 }
 
+void OpenCVUtils::nonMaxSuppression(QList<Rect> &rects, QList<float> &confidences, float overlap, QList<int> *indices)
+{
+    // Most confident first, ties broken by input order
+    vector< pair<float,int> > order(rects.size());
+    for (int i=0; i<rects.size(); i++)
+        order[i] = pair<float,int>(confidences[i], -i);
+    std::sort(order.begin(), order.end(), std::greater< pair<float,int> >());
+
+    const OverlappingRects overlapping(overlap);
+    QHash< quint64, QList<int> > kept;
+    QList<Rect> keptRects;
+    QList<float> keptConfidences;
+    quint64 neighbors[81];
+    for (size_t o=0; o<order.size(); o++) {
+        const int i = -order[o].second;
+        const int count = overlapping.neighbors(rects[i], neighbors);
+        bool suppressed = false;
+        for (int k=0; k<count && !suppressed; k++) {
+            QHash< quint64, QList<int> >::const_iterator it = kept.find(neighbors[k]);
+            if (it == kept.end())
+                continue;
+            foreach (int j, it.value())
+                if (OverlappingRects::overlap(rects[i], rects[j]) > overlap) {
+                    suppressed = true;
+                    break;
+                }
+        }
+        if (suppressed)
+            continue;
+
+        kept[overlapping.key(rects[i])].append(i);
+        keptRects.append(rects[i]);
+        keptConfidences.append(confidences[i]);
+        if (indices)
+            indices->append(i);
+    }
+
+    rects = keptRects;
+    confidences = keptConfidences;
+}
+
+void OpenCVUtils::softNonMaxSuppression(QList<Rect> &rects, QList<float> &confidences, float overlap, float minConfidence, QList<int> *indices)
+{
+    const OverlappingRects overlapping(overlap);
+    QVector<quint64> keys(rects.size());
+    for (int i=0; i<rects.size(); i++)
+        keys[i] = overlapping.key(rects[i]);
+    const RectBuckets buckets(keys);
+
+    // Confidences only ever decay, so stale queue entries are skipped when they surface
+    QVector<float> scores = confidences.toVector();
+    QVector<bool> done(rects.size(), false);
+    std::priority_queue< pair<float,int> > queue;
+    for (int i=0; i<rects.size(); i++)
+        queue.push(pair<float,int>(scores[i], -i));
+
+    QList<Rect> keptRects;
+    QList<float> keptConfidences;
+    quint64 neighbors[81];
+    while (!queue.empty()) {
+        const pair<float,int> top = queue.top();
+        queue.pop();
+        const int i = -top.second;
+        if (done[i] || (top.first != scores[i]))
+            continue;
+        if (scores[i] < minConfidence)
+            break;
+
+        done[i] = true;
+        keptRects.append(rects[i]);
+        keptConfidences.append(scores[i]);
+        if (indices)
+            indices->append(i);
+
+        // Linear decay of the remaining candidates overlapping this one
+        const int count = overlapping.neighbors(rects[i], neighbors);
+        for (int k=0; k<count; k++) {
+            int begin, end;
+            if (!buckets.find(neighbors[k], begin, end))
+                continue;
+            for (int p=begin; p<end; p++) {
+                const int j = buckets.at(p);
+                if (done[j])
+                    continue;
+                const float o = OverlappingRects::overlap(rects[i], rects[j]);
+                if (o > overlap) {
+                    scores[j] *= 1 - o;
+                    queue.push(pair<float,int>(scores[j], -j));
+                }
+            }
+        }
+    }
+
+    rects = keptRects;
+    confidences = keptConfidences;
+}
+
+void OpenCVUtils::suppress(QList<Rect> &rects, QList<float> &confidences, Suppression method, float confidenceThreshold, int minNeighbors, float epsilon, float overlap)
+{
+    if (method == Group) {
+        group(rects, confidences, confidenceThreshold, minNeighbors, epsilon);
+        return;
+    }
+
+    if (method == Soft) {
+        softNonMaxSuppression(rects, confidences, overlap, confidenceThreshold);
+        return;
+    }
+
+    for (int i=rects.size()-1; i>=0; i--)
+        if (confidences[i] < confidenceThreshold) {
+            rects.removeAt(i);
+            confidences.removeAt(i);
+        }
+    nonMaxSuppression(rects, confidences, overlap);
+}
+
 void OpenCVUtils::pad(const br::Template &src, br::Template &dst, bool padMat, const QMarginsF &padding, bool padPoints, bool padRects, int border, int value)
 {
     // Padding is expected to be top, bottom, left, right
@@ -36,6 +36,14 @@ namespace OpenCVUtils
     void cvtGray(const cv::Mat &src, cv::Mat &dst);
     void cvtUChar(const cv::Mat &src, cv::Mat &dst);
 
+    // Decode image
+    // The reduction is the largest power of two, at most 8, that keeps the shorter side of an encoded JPEG or PNG
+    // at least minShortSide and its longer side at least minLongSide. It is 1 when there are no bounds or the size is unknown.
+    int decodeReduction(const cv::Mat &encoded, int minShortSide, int minLongSide);
+    // As imdecode/imread, but decode with IMREAD_REDUCED_* when flags is IMREAD_COLOR or IMREAD_GRAYSCALE and the bounds allow it
+    cv::Mat decode(const cv::Mat &encoded, int flags, int minShortSide = 0, int minLongSide = 0);
+    cv::Mat read(const QString &file, int flags, int minShortSide = 0, int minLongSide = 0);
+
     // To image
     cv::Mat toMat(const QList<float> &src, int rows = -1);
     cv::Mat toMat(const QList< QList<float> > &srcs, int rows = -1);
@@ -106,6 +114,14 @@ namespace OpenCVUtils
 
     // Misc
     void group(QList<cv::Rect> &rects, QList<float> &confidences, float confidenceThreshold, int minNeighbors, float epsilon, bool useMax=false, QList<int> *maxIndices=NULL);
+    void nonMaxSuppression(QList<cv::Rect> &rects, QList<float> &confidences, float overlap, QList<int> *indices=NULL);
+    void softNonMaxSuppression(QList<cv::Rect> &rects, QList<float> &confidences, float overlap, float minConfidence, QList<int> *indices=NULL);
+
+    // Detection grouping shared by the detection transforms: Group merges similar rectangles like
+    // cv::groupRectangles, Greedy keeps the most confident of any rectangles overlapping by more than
+    // 'overlap', and Soft decays the confidence of those instead of discarding them
+    enum Suppression { Group = 0, Greedy = 1, Soft = 2 };
+    BR_EXPORT void suppress(QList<cv::Rect> &rects, QList<float> &confidences, Suppression method, float confidenceThreshold, int minNeighbors, float epsilon, float overlap);
     void pad(const br::Template &src, br::Template &dst, bool padMat, const QMarginsF &padding, bool padPoints, bool padRects, int border=0, int value=0);
     void pad(const br::TemplateList &src, br::TemplateList &dst, bool padMat, const QMarginsF &padding, bool padPoints, bool padRects, int border=0, int value=0);
     QPointF rotatePoint(const QPointF &point, const cv::Mat &rotationMatrix);
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <algorithm>
+#include <cmath>
 #include <QCryptographicHash>
 #include <QDebug>
 #ifndef BR_EMBEDDED
@@ -114,6 +116,53 @@ void writeFile(const QString &file, const QByteArray &data, int compression)
     }
 }
 
+// Lookup table for the CRC-32 used by gzip
+struct CRC32Table
+{
+    quint32 entries[256];
+
+    CRC32Table()
+    {
+        for (quint32 i=0; i<256; i++) {
+            quint32 c = i;
+            for (int k=0; k<8; k++)
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            entries[i] = c;
+        }
+    }
+};
+
+static quint32 crc32(const QByteArray &data)
+{
+    static const CRC32Table table;
+    quint32 c = 0xFFFFFFFFu;
+    const uchar *p = (const uchar*) data.constData();
+    for (int i=0; i<data.size(); i++)
+        c = table.entries[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void appendLittleEndian(QByteArray &data, quint32 value)
+{
+    for (int i=0; i<4; i++)
+        data.append(char((value >> (8*i)) & 0xFF));
+}
+
+// A complete gzip member, so that consecutive calls can be written to one .gz file
+QByteArray gzip(const QByteArray &data, int compression)
+{
+    if (data.isEmpty())
+        return QByteArray();
+
+    // qCompress yields a 4 byte length and a zlib stream: a 2 byte header, the deflate data and a 4 byte adler32 checksum
+    const QByteArray zlib = qCompress(data, compression);
+    QByteArray member("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    member.append(zlib.constData() + 6, zlib.size() - 10);
+    appendLittleEndian(member, crc32(data));
+    appendLittleEndian(member, quint32(data.size()));
+    return member;
+}
+
 void copyFile(const QString &src, const QString &dst)
 {
     touchDir(QFileInfo(dst));
@@ -221,6 +270,70 @@ QStringList toStringList(const QList<float> &values)
     return result;
 }
 
+// Appends the same text as QString::number(value), formatting the common fixed-point case directly
+void appendNumber(QByteArray &text, float value)
+{
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10 };
+
+    const double magnitude = fabs(double(value));
+    if (value == 0 && !std::signbit(value)) {
+        text.append('0');
+        return;
+    }
+
+    if (!(magnitude >= 1e-4) || !(magnitude < 999999.5)) {
+        text.append(QByteArray::number(double(value)));
+        return;
+    }
+
+    // Six significant digits, scaled by an exactly representable power of ten
+    int exponent = std::min(5, std::max(-4, int(floor(log10(magnitude)))));
+    double scaled = magnitude * powers[5-exponent];
+    if (scaled < 1e5 && exponent > -4) scaled = magnitude * powers[5-(--exponent)];
+    else if (scaled >= 1e6 && exponent < 5) scaled = magnitude * powers[5-(++exponent)];
+
+    const double whole = floor(scaled);
+    const double fraction = scaled - whole;
+    if ((scaled < 1e5) || (scaled >= 1e6) || (fabs(fraction - 0.5) < 1e-6)) {
+        // Leave ties and anything outside the expected range to Qt's exact rounding
+        text.append(QByteArray::number(double(value)));
+        return;
+    }
+
+    int digits = int(whole) + (fraction > 0.5 ? 1 : 0);
+    if (digits == 1000000) {
+        digits = 100000;
+        exponent++;
+    }
+    if (exponent > 5) {
+        text.append(QByteArray::number(double(value)));
+        return;
+    }
+
+    char buffer[16];
+    for (int i=5; i>=0; i--) {
+        buffer[i] = char('0' + digits % 10);
+        digits /= 10;
+    }
+    int significant = 6;
+    while (significant > std::max(1, exponent+1) && buffer[significant-1] == '0')
+        significant--;
+
+    if (value < 0)
+        text.append('-');
+    if (exponent >= 0) {
+        text.append(buffer, exponent+1);
+        if (significant > exponent+1) {
+            text.append('.');
+            text.append(buffer + exponent + 1, significant - exponent - 1);
+        }
+    } else {
+        text.append("0.", 2);
+        text.append(QByteArray(-exponent-1, '0'));
+        text.append(buffer, significant);
+    }
+}
+
 QStringList toStringList(const std::vector<std::string> &string_list)
 {
     QStringList result;
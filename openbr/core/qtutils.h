@@ -44,6 +44,7 @@ namespace QtUtils
     void writeFile(const QString &file, const QStringList &lines);
     void writeFile(const QString &file, const QString &data);
     void writeFile(const QString &file, const QByteArray &data, int compression = 0);
+    QByteArray gzip(const QByteArray &data, int compression = -1);
     void copyFile(const QString &src, const QString &dst);
 
     /**** Directory Utilities ****/
@@ -61,6 +62,7 @@ namespace QtUtils
     float toFloat(const QString &string);
     QList<float> toFloats(const QStringList &strings);
     QStringList toStringList(const QList<float> &values);
+    void appendNumber(QByteArray &text, float value);
     QStringList toStringList(const std::vector<std::string> &string_list);
     QStringList toStringList(int num_strings, const char* strings[]);
     QString shortTextHash(QString string);
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <functional>
+
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
@@ -334,8 +336,18 @@ void br_slave_process(const char *baseName)
 
 br_template br_load_img(const char *data, int len)
 {
-    std::vector<char> buf(data, data+len);
-    cv::Mat img = cv::imdecode(cv::Mat(buf), cv::IMREAD_COLOR);
+    // Wrap the caller's buffer rather than copying it, imdecode only reads from it
+    const cv::Mat buf(1, len, CV_8UC1, const_cast<char*>(data));
+    cv::Mat img = cv::imdecode(buf, cv::IMREAD_COLOR);
+    Template *tmpl = new Template(img);
+    return (br_template)tmpl;
+}
+
+br_template br_load_raw_img(const unsigned char *data, int rows, int cols, int type, int stride)
+{
+    // No copy is made, the caller must keep data alive for the lifetime of the template
+    const size_t step = (stride > 0) ? size_t(stride) : size_t(cv::Mat::AUTO_STEP);
+    cv::Mat img(rows, cols, type, const_cast<unsigned char*>(data), step);
     Template *tmpl = new Template(img);
     return (br_template)tmpl;
 }
@@ -429,6 +441,38 @@ void br_enroll_template_list(br_template_list tl)
     Enroll(*realTL);
 }
 
+struct AsyncEnrollContext
+{
+    br_enroll_callback callback;
+    void *user_data;
+};
+
+static void asyncEnrollCallback(const TemplateList &enrolled, void *context)
+{
+    AsyncEnrollContext *asyncContext = reinterpret_cast<AsyncEnrollContext*>(context);
+    // Ownership of the enrolled list passes to the caller
+    asyncContext->callback((br_template_list)new TemplateList(enrolled), asyncContext->user_data);
+    delete asyncContext;
+}
+
+void br_enroll_template_list_async(br_template_list tl, br_enroll_callback callback, void *user_data)
+{
+    // The callback is the only way the enrolled templates reach the caller
+    if (!callback)
+        qFatal("br_enroll_template_list_async requires a callback.");
+
+    TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
+    AsyncEnrollContext *context = new AsyncEnrollContext();
+    context->callback = callback;
+    context->user_data = user_data;
+    EnrollAsync(*realTL, asyncEnrollCallback, context);
+}
+
+void br_enroll_async_wait()
+{
+    EnrollAsyncWait();
+}
+
 br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query)
 {
     TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
@@ -444,6 +488,55 @@ float br_get_matrix_output_at(br_matrix_output output, int row, int col)
     return matOut->data.at<float>(row, col);
 }
 
+int br_get_matrix_output_rows(br_matrix_output output)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    return matOut->data.rows;
+}
+
+int br_get_matrix_output_cols(br_matrix_output output)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    return matOut->data.cols;
+}
+
+int br_get_matrix_output(br_matrix_output output, float *buffer, int buffer_length)
+{
+    const cv::Mat &data = reinterpret_cast<MatrixOutput*>(output)->data;
+    const int total = int(data.total());
+    if (buffer_length < total)
+        return total;
+
+    if (data.isContinuous()) {
+        memcpy(buffer, data.ptr<float>(), total * sizeof(float));
+    } else {
+        for (int i=0; i<data.rows; i++)
+            memcpy(buffer + i*data.cols, data.ptr<float>(i), data.cols * sizeof(float));
+    }
+    return total;
+}
+
+int br_get_matrix_output_top_k(br_matrix_output output, int k, int *indices, float *scores)
+{
+    const cv::Mat &data = reinterpret_cast<MatrixOutput*>(output)->data;
+    k = std::min(k, data.cols);
+    if (k <= 0)
+        return 0;
+
+    std::vector< std::pair<float,int> > pairs(data.cols);
+    for (int i=0; i<data.rows; i++) {
+        const float *row = data.ptr<float>(i);
+        for (int j=0; j<data.cols; j++)
+            pairs[j] = std::pair<float,int>(row[j], j);
+        std::partial_sort(pairs.begin(), pairs.begin()+k, pairs.end(), std::greater< std::pair<float,int> >());
+        for (int j=0; j<k; j++) {
+            if (indices) indices[i*k+j] = pairs[j].second;
+            if (scores)  scores[i*k+j] = pairs[j].first;
+        }
+    }
+    return k;
+}
+
 br_template br_get_template(br_template_list tl, int index)
 {
     TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
@@ -136,6 +136,8 @@ typedef void* br_matrix_output;
 
 BR_EXPORT br_template br_load_img(const char *data, int len);
 
+BR_EXPORT br_template br_load_raw_img(const unsigned char *data, int rows, int cols, int type, int stride = 0);
+
 BR_EXPORT unsigned char* br_unload_img(br_template tmpl);
 
 BR_EXPORT br_template_list br_template_list_from_buffer(const char *buf, int len);
@@ -164,10 +166,24 @@ BR_EXPORT br_template_list br_enroll_template(br_template tmpl);
 
 BR_EXPORT void br_enroll_template_list(br_template_list tl);
 
+typedef void (*br_enroll_callback)(br_template_list enrolled, void *user_data);
+
+BR_EXPORT void br_enroll_template_list_async(br_template_list tl, br_enroll_callback callback, void *user_data);
+
+BR_EXPORT void br_enroll_async_wait();
+
 BR_EXPORT br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query);
 
 BR_EXPORT float br_get_matrix_output_at(br_matrix_output output, int row, int col);
 
+BR_EXPORT int br_get_matrix_output_rows(br_matrix_output output);
+
+BR_EXPORT int br_get_matrix_output_cols(br_matrix_output output);
+
+BR_EXPORT int br_get_matrix_output(br_matrix_output output, float *buffer, int buffer_length);
+
+BR_EXPORT int br_get_matrix_output_top_k(br_matrix_output output, int k, int *indices, float *scores);
+
 BR_EXPORT br_template br_get_template(br_template_list tl, int index);
 
 BR_EXPORT int br_num_templates(br_template_list tl);
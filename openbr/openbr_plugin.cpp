@@ -1360,6 +1360,26 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+void Output::setRelativeRow(const float *values, const uchar *valid, int i, int j, int size)
+{
+    setRow(values, valid, i+offset.y(), j+offset.x(), size);
+    if (!next.isNull()) next->setRelativeRow(values, valid, i, j, size);
+}
+
+void Output::setRelativeTile(const cv::Mat &values, const cv::Mat &valid, int i, int j)
+{
+    if ((values.type() != CV_32FC1) || (!valid.empty() && ((valid.type() != CV_8UC1) || (valid.size() != values.size()))))
+        qFatal("Expected a float tile and a matching byte mask.");
+    for (int row=0; row<values.rows; row++)
+        setRelativeRow(values.ptr<float>(row), valid.empty() ? NULL : valid.ptr<uchar>(row), i+row, j, values.cols);
+}
+
+void Output::setRow(const float *values, const uchar *valid, int i, int j, int size)
+{
+    for (int k=0; k<size; k++)
+        set((valid && !valid[k]) ? -std::numeric_limits<float>::max() : values[k], i, j+k);
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1398,6 +1418,17 @@ void MatrixOutput::set(float value, int i, int j)
     data.at<float>(i,j) = value;
 }
 
+void MatrixOutput::setRow(const float *values, const uchar *valid, int i, int j, int size)
+{
+    float *dst = data.ptr<float>(i) + j;
+    if (!valid) {
+        memcpy(dst, values, size * sizeof(float));
+        return;
+    }
+    for (int k=0; k<size; k++)
+        dst[k] = valid[k] ? values[k] : -std::numeric_limits<float>::max();
+}
+
 BR_REGISTER(Output, MatrixOutput)
 
 /* Format - public methods */
@@ -1676,10 +1707,15 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
-    for (int i=0; i<query.size(); i++)
-        for (int j=0; j<target.size(); j++)
-            if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+    QVector<float> scores(target.size());
+    QVector<uchar> valid(target.size());
+    for (int i=0; i<query.size(); i++) {
+        for (int j=0; j<target.size(); j++) {
+            valid[j] = !target[j].isEmpty() && !query[i].isEmpty();
+            if (valid[j]) scores[j] = compare(target[j], query[i]);
+        }
+        output->setRelativeRow(scores.constData(), valid.constData(), i+queryOffset, targetOffset, target.size());
+    }
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
@@ -1732,3 +1768,17 @@ Classifier *Classifier::make(QString str, QObject *parent)
     classifier->setParent(parent);
     return classifier;
 }
+
+QList<float> Classifier::classify(const TemplateList &src, bool process, QList<float> *confidences) const
+{
+    QList<float> results;
+    if (confidences)
+        confidences->clear();
+    foreach (const Template &t, src) {
+        float confidence = 0;
+        results.append(classify(t, process, &confidence));
+        if (confidences)
+            confidences->append(confidence);
+    }
+    return results;
+}
@@ -653,6 +653,8 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles);
     virtual void setBlock(int rowBlock, int columnBlock);
     virtual void setRelative(float value, int i, int j);
+    virtual void setRelativeRow(const float *values, const uchar *valid, int i, int j, int size);
+    virtual void setRelativeTile(const cv::Mat &values, const cv::Mat &valid, int i, int j);
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles);
 
@@ -660,6 +662,7 @@ private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual void setRow(const float *values, const uchar *valid, int i, int j, int size);
 };
 
 
@@ -678,6 +681,7 @@ protected:
 private:
     void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
+    void setRow(const float *values, const uchar *valid, int i, int j, int size);
 };
 
 class BR_EXPORT Format : public Object
@@ -903,6 +907,8 @@ public:
 
     virtual void train(const TemplateList &data) { (void)data; }
     virtual float classify(const Template &src, bool process = true, float *confidence = NULL) const = 0;
+    // Classify many windows of the same size at once, the default implementation calls classify() on each
+    virtual QList<float> classify(const TemplateList &src, bool process = true, QList<float> *confidences = NULL) const;
 
     // Slots for representations
     virtual Template preprocess(const Template &src) const { return src; }
@@ -919,6 +925,12 @@ BR_EXPORT void Enroll(const File &input, const File &gallery = File());
 
 BR_EXPORT void Enroll(TemplateList &tmpl);
 
+typedef void (*EnrollCallback)(const TemplateList &enrolled, void *context);
+
+BR_EXPORT QFuture<TemplateList> EnrollAsync(const TemplateList &tmpl, EnrollCallback callback = NULL, void *context = NULL);
+
+BR_EXPORT void EnrollAsyncWait();
+
 BR_EXPORT void Project(const File &input, const File &output);
 
 BR_EXPORT void Compare(const File &targetGallery, const File &queryGallery, const File &output);
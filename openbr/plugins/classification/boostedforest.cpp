@@ -0,0 +1,370 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/common.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup classifiers
+ * \brief A soft cascade of Gentle AdaBoost regression trees trained on the features of a Representation.
+ *
+ * Trees are complete binary trees of depth maxDepth stored as flat arrays, so node i has children
+ * 2i+1 and 2i+2 and traversal is a branch-free index update. After every tree the running score is
+ * compared against a stage threshold chosen so that minTAR of the positive training samples survive,
+ * which lets most negative windows be rejected after only a few trees.
+ *
+ * When classifying a TemplateList, the live windows descend each tree together one level at a time, evaluating
+ * only the node on each window's path and comparing four windows at a time when SSE is available.
+ * Rejected windows are dropped from the batch after every tree.
+ *
+ * \br_paper Lubomir Bourdev and Jonathan Brandt
+ *           "Robust Object Detection Via Soft Cascade"
+ *           CVPR 2005
+ * \br_property br::Representation* representation The features used to train the trees.
+ * \br_property int numTrees Maximum number of trees in the forest. Default is 1000.
+ * \br_property int maxDepth Depth of each tree, 1 trains decision stumps. Default is 4.
+ * \br_property float minTAR Fraction of positive training samples that must pass each stage. Default is 0.995.
+ * \br_property int featureSamples Number of randomly sampled features considered when building each tree. Default is 1024.
+ * \br_property QString inputVariable Metadata key for the label of each template. Positive samples have a label of 1. Default is "Label".
+ */
+class BoostedForestClassifier : public Classifier
+{
+    Q_OBJECT
+
+    Q_PROPERTY(br::Representation* representation READ get_representation WRITE set_representation RESET reset_representation STORED false)
+    Q_PROPERTY(int numTrees READ get_numTrees WRITE set_numTrees RESET reset_numTrees STORED false)
+    Q_PROPERTY(int maxDepth READ get_maxDepth WRITE set_maxDepth RESET reset_maxDepth STORED false)
+    Q_PROPERTY(float minTAR READ get_minTAR WRITE set_minTAR RESET reset_minTAR STORED false)
+    Q_PROPERTY(int featureSamples READ get_featureSamples WRITE set_featureSamples RESET reset_featureSamples STORED false)
+    Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    BR_PROPERTY(br::Representation*, representation, NULL)
+    BR_PROPERTY(int, numTrees, 1000)
+    BR_PROPERTY(int, maxDepth, 4)
+    BR_PROPERTY(float, minTAR, 0.995)
+    BR_PROPERTY(int, featureSamples, 1024)
+    BR_PROPERTY(QString, inputVariable, "Label")
+
+    static const int bins = 256;
+
+    // Tree t owns internal nodes [t*nodesPerTree, (t+1)*nodesPerTree) and leaves [t*leavesPerTree, (t+1)*leavesPerTree)
+    int depth, nodesPerTree, leavesPerTree;
+    QVector<int> features;
+    QVector<float> thresholds, leaves, stageThresholds;
+
+    void init()
+    {
+        if (representation == NULL)
+            qFatal("BoostedForest requires a representation.");
+        depth = std::max(maxDepth, 1);
+        nodesPerTree = (1 << depth) - 1;
+        leavesPerTree = 1 << depth;
+    }
+
+    int numTrained() const
+    {
+        return stageThresholds.size();
+    }
+
+    inline float treeScore(int tree, const Template &src) const
+    {
+        const int *f = features.data() + tree*nodesPerTree;
+        const float *thr = thresholds.data() + tree*nodesPerTree;
+        int idx = 0;
+        for (int d=0; d<depth; d++)
+            idx = 2*idx + 1 + (representation->evaluate(src, f[idx]) > thr[idx]);
+        return leaves[tree*leavesPerTree + idx - nodesPerTree];
+    }
+
+    // Gentle AdaBoost fit of a single regression tree to the weighted samples in 'active'.
+    // 'values' is feature-major: values[j*n + i] holds feature 'sampled[j]' for sample i, quantized to 'bins' levels.
+    void fitTree(const QVector<uchar> &values, const QList<int> &sampled, const QVector<float> &mins, const QVector<float> &widths,
+                 const QVector<int> &active, const QVector<float> &labels, const QVector<double> &weights, int n)
+    {
+        const int tree = numTrained();
+        features.resize((tree+1)*nodesPerTree);
+        thresholds.resize((tree+1)*nodesPerTree);
+        leaves.resize((tree+1)*leavesPerTree);
+
+        // Node index of each active sample, all samples start at the root
+        QVector<int> node(active.size(), 0);
+        QVector<double> wy(bins), w(bins);
+
+        for (int idx=0; idx<nodesPerTree; idx++) {
+            double bestGain = -1;
+            int bestFeature = 0, bestBin = bins-1;
+
+            for (int j=0; j<sampled.size(); j++) {
+                wy.fill(0); w.fill(0);
+                const uchar *v = values.data() + j*n;
+                double totalWY = 0, totalW = 0;
+                for (int k=0; k<active.size(); k++) {
+                    if (node[k] != idx) continue;
+                    const int i = active[k];
+                    wy[v[i]] += weights[i]*labels[i];
+                    w[v[i]] += weights[i];
+                    totalWY += weights[i]*labels[i];
+                    totalW += weights[i];
+                }
+                if (totalW == 0) break;
+
+                double leftWY = 0, leftW = 0;
+                for (int b=0; b<bins-1; b++) {
+                    leftWY += wy[b]; leftW += w[b];
+                    const double rightWY = totalWY - leftWY, rightW = totalW - leftW;
+                    if (leftW <= 0 || rightW <= 0) continue;
+                    const double gain = leftWY*leftWY/leftW + rightWY*rightWY/rightW;
+                    if (gain > bestGain) {
+                        bestGain = gain;
+                        bestFeature = j;
+                        bestBin = b;
+                    }
+                }
+            }
+
+            // Nodes without a useful split send every sample left
+            features[tree*nodesPerTree + idx] = sampled[bestFeature];
+            thresholds[tree*nodesPerTree + idx] = bestGain < 0 ? std::numeric_limits<float>::max()
+                                                               : mins[bestFeature] + (bestBin+1)*widths[bestFeature];
+
+            const uchar *v = values.data() + bestFeature*n;
+            for (int k=0; k<active.size(); k++)
+                if (node[k] == idx)
+                    node[k] = 2*idx + 1 + (bestGain >= 0 && v[active[k]] > bestBin);
+        }
+
+        QVector<double> leafWY(leavesPerTree, 0), leafW(leavesPerTree, 0);
+        for (int k=0; k<active.size(); k++) {
+            const int i = active[k];
+            leafWY[node[k]-nodesPerTree] += weights[i]*labels[i];
+            leafW[node[k]-nodesPerTree] += weights[i];
+        }
+        for (int l=0; l<leavesPerTree; l++)
+            leaves[tree*leavesPerTree + l] = leafW[l] > 0 ? leafWY[l]/leafW[l] : 0;
+    }
+
+    void train(const TemplateList &data)
+    {
+        representation->train(data);
+
+        TemplateList samples;
+        QVector<float> labels;
+        int numPositives = 0;
+        foreach (const Template &t, data) {
+            samples.append(representation->preprocess(t));
+            const bool positive = t.file.get<float>(inputVariable) == 1;
+            labels.append(positive ? 1 : -1);
+            numPositives += positive;
+        }
+
+        const int n = samples.size();
+        const int numNegatives = n - numPositives;
+        if (numPositives == 0 || numNegatives == 0)
+            qFatal("BoostedForest requires positive and negative training samples.");
+
+        // Class balanced initial weights
+        QVector<double> prior(n), weights(n);
+        for (int i=0; i<n; i++)
+            prior[i] = labels[i] > 0 ? 0.5/numPositives : 0.5/numNegatives;
+        weights = prior;
+
+        QVector<float> scores(n, 0);
+        QVector<int> active(n);
+        for (int i=0; i<n; i++) active[i] = i;
+
+        features.clear(); thresholds.clear(); leaves.clear(); stageThresholds.clear();
+
+        const int numFeatures = representation->numFeatures();
+        const int samplesPerTree = std::min(featureSamples, numFeatures);
+        QVector<uchar> values(samplesPerTree*n);
+        QVector<float> mins(samplesPerTree), widths(samplesPerTree);
+        QVector<float> raw(n);
+
+        for (int tree=0; tree<numTrees; tree++) {
+            const QList<int> sampled = Common::RandSample(samplesPerTree, numFeatures, 0, true);
+
+            // Quantize the sampled features of the remaining samples
+            for (int j=0; j<samplesPerTree; j++) {
+                float lo = std::numeric_limits<float>::max(), hi = -std::numeric_limits<float>::max();
+                foreach (int i, active) {
+                    raw[i] = representation->evaluate(samples[i], sampled[j]);
+                    lo = std::min(lo, raw[i]);
+                    hi = std::max(hi, raw[i]);
+                }
+                mins[j] = lo;
+                widths[j] = hi > lo ? (hi - lo) / bins : 1;
+                uchar *v = values.data() + j*n;
+                foreach (int i, active)
+                    v[i] = (uchar)std::min(bins-1, int((raw[i] - lo) / widths[j]));
+            }
+
+            fitTree(values, sampled, mins, widths, active, labels, weights, n);
+
+            // Update scores and the stage threshold from the surviving positives
+            QVector<float> positiveScores;
+            foreach (int i, active) {
+                scores[i] += treeScore(tree, samples[i]);
+                if (labels[i] > 0)
+                    positiveScores.append(scores[i]);
+            }
+            std::sort(positiveScores.begin(), positiveScores.end());
+            const int reject = std::min(positiveScores.size()-1, int((1 - minTAR) * positiveScores.size()));
+            const float stageThreshold = positiveScores[reject] - std::numeric_limits<float>::epsilon();
+            stageThresholds.append(stageThreshold);
+
+            QVector<int> survivors;
+            double sum = 0;
+            int negatives = 0;
+            foreach (int i, active) {
+                if (scores[i] < stageThreshold) continue;
+                survivors.append(i);
+                weights[i] = prior[i] * exp(-labels[i]*scores[i]);
+                sum += weights[i];
+                negatives += labels[i] < 0;
+            }
+            foreach (int i, survivors)
+                weights[i] /= sum;
+            active = survivors;
+
+            qDebug("Tree %d: %d positives and %d negatives remaining", tree, active.size() - negatives, negatives);
+            if (negatives == 0)
+                break;
+        }
+    }
+
+    float classify(const Template &src, bool process, float *confidence) const
+    {
+        const Template t = process ? preprocess(src) : src;
+        float score = 0;
+        for (int tree=0; tree<numTrained(); tree++) {
+            score += treeScore(tree, t);
+            if (score < stageThresholds[tree]) {
+                if (confidence) *confidence = score;
+                return 0;
+            }
+        }
+        if (confidence) *confidence = score;
+        return 1;
+    }
+
+    QList<float> classify(const TemplateList &src, bool process, QList<float> *confidences) const
+    {
+        TemplateList windows;
+        if (process) foreach (const Template &t, src) windows.append(preprocess(t));
+        else         windows = src;
+
+        const int n = windows.size();
+        QVector<float> scores(n, 0);
+        QList<float> results;
+        for (int i=0; i<n; i++) results.append(0);
+
+        QVector<int> active(n);
+        for (int i=0; i<n; i++) active[i] = i;
+
+        // Node, feature value and node threshold of each live window at the current depth, padded to a multiple of 4
+        QVector<int> node;
+        QVector<float> values, nodeThresholds;
+
+        for (int tree=0; tree<numTrained() && !active.isEmpty(); tree++) {
+            const int m = active.size();
+            const int stride = (m + 3) & ~3;
+            node.fill(0, stride);
+            values.fill(0, stride);
+            nodeThresholds.fill(0, stride);
+            const int *f = features.data() + tree*nodesPerTree;
+            const float *thr = thresholds.data() + tree*nodesPerTree;
+
+            // Level by level, so only the nodes on each window's path are evaluated
+            for (int d=0; d<depth; d++) {
+                for (int k=0; k<m; k++) {
+                    values[k] = representation->evaluate(windows[active[k]], f[node[k]]);
+                    nodeThresholds[k] = thr[node[k]];
+                }
+
+#ifdef __SSE__
+                for (int c=0; c<stride; c+=4) {
+                    const int bits = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(values.data() + c), _mm_loadu_ps(nodeThresholds.data() + c)));
+                    for (int k=0; k<4; k++)
+                        node[c+k] = 2*node[c+k] + 1 + ((bits >> k) & 1);
+                }
+#else
+                for (int k=0; k<m; k++)
+                    node[k] = 2*node[k] + 1 + (values[k] > nodeThresholds[k]);
+#endif
+            }
+
+            const float *leaf = leaves.data() + tree*leavesPerTree;
+            QVector<int> survivors;
+            survivors.reserve(m);
+            for (int k=0; k<m; k++) {
+                const int i = active[k];
+                scores[i] += leaf[node[k] - nodesPerTree];
+                if (scores[i] >= stageThresholds[tree])
+                    survivors.append(i);
+            }
+            active = survivors;
+        }
+
+        foreach (int i, active)
+            results[i] = 1;
+        if (confidences)
+            *confidences = scores.toList();
+        return results;
+    }
+
+    Template preprocess(const Template &src) const
+    {
+        return representation->preprocess(src);
+    }
+
+    Size windowSize(int *dx, int *dy) const
+    {
+        return representation->windowSize(dx, dy);
+    }
+
+    int numFeatures() const
+    {
+        return representation->numFeatures();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        representation->store(stream);
+        stream << depth << features << thresholds << leaves << stageThresholds;
+    }
+
+    void load(QDataStream &stream)
+    {
+        representation->load(stream);
+        stream >> depth >> features >> thresholds >> leaves >> stageThresholds;
+        nodesPerTree = (1 << depth) - 1;
+        leavesPerTree = 1 << depth;
+    }
+};
+
+BR_REGISTER(Classifier, BoostedForestClassifier)
+
+} // namespace br
+
+#include "classification/boostedforest.moc"
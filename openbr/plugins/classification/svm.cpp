@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QTemporaryFile>
+#include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -45,6 +46,9 @@ namespace br
  * \br_property int termCriteria The maximum number of training iterations. Default is 1000.
  * \br_property int folds Cross validation parameter used for autoselecting other parameters. Default is 5.
  * \br_property bool balanceFolds If true and the problem is 2-class classification then more balanced cross validation subsets are created. Default is false.
+ *
+ * Models with a linear kernel are collapsed to one weight vector per decision function, and RBF models are evaluated
+ * as matrix products over the support vectors, so projecting a TemplateList scores every template at once.
  */
 class SVMTransform : public Transform
 {
@@ -93,6 +97,14 @@ private:
     QHash<QString, int> labelMap;
     QHash<int, QVariant> reverseLookup;
 
+    // The trained decision functions as dense matrices, so that a block of templates is scored with matrix products
+    int svmType;
+    QVector<int> classLabels;
+    Mat weights; // Linear kernel, one collapsed weight vector per decision function
+    Mat supportVectors, supportNorms; // RBF kernel, one support vector per row and its squared norm
+    Mat alphas; // RBF kernel, the coefficients of each decision function over every support vector
+    Mat rhos; // The offset of each decision function
+
     void init()
     {
         svm = ml::SVM::create();
@@ -147,22 +159,120 @@ private:
         }
 
         qDebug("SVM C = %f  Gamma = %f  Support Vectors = %d", svm->getC(), svm->getGamma(), svm->getSupportVectors().rows);
+        prepare();
     }
 
-    void project(const Template &src, Template &dst) const
+    void prepare()
     {
-        if (returnDFVal && reverseLookup.size() > 2)
-            qFatal("Decision function for multiclass classification not implemented.");
+        weights.release();
+        supportVectors.release();
+        supportNorms.release();
+        alphas.release();
+        rhos.release();
+        classLabels.clear();
+
+        if (!svm->isTrained())
+            return;
+        const int kernelType = svm->getKernelType();
+        if ((kernelType != ml::SVM::LINEAR) && (kernelType != ml::SVM::RBF))
+            return;
+
+        svmType = svm->getType();
+        if ((svmType == ml::SVM::C_SVC) || (svmType == ml::SVM::NU_SVC)) {
+            // The class labels are only available through the serialized model
+            cv::FileStorage fs(".yml", cv::FileStorage::WRITE | cv::FileStorage::MEMORY);
+            fs.startWriteStruct(svm->getDefaultName(), cv::FileNode::MAP);
+            svm->write(fs);
+            fs.endWriteStruct();
+            cv::FileStorage model(fs.releaseAndGetString(), cv::FileStorage::READ | cv::FileStorage::MEMORY);
+            Mat labels;
+            model[svm->getDefaultName()]["class_labels"] >> labels;
+            labels.convertTo(labels, CV_32S);
+            for (size_t i=0; i<labels.total(); i++)
+                classLabels.append(labels.at<int>(int(i)));
+            if (classLabels.size() < 2)
+                return;
+        }
 
-        dst = src;
+        const int functions = classLabels.isEmpty() ? 1 : classLabels.size() * (classLabels.size() - 1) / 2;
+        const Mat sv = svm->getSupportVectors();
+        Mat coefficients = Mat::zeros(functions, sv.rows, CV_32FC1);
+        rhos.create(1, functions, CV_32FC1);
+        for (int i=0; i<functions; i++) {
+            Mat alpha, index;
+            rhos.at<float>(0, i) = svm->getDecisionFunction(i, alpha, index);
+            for (size_t k=0; k<alpha.total(); k++)
+                coefficients.at<float>(i, index.at<int>(int(k))) += alpha.at<double>(int(k));
+        }
 
-        cv::Mat output;
-        float prediction = svm->predict(src.m().reshape(1, 1), output, returnDFVal ? ml::StatModel::RAW_OUTPUT : 0);
-        prediction = output.at<float>(0, 0);
+        if (kernelType == ml::SVM::LINEAR) {
+            // A linear decision function is the dot product with the weighted sum of its support vectors
+            weights = coefficients * sv;
+        } else {
+            supportVectors = sv;
+            reduce(sv.mul(sv), supportNorms, 1, REDUCE_SUM);
+            supportNorms = supportNorms.t();
+            alphas = coefficients;
+        }
+    }
+
+    bool batchable(const Mat &samples) const
+    {
+        if (rhos.empty() || (samples.type() != CV_32FC1))
+            return false;
+        return samples.cols == (weights.empty() ? supportVectors.cols : weights.cols);
+    }
 
+    // One row per sample, one column per decision function
+    Mat decisions(const Mat &samples) const
+    {
+        Mat result;
+        if (!weights.empty()) {
+            gemm(samples, weights, 1, Mat(), 0, result, GEMM_2_T);
+        } else {
+            // exp(-gamma |x - s|^2), where |x - s|^2 = |x|^2 + |s|^2 - 2 x.s
+            Mat kernels, norms;
+            gemm(samples, supportVectors, -2, Mat(), 0, kernels, GEMM_2_T);
+            reduce(samples.mul(samples), norms, 1, REDUCE_SUM);
+            const float gamma = float(svm->getGamma());
+            for (int i=0; i<kernels.rows; i++) {
+                float *kernel = kernels.ptr<float>(i);
+                const float *supportNorm = supportNorms.ptr<float>(0);
+                const float norm = norms.at<float>(i, 0);
+                for (int j=0; j<kernels.cols; j++)
+                    kernel[j] = -gamma * std::max(kernel[j] + norm + supportNorm[j], 0.f);
+            }
+            exp(kernels, kernels);
+            gemm(kernels, alphas, 1, Mat(), 0, result, GEMM_2_T);
+        }
+
+        for (int i=0; i<result.rows; i++)
+            result.row(i) -= rhos;
+        return result;
+    }
+
+    // Same as ml::SVM::predict given the decision function values of a sample
+    float prediction(const float *decision) const
+    {
+        if (classLabels.isEmpty())
+            return ((svmType == ml::SVM::ONE_CLASS) && !returnDFVal) ? float(decision[0] > 0) : decision[0];
+
+        QVector<int> votes(classLabels.size(), 0);
+        int function = 0;
+        for (int i=0; i<classLabels.size(); i++)
+            for (int j=i+1; j<classLabels.size(); j++)
+                votes[decision[function++] > 0 ? i : j]++;
+
+        if (returnDFVal && (classLabels.size() == 2))
+            return decision[0];
+        return classLabels[int(std::max_element(votes.begin(), votes.end()) - votes.begin())];
+    }
+
+    // value is a 1x1 matrix holding the prediction
+    void finish(float prediction, const Mat &value, Template &dst) const
+    {
         if (returnDFVal) {
-            dst.m() = Mat(1, 1, CV_32F);
-            dst.m().at<float>(0, 0) = prediction;
+            dst.m() = value;
             // positive values ==> first class
             // negative values ==> second class
             if (type != EPS_SVR && type != NU_SVR)
@@ -171,13 +281,73 @@ private:
 
         if (type == EPS_SVR || type == NU_SVR) {
             dst.file.set(outputVariable, prediction);
-            dst.m() = Mat(1, 1, CV_32F);
-            dst.m().at<float>(0, 0) = prediction;
-
+            dst.m() = value;
         } else
             dst.file.set(outputVariable, reverseLookup[prediction]);
     }
 
+    void project(const Template &src, Template &dst) const
+    {
+        if (returnDFVal && reverseLookup.size() > 2)
+            qFatal("Decision function for multiclass classification not implemented.");
+
+        dst = src;
+
+        const Mat sample = src.m().reshape(1, 1);
+        Mat output;
+        if (batchable(sample)) {
+            output.create(1, 1, CV_32FC1);
+            output.at<float>(0, 0) = prediction(decisions(sample).ptr<float>(0));
+        } else {
+            svm->predict(sample, output, returnDFVal ? ml::StatModel::RAW_OUTPUT : 0);
+        }
+        finish(output.at<float>(0, 0), output, dst);
+    }
+
+    // Scores the whole list at once, predictions share one output matrix
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (returnDFVal && reverseLookup.size() > 2)
+            qFatal("Decision function for multiclass classification not implemented.");
+        if (src.isEmpty())
+            return;
+
+        const size_t dimensions = src.first().isEmpty() ? 0 : src.first().m().total() * src.first().m().channels();
+        foreach (const Template &t, src)
+            if (t.isEmpty() || (t.m().type() != src.first().m().type()) || (t.m().total() * t.m().channels() != dimensions) || !t.m().isContinuous()) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        Mat samples(src.size(), int(dimensions), src.first().m().depth());
+        for (int i=0; i<src.size(); i++)
+            memcpy(samples.ptr(i), src[i].m().data, samples.cols * samples.elemSize());
+
+        Mat outputs;
+        if (batchable(samples)) {
+            outputs.create(samples.rows, 1, CV_32FC1);
+            const int blockSize = 4096;
+            for (int begin=0; begin<samples.rows; begin+=blockSize) {
+                const Mat block = decisions(samples.rowRange(begin, std::min(begin + blockSize, samples.rows)));
+                for (int i=0; i<block.rows; i++)
+                    outputs.at<float>(begin + i, 0) = prediction(block.ptr<float>(i));
+            }
+        } else {
+            try {
+                svm->predict(samples, outputs, returnDFVal ? ml::StatModel::RAW_OUTPUT : 0);
+            } catch (...) {
+                Transform::project(src, dst);
+                return;
+            }
+        }
+
+        dst.reserve(dst.size() + src.size());
+        for (int i=0; i<src.size(); i++) {
+            dst.append(src[i]);
+            finish(outputs.at<float>(i, 0), outputs.row(i), dst.last());
+        }
+    }
+
     void store(QDataStream &stream) const
     {
         // Create local file
@@ -214,7 +384,8 @@ private:
         // Load model from local file
         svm = cv::Algorithm::load<ml::SVM>(tempFile.fileName().toStdString());
         stream >> labelMap >> reverseLookup;
-    } 
+        prepare();
+    }
 };
 
 BR_REGISTER(Transform, SVMTransform)
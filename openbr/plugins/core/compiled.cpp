@@ -0,0 +1,341 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QtConcurrent>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief A trained Transform lowered to a flat execution plan.
+ *
+ * The nested Pipe, Fork, Independent and LoadStore objects of an already constructed transform are
+ * flattened into a single array of steps:
+ * - \em Fused steps group consecutive untrainable transforms. Over a template list each template runs the
+ *   whole group as one task, rather than the list waiting for every template after each transform.
+ *   Each transform is still called through its own project().
+ * - \em Linear steps hand the whole template list to a trained or list-level transform.
+ * - \em Parallel steps run the branches of a Fork concurrently and merge their outputs.
+ * - \em PerMatrix steps run the branches of an Independent over each matrix of the template.
+ *
+ * The shape and type of the templates leaving each step are recorded from the first template
+ * that reaches it and reported by stages().
+ *
+ * \br_property br::Transform* transform The trained transform to compile.
+ * \br_related_plugin PipeTransform ForkTransform IndependentTransform
+ */
+class CompiledTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+
+public:
+    enum Kind { Fused, Linear, Parallel, PerMatrix };
+
+    struct Step
+    {
+        Kind kind;
+        QList<Transform*> transforms; // The chain of a Fused step, or the single transform of a Linear step
+        QList<int> branches; // First step of each branch of a Parallel or PerMatrix step
+        int end; // One past the last step belonging to this step
+
+        bool shaped;
+        int size, rows, cols;
+        QString type;
+
+        Step(Kind _kind = Linear) : kind(_kind), end(0), shaped(false), size(0), rows(0), cols(0) {}
+    };
+
+    // One line per step: nesting, kind, transforms and the shape and type of its output
+    Q_INVOKABLE QStringList stages() const
+    {
+        QStringList result;
+        describe(0, steps.size(), "", result);
+        return result;
+    }
+
+private:
+    QVector<Step> steps;
+    int open; // Index of the Fused step still accepting transforms at the current nesting level
+    mutable QMutex shapeLock;
+
+    void init()
+    {
+        trainable = false;
+        steps.clear();
+        if (!transform)
+            return;
+
+        open = -1;
+        if (transform->timeVarying()) {
+            qWarning("Compiled: %s is time varying and will not be lowered.", qPrintable(transform->description()));
+            append(Step(Linear), transform);
+        } else {
+            lower(transform);
+        }
+
+        if (Globals->verbose)
+            foreach (const QString &stage, stages())
+                qDebug("%s", qPrintable(stage));
+    }
+
+    void append(Step step, Transform *transform)
+    {
+        step.transforms.append(transform);
+        step.end = steps.size() + 1;
+        steps.append(step);
+    }
+
+    static bool fusable(const Transform *transform)
+    {
+        return !transform->trainable
+               && !transform->timeVarying()
+               && !dynamic_cast<const UntrainableMetaTransform*>(transform)
+               && !dynamic_cast<const CompositeTransform*>(transform);
+    }
+
+    static bool composite(const Transform *transform)
+    {
+        return dynamic_cast<const CompositeTransform*>(transform) != NULL;
+    }
+
+    void lower(Transform *transform)
+    {
+        const QString name = transform->metaObject()->className();
+
+        if (name == "br::LoadStoreTransform") {
+            lower(transform->property("transform").value<Transform*>());
+            return;
+        }
+
+        if (name == "br::PipeTransform") {
+            foreach (Transform *child, transform->property("transforms").value< QList<Transform*> >())
+                lower(child);
+            return;
+        }
+
+        // An Independent around a leaf is already a single per-matrix call, only look inside those
+        // around a Pipe or Fork
+        const bool fork = (name == "br::ForkTransform");
+        const bool independent = (name == "br::IndependentTransform") && composite(transform->property("transform").value<Transform*>());
+        if (fork || independent) {
+            const int index = steps.size();
+            steps.append(Step(fork ? Parallel : PerMatrix));
+
+            // The trained per-matrix clones of an Independent are its children
+            const QList<Transform*> branches = fork ? transform->property("transforms").value< QList<Transform*> >()
+                                                    : transform->getChildren<Transform>();
+            foreach (Transform *branch, branches) {
+                steps[index].branches.append(steps.size());
+                open = -1;
+                lower(branch);
+            }
+
+            steps[index].end = steps.size();
+            open = -1;
+            return;
+        }
+
+        if (!fusable(transform)) {
+            append(Step(Linear), transform);
+            open = -1;
+            return;
+        }
+
+        if (open == -1) {
+            open = steps.size();
+            append(Step(Fused), transform);
+        } else {
+            steps[open].transforms.append(transform);
+        }
+    }
+
+    int branchEnd(const Step &step, int branch) const
+    {
+        return (branch+1 < step.branches.size()) ? step.branches[branch+1] : step.end;
+    }
+
+    static const char *kindName(Kind kind)
+    {
+        switch (kind) {
+          case Fused:     return "Fused";
+          case Linear:    return "Linear";
+          case Parallel:  return "Parallel";
+          case PerMatrix: return "PerMatrix";
+        }
+        return "";
+    }
+
+    void describe(int begin, int end, const QString &indentation, QStringList &result) const
+    {
+        for (int i=begin; i<end; i=steps[i].end) {
+            const Step &step = steps[i];
+            QStringList names;
+            foreach (const Transform *t, step.transforms)
+                names.append(t->description());
+
+            result.append(QString("%1%2 %3%4 -> %5").arg(indentation, kindName(step.kind), names.join("+"),
+                                                         step.branches.isEmpty() ? QString() : QString::number(step.branches.size()) + " branches",
+                                                         step.shaped ? QString("%1x%2x%3 %4").arg(QString::number(step.size), QString::number(step.rows), QString::number(step.cols), step.type)
+                                                                     : QString("?")));
+            for (int j=0; j<step.branches.size(); j++)
+                describe(step.branches[j], branchEnd(step, j), indentation + "  ", result);
+        }
+    }
+
+    void observe(int index, const Template &t) const
+    {
+        if (t.file.fte)
+            return;
+
+        QMutexLocker locker(&shapeLock);
+        Step &step = const_cast<Step&>(steps[index]);
+        if (step.shaped)
+            return;
+        step.size = t.size();
+        if (!t.isEmpty()) {
+            step.rows = t.m().rows;
+            step.cols = t.m().cols;
+            step.type = OpenCVUtils::typeToString(t.m());
+        }
+        step.shaped = true;
+    }
+
+    // Run steps [begin, end) on a single template
+    void run(int begin, int end, const Template &src, Template &dst) const
+    {
+        dst = src;
+        for (int i=begin; i<end && !dst.file.fte; i=steps[i].end) {
+            const Step &step = steps[i];
+            Template in = dst;
+            try {
+                if (step.kind == Fused || step.kind == Linear) {
+                    foreach (const Transform *t, step.transforms) {
+                        in >> *t;
+                        if (in.file.fte)
+                            break;
+                    }
+                    dst = in;
+                } else if (step.kind == Parallel) {
+                    dst = Template();
+                    for (int j=0; j<step.branches.size(); j++) {
+                        Template res;
+                        run(step.branches[j], branchEnd(step, j), in, res);
+                        dst.merge(res);
+                    }
+                } else {
+                    dst.file = in.file;
+                    dst.clear();
+                    QList<cv::Mat> mats;
+                    for (int j=0; j<in.size(); j++) {
+                        const int branch = j % step.branches.size();
+                        run(step.branches[branch], branchEnd(step, branch), Template(in.file, in[j]), dst);
+                        mats.append(dst);
+                        dst.clear();
+                    }
+                    dst.append(mats);
+                }
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with compiled step %d", qPrintable(src.file.flat()), i);
+                dst = Template(src.file);
+                dst.file.fte = true;
+            }
+            observe(i, dst);
+        }
+    }
+
+    static void _run(const CompiledTransform *plan, int begin, int end, const Template *src, Template *dst)
+    {
+        plan->run(begin, end, *src, *dst);
+    }
+
+    static void _runList(const CompiledTransform *plan, int begin, int end, const TemplateList *src, TemplateList *dst)
+    {
+        plan->run(begin, end, *src, *dst);
+    }
+
+    // Run steps [begin, end) on a template list, failures to enroll are collected at the end like PipeTransform
+    void run(int begin, int end, const TemplateList &src, TemplateList &dst) const
+    {
+        TemplateList ftes;
+        dst = src;
+        for (int i=begin; i<end; i=steps[i].end) {
+            const Step &step = steps[i];
+            TemplateList res;
+            if (step.kind == Linear) {
+                step.transforms.first()->project(dst, res);
+            } else if (step.kind == Parallel) {
+                // Each branch sees the whole list, the branches themselves run concurrently
+                QVector<TemplateList> branches(step.branches.size());
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j<branches.size(); j++)
+                    if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_runList, this, step.branches[j], branchEnd(step, j), &dst, &branches[j]));
+                    else                          _runList(this, step.branches[j], branchEnd(step, j), &dst, &branches[j]);
+                futures.waitForFinished();
+
+                for (int j=0; j<dst.size(); j++)
+                    res.append(Template(dst[j].file));
+                foreach (const TemplateList &branch, branches) {
+                    if (branch.size() != res.size()) qFatal("TemplateList is of an unexpected size.");
+                    for (int j=0; j<res.size(); j++)
+                        res[j].merge(branch[j]);
+                }
+            } else {
+                // Fused and PerMatrix steps are independent per template
+                for (int j=0; j<dst.size(); j++)
+                    res.append(Template());
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j<dst.size(); j++)
+                    if ((Globals->parallelism > 1) && (dst.size() > 1)) futures.addFuture(QtConcurrent::run(_run, this, i, step.end, &dst[j], &res[j]));
+                    else                                                _run(this, i, step.end, &dst[j], &res[j]);
+                futures.waitForFinished();
+            }
+
+            splitFTEs(res, ftes);
+            dst = res;
+            if (!dst.isEmpty())
+                observe(i, dst.first());
+        }
+        dst.append(ftes);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        run(0, steps.size(), src, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        run(0, steps.size(), src, dst);
+    }
+
+    void train(const QList<TemplateList> &data)
+    {
+        (void) data;
+        qFatal("Compiled: train the transform before compiling it.");
+    }
+};
+
+BR_REGISTER(Transform, CompiledTransform)
+
+} // namespace br
+
+#include "core/compiled.moc"
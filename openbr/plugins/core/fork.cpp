@@ -26,11 +26,46 @@ static void _train(Transform *transform, const QList<TemplateList> *data)
     transform->train(*data);
 }
 
+static void _projectList(const Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    transform->project(*src, *dst);
+}
+
+// Same as PipeTransform projecting src through stages [begin, end), returns false if a failure to enroll stopped it
+static bool _projectStages(const QList<Transform*> &stages, int begin, int end, const Template &src, Template &dst)
+{
+    for (int i=begin; i<end; i++) {
+        try {
+            dst >> *stages[i];
+            if (dst.file.fte)
+                return false;
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(stages[i]->objectName()));
+            dst = Template(src.file);
+            dst.file.fte = true;
+        }
+    }
+    return true;
+}
+
+// Same as PipeTransform projecting a list through stages [begin, end), collecting failures to enroll in ftes
+static void _projectStageList(const QList<Transform*> *stages, int begin, TemplateList *dst, TemplateList *ftes)
+{
+    for (int i=begin; i<stages->size(); i++) {
+        TemplateList res;
+        (*stages)[i]->project(*dst, res);
+        splitFTEs(res, *ftes);
+        *dst = res;
+    }
+}
+
 /*!
  * \ingroup transforms
  * \brief Transforms in parallel.
  *
  * The source Template is seperately given to each transform and the results are appended together.
+ * Branches are evaluated concurrently. When every branch is a PipeTransform, leading untrainable stages with identical
+ * descriptions in all branches are evaluated once and their output shared by the branches.
  *
  * \author Josh Klontz \cite jklontz
  * \br_related_plugin PipeTransform
@@ -39,12 +74,75 @@ class ForkTransform : public CompositeTransform
 {
     Q_OBJECT
 
+    int prefix; // Number of leading stages shared by every branch
+    QList< QList<Transform*> > stages; // Stages of each branch, when prefix > 0
+
+    void init()
+    {
+        CompositeTransform::init();
+        prefix = 0;
+        stages.clear();
+        if (transforms.size() < 2)
+            return;
+
+        foreach (Transform *transform, transforms) {
+            if (QString(transform->metaObject()->className()) != "br::PipeTransform")
+                return;
+            stages.append(static_cast<CompositeTransform*>(transform)->transforms);
+        }
+
+        while (prefix < stages.first().size()) {
+            const Transform *first = stages.first()[prefix];
+            if (first->trainable || first->timeVarying())
+                break;
+
+            const QString description = first->description();
+            bool shared = true;
+            for (int i=1; shared && (i<stages.size()); i++)
+                shared = (prefix < stages[i].size()) &&
+                         !stages[i][prefix]->trainable &&
+                         !stages[i][prefix]->timeVarying() &&
+                         (stages[i][prefix]->description() == description);
+            if (!shared)
+                break;
+            prefix++;
+        }
+
+        if (prefix == 0)
+            stages.clear();
+    }
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
+
+        if (prefix == 0) {
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<transforms.size(); i++)
+                futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
+            futures.waitForFinished();
+            return;
+        }
+
+        // Project the training data through the shared stages once, dropping failures to enroll like PipeTransform::train
+        QList<TemplateList> dataLines(data);
+        const QList<Transform*> shared = stages.first().mid(0, prefix);
+        QVector<TemplateList> junk(dataLines.size());
+        QFutureSynchronizer<void> projections;
+        for (int j=0; j<dataLines.size(); j++)
+            projections.addFuture(QtConcurrent::run(_projectStageList, &shared, 0, &dataLines[j], &junk[j]));
+        projections.waitForFinished();
+
+        // Then train the remaining stages of each branch in place, so that store() and load() on the branches are unchanged
+        QList< QSharedPointer<Transform> > suffixes;
         QFutureSynchronizer<void> futures;
-        for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
+        for (int i=0; i<stages.size(); i++) {
+            QList<Transform*> suffix = stages[i].mid(prefix);
+            if (suffix.isEmpty())
+                continue;
+            suffixes.append(QSharedPointer<Transform>(pipeTransforms(suffix)));
+            futures.addFuture(QtConcurrent::run(_train, suffixes.last().data(), &dataLines));
+        }
         futures.waitForFinished();
     }
 
@@ -110,6 +208,18 @@ protected:
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
+        if (prefix > 0) {
+            Template shared = src;
+            const bool active = _projectStages(stages.first(), 0, prefix, src, shared);
+            for (int i=0; i<stages.size(); i++) {
+                Template res = shared;
+                if (active)
+                    _projectStages(stages[i], prefix, stages[i].size(), src, res);
+                dst.merge(res);
+            }
+            return;
+        }
+
         foreach (const Transform *f, transforms) {
             try {
                 dst.merge((*f)(src));
@@ -124,13 +234,32 @@ protected:
 
     void _project(const TemplateList &src, TemplateList &dst) const
     {
+        QVector<TemplateList> m(transforms.size());
+        QFutureSynchronizer<void> futures;
+        if (prefix > 0) {
+            const QList<Transform*> sharedStages = stages.first().mid(0, prefix);
+            TemplateList shared = src, ftes;
+            _projectStageList(&sharedStages, 0, &shared, &ftes);
+
+            QVector<TemplateList> branchFTEs(stages.size(), ftes);
+            for (int i=0; i<stages.size(); i++) {
+                m[i] = shared;
+                futures.addFuture(QtConcurrent::run(_projectStageList, &stages[i], prefix, &m[i], &branchFTEs[i]));
+            }
+            futures.waitForFinished();
+            for (int i=0; i<stages.size(); i++)
+                m[i].append(branchFTEs[i]);
+        } else {
+            for (int i=0; i<transforms.size(); i++)
+                futures.addFuture(QtConcurrent::run(_projectList, transforms[i], &src, &m[i]));
+            futures.waitForFinished();
+        }
+
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
-        foreach (const Transform *f, transforms) {
-            TemplateList m;
-            f->project(src, m);
-            if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
-            for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
+        for (int j=0; j<m.size(); j++) {
+            if (m[j].size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
+            for (int i=0; i<src.size(); i++) dst[i].merge(m[j][i]);
         }
     }
 
@@ -14,8 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/numa.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
@@ -24,53 +28,200 @@ namespace br
  * \ingroup transforms
  * \brief Compare each Template to a fixed Gallery (with name = galleryName), using the specified distance.
  * dst will contain a 1 by n vector of scores.
+ *
+ * In numa mode the gallery is copied to every memory node by a thread bound to that node. If replicate
+ * is false each node holds a contiguous shard, queries are compared against every shard by workers
+ * pinned to the shard's node and the per-node results are merged. If replicate is true each node holds
+ * the whole gallery and queries are compared against the copy local to the calling thread, which is
+ * best combined with pinned stream workers (see DirectStreamTransform).
  * \author Charles Otto \cite caotto
+ * \br_property br::Distance* distance Distance used to compare templates.
+ * \br_property QString galleryName Gallery to compare against.
+ * \br_property bool numa Place the gallery and compare workers per NUMA node. Default is false.
+ * \br_property bool replicate In numa mode, copy the whole gallery to each node rather than sharding it. Default is false.
+ * \br_property int topK If positive, dst holds only the K highest scores in descending order and the gallery index of each score is stored in the metadata key "GalleryIndices". Default is 0.
  */
 class GalleryCompareTransform : public Transform
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED true)
     Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa STORED false)
+    Q_PROPERTY(bool replicate READ get_replicate WRITE set_replicate RESET reset_replicate STORED false)
+    Q_PROPERTY(int topK READ get_topK WRITE set_topK RESET reset_topK STORED false)
     BR_PROPERTY(br::Distance*, distance, NULL)
     BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(bool, numa, false)
+    BR_PROPERTY(bool, replicate, false)
+    BR_PROPERTY(int, topK, 0)
+
+    typedef QPair<float,int> Score;
 
+    // In numa mode the gallery is released once it is placed, leaving only the shards
     TemplateList gallery;
+    int gallerySize;
+
+    // Per-node copies of the gallery, the gallery index of their first template, and node-bound workers
+    QList<TemplateList> shards;
+    QList<int> offsets;
+    QList<QThreadPool*> pools;
 
     void project(const Template &src, Template &dst) const
     {
         dst = src;
-        if (gallery.isEmpty())
+        if (gallerySize == 0)
+            return;
+
+        if (!numa && topK <= 0) {
+            dst.m() = OpenCVUtils::toMat(distance->compare(gallery, src), 1);
+            return;
+        }
+
+        QList<Score> scores;
+        if (!numa) {
+            scores = search(gallery, 0, src);
+        } else if (replicate) {
+            scores = search(shards[NUMA::currentNode() % shards.size()], 0, src);
+        } else {
+            QList< QFuture< QList<Score> > > futures;
+            for (int node=0; node<shards.size(); node++)
+                futures.append(QtConcurrent::run(pools[node], this, &GalleryCompareTransform::searchOn, node, src));
+            for (int node=0; node<futures.size(); node++)
+                scores.append(futures[node].result());
+            if (topK > 0)
+                scores = best(scores);
+        }
+
+        if (topK <= 0) {
+            QList<float> line;
+            line.reserve(scores.size());
+            foreach (const Score &score, scores)
+                line.append(score.first);
+            dst.m() = OpenCVUtils::toMat(line, 1);
+        } else {
+            QList<float> line;
+            QList<int> indices;
+            foreach (const Score &score, scores) {
+                line.append(score.first);
+                indices.append(score.second);
+            }
+            dst.m() = OpenCVUtils::toMat(line, 1);
+            dst.file.set("GalleryIndices", QtUtils::toVariantList(indices));
+        }
+    }
+
+    // Scores against 'targets' paired with their gallery index, in gallery order unless topK is set
+    QList<Score> search(const TemplateList &targets, int offset, const Template &src) const
+    {
+        const QList<float> line = distance->compare(targets, src);
+        QList<Score> scores;
+        scores.reserve(line.size());
+        for (int i=0; i<line.size(); i++)
+            scores.append(Score(line[i], offset + i));
+        return topK > 0 ? best(scores) : scores;
+    }
+
+    QList<Score> searchOn(int node, const Template &src) const
+    {
+        NUMA::bind(node);
+        return search(shards[node], offsets[node], src);
+    }
+
+    QList<Score> best(QList<Score> scores) const
+    {
+        const int k = std::min(topK, scores.size());
+        std::partial_sort(scores.begin(), scores.begin() + k, scores.end(), std::greater<Score>());
+        return scores.mid(0, k);
+    }
+
+    // Deep copy so the pages are first touched, and therefore allocated, on the bound node
+    TemplateList place(int node, const TemplateList &templates) const
+    {
+        NUMA::bind(node);
+        TemplateList copy;
+        copy.reserve(templates.size());
+        foreach (const Template &t, templates) {
+            Template u(t.file);
+            foreach (const cv::Mat &m, t)
+                u.append(m.clone());
+            copy.append(u);
+        }
+        return copy;
+    }
+
+    // The whole gallery, reassembled from the shards in numa mode
+    TemplateList templates() const
+    {
+        if (shards.isEmpty())
+            return gallery;
+        if (replicate)
+            return shards.first();
+        TemplateList result;
+        result.reserve(gallerySize);
+        foreach (const TemplateList &shard, shards)
+            result.append(shard);
+        return result;
+    }
+
+    void distribute()
+    {
+        qDeleteAll(pools);
+        pools.clear();
+        shards.clear();
+        offsets.clear();
+        gallerySize = gallery.size();
+        if (!numa || gallery.isEmpty())
             return;
 
-        QList<float> line = distance->compare(gallery, src);
-        dst.m() = OpenCVUtils::toMat(line, 1);
+        const int nodes = NUMA::nodes();
+        QList< QFuture<TemplateList> > futures;
+        for (int node=0; node<nodes; node++) {
+            QThreadPool *pool = new QThreadPool();
+            pool->setMaxThreadCount(std::max(NUMA::cpus(node).size(), 1));
+            pools.append(pool);
+
+            const int begin = replicate ? 0 : node * gallery.size() / nodes;
+            const int end = replicate ? gallery.size() : (node+1) * gallery.size() / nodes;
+            offsets.append(begin);
+            futures.append(QtConcurrent::run(pool, this, &GalleryCompareTransform::place, node, gallery.mid(begin, end-begin)));
+        }
+        foreach (const QFuture<TemplateList> &future, futures)
+            shards.append(future.result());
+        gallery.clear();
+
+        if (Globals->verbose)
+            qDebug("GalleryCompare placed %d templates on %d NUMA node(s)%s.", gallerySize, nodes, replicate ? " (replicated)" : "");
     }
 
     void init()
     {
         if (!galleryName.isEmpty())
             gallery = TemplateList::fromGallery(galleryName);
+        distribute();
     }
 
     void train(const TemplateList &data)
     {
         gallery = data;
+        distribute();
     }
 
     void store(QDataStream &stream) const
     {
         br::Object::store(stream);
-        stream << gallery;
+        stream << templates();
     }
 
     void load(QDataStream &stream)
     {
         br::Object::load(stream);
         stream >> gallery;
+        distribute();
     }
 
 public:
-    GalleryCompareTransform() : Transform(false, true) {}
+    GalleryCompareTransform() : Transform(false, true), gallerySize(0) {}
+    ~GalleryCompareTransform() { qDeleteAll(pools); }
 };
 
 BR_REGISTER(Transform, GalleryCompareTransform)
@@ -28,6 +28,7 @@ namespace br
  * \brief Clones the Transform so that it can be applied independently.
  *
  * Independent Transforms expect single-matrix Templates.
+ * Template lists are handed to the clones whole when every clone declares the BatchProject class info.
  *
  * \author Josh Klontz \cite jklontz
  */
@@ -59,6 +60,15 @@ class IndependentTransform : public MetaTransform
         return true;
     }
 
+    // The per-matrix transforms, which after training are distinct clones of transform
+    QList<Object *> getChildren() const
+    {
+        QList<Object *> children;
+        foreach (Transform *t, transforms)
+            children.append(t);
+        return children;
+    }
+
     Transform *simplify(bool &newTransform)
     {
         newTransform = false;
@@ -169,6 +179,42 @@ class IndependentTransform : public MetaTransform
         dst.append(mats);
     }
 
+    // Hands each transform all of the matrices it applies to at once, so that batched implementations see the whole list.
+    // Only transforms that declare the BatchProject class info are known to project lists one-to-one.
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (const Transform *t, transforms)
+            if (t->metaObject()->indexOfClassInfo("BatchProject") == -1) {
+                Transform::project(src, dst);
+                return;
+            }
+
+        QVector<TemplateList> inputs(transforms.size()), outputs(transforms.size());
+        for (int i=0; i<src.size(); i++)
+            for (int j=0; j<src[i].size(); j++)
+                inputs[j%transforms.size()].append(Template(src[i].file, src[i][j]));
+
+        for (int t=0; t<transforms.size(); t++) {
+            if (inputs[t].isEmpty())
+                continue;
+            transforms[t]->project(inputs[t], outputs[t]);
+            if (outputs[t].size() != inputs[t].size())
+                qFatal("%s declares BatchProject but did not project its list one-to-one.", qPrintable(transforms[t]->objectName()));
+        }
+
+        QVector<int> next(transforms.size(), 0);
+        dst.reserve(dst.size() + src.size());
+        for (int i=0; i<src.size(); i++) {
+            Template t(src[i].file);
+            for (int j=0; j<src[i].size(); j++) {
+                const Template &out = outputs[j%transforms.size()][next[j%transforms.size()]++];
+                t.file = out.file;
+                t.append(out.isEmpty() ? Mat() : out.last());
+            }
+            dst.append(t);
+        }
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst.file = src.file;
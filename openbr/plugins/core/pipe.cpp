@@ -15,53 +15,342 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtConcurrent>
+#include <QCryptographicHash>
+#include <QTemporaryDir>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
 
+static qint64 residentBytes(const TemplateList &templates)
+{
+    qint64 bytes = 0;
+    foreach (const Template &t, templates)
+        foreach (const cv::Mat &m, t)
+            bytes += m.total() * m.elemSize();
+    return bytes;
+}
+
+static qint64 residentBytes(const QList<TemplateList> &dataLines)
+{
+    qint64 bytes = 0;
+    foreach (const TemplateList &templates, dataLines)
+        bytes += residentBytes(templates);
+    return bytes;
+}
+
+static QString partialGallery(const QString &gallery)
+{
+    return gallery.left(gallery.size() - 4) + ".part.gal";
+}
+
+// Galleries are written under a temporary name and renamed once complete, so a checkpoint is never partial
+static void commitGallery(const QString &gallery)
+{
+    const QString part = partialGallery(gallery);
+    if (!QFileInfo(part).exists()) {
+        // Nothing was written, but the empty line must still be readable
+        QFile file(part);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Can't open gallery: %s for writing", qPrintable(part));
+    }
+    QFile::remove(gallery);
+    if (!QFile::rename(part, gallery))
+        qFatal("Failed to rename %s to %s.", qPrintable(part), qPrintable(gallery));
+}
+
+static TemplateList readTrainingBlock(Gallery *gallery, bool *done)
+{
+    TemplateList templates = gallery->readBlock(done);
+    for (int i=0; i<templates.size(); i++) {
+        // Added by the gallery, not part of the training data
+        templates[i].file.remove("FTE");
+        templates[i].file.remove("progress");
+    }
+    return templates;
+}
+
+static void readTrainingLine(const QString *gallery, TemplateList *templates)
+{
+    QScopedPointer<Gallery> input(Gallery::make(*gallery));
+    bool done = false;
+    while (!done)
+        templates->append(readTrainingBlock(input.data(), &done));
+}
+
+static void writeTrainingLine(const TemplateList *templates, const QString *gallery)
+{
+    {
+        QScopedPointer<Gallery> output(Gallery::make(partialGallery(*gallery)));
+        output->writeBlock(*templates);
+    }
+    commitGallery(*gallery);
+}
+
+static void removeGalleries(const QStringList &galleries, const QStringList &keep)
+{
+    foreach (const QString &gallery, galleries)
+        if (!keep.contains(gallery))
+            QFile::remove(gallery);
+}
+
 /*!
  * \ingroup Transforms
  * \brief Transforms in series.
  *
  * The source Template is given to the first transform and the resulting Template is passed to the next transform, etc.
  *
+ * During training with a memory budget, runs of untrainable stages project the data lines one block at a time,
+ * and the lines are spilled to galleries on disk as soon as they would exceed the budget. Trainable stages are still handed all of their data.
+ * When checkpointing, the trained state of each stage and the input of each trainable stage are saved as they are produced,
+ * and training the same pipe on the same data again resumes at the first untrained stage.
+ *
+ * When the global decodeHints parameter is set, decoders such as Open and Read receive the resolution and color space
+ * needed by the transforms right after them as template metadata, so images can be decoded at a reduced scale.
+ *
  * \author Josh Klontz \cite jklontz
  * \br_related_plugin ExpandTransform ForkTransform
+ * \br_property QString checkpoint Directory to save training progress to. Default is the global checkpoint parameter, or empty for no checkpoints.
+ * \br_property int memoryBudget Megabytes of training data to keep in memory between stages before spilling to disk, 0 for no limit. Default is the global memoryBudget parameter, or 0.
  */
 class PipeTransform : public CompositeTransform
 {
     Q_OBJECT
+    Q_PROPERTY(QString checkpoint READ get_checkpoint WRITE set_checkpoint RESET reset_checkpoint STORED false)
+    Q_PROPERTY(int memoryBudget READ get_memoryBudget WRITE set_memoryBudget RESET reset_memoryBudget STORED false)
+    BR_PROPERTY(QString, checkpoint, Globals->file.get<QString>("checkpoint", QString()))
+    BR_PROPERTY(int, memoryBudget, Globals->file.get<int>("memoryBudget", 0))
+
+    QHash<int, QVariantMap> decodeHints; // Metadata handed to the decoder at each index, see findDecodeHints()
 
     void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex)
     {
         TemplateList ftes;
         for (int i=startIndex; i<stopIndex; i++) {
             TemplateList res;
-            transforms[i]->project(*srcdst, res);
+            projectStage(i, *srcdst, res);
 
             splitFTEs(res, ftes);
             *srcdst = res;
         }
     }
 
+    // Same as _projectPartial, for a line spilled to disk, holding one block in memory at a time
+    void _projectGallery(const QString *input, const QString *output, int startIndex, int stopIndex)
+    {
+        {
+            QScopedPointer<Gallery> src(Gallery::make(*input));
+            QScopedPointer<Gallery> dst(Gallery::make(partialGallery(*output)));
+            bool done = false;
+            while (!done) {
+                TemplateList block = readTrainingBlock(src.data(), &done);
+                _projectPartial(&block, startIndex, stopIndex);
+                dst->writeBlock(block);
+            }
+        }
+        commitGallery(*output);
+    }
+
+    // Same as _projectPartial over every resident line, one block at a time, so the input and the projected templates
+    // together stay under the budget. Once they would exceed it, the lines are spilled to galleries and the rest of the
+    // input is projected straight to them. Returns true if the lines were spilled.
+    bool _projectResident(QList<TemplateList> &dataLines, const QStringList &galleries, int startIndex, int stopIndex, qint64 budget)
+    {
+        qint64 inputBytes = residentBytes(dataLines), projectedBytes = 0;
+        QList<TemplateList> projected;
+        QList< QSharedPointer<Gallery> > outputs;
+
+        for (int j=0; j<dataLines.size(); j++) {
+            projected.append(TemplateList());
+            while (!dataLines[j].isEmpty()) {
+                const int size = std::min(Globals->blockSize, dataLines[j].size());
+                TemplateList block = dataLines[j].mid(0, size);
+                dataLines[j].erase(dataLines[j].begin(), dataLines[j].begin() + size);
+                inputBytes -= residentBytes(block);
+
+                _projectPartial(&block, startIndex, stopIndex);
+
+                if (!outputs.isEmpty()) {
+                    outputs[j]->writeBlock(block);
+                    continue;
+                }
+
+                projectedBytes += residentBytes(block);
+                projected[j].append(block);
+                if (inputBytes + projectedBytes > budget) {
+                    for (int k=0; k<galleries.size(); k++) {
+                        outputs.append(QSharedPointer<Gallery>(Gallery::make(partialGallery(galleries[k]))));
+                        if (k <= j)
+                            outputs[k]->writeBlock(projected[k]);
+                    }
+                    projected.clear();
+                }
+            }
+        }
+
+        if (outputs.isEmpty()) {
+            dataLines = projected;
+            return false;
+        }
+
+        outputs.clear();
+        foreach (const QString &gallery, galleries)
+            commitGallery(gallery);
+        dataLines.clear();
+        return true;
+    }
+
+    // Identifies this pipe and its training data, so that checkpoints are only resumed by the same training run
+    QString checkpointDirectory(const QList<TemplateList> &data) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(description(false).toUtf8());
+        foreach (const TemplateList &templates, data) {
+            hash.addData(QByteArray::number(templates.size()));
+            foreach (const Template &t, templates)
+                hash.addData(t.file.name.toUtf8());
+        }
+        return checkpoint + "/" + hash.result().toHex();
+    }
+
+    static QString model(const QString &directory, int stage)
+    {
+        return QString("%1/%2.model").arg(directory, QString::number(stage));
+    }
+
+    static QStringList galleries(const QString &directory, int stage, int lines)
+    {
+        QStringList galleries;
+        for (int j=0; j<lines; j++)
+            galleries.append(QString("%1/%2.%3.gal").arg(directory, QString::number(stage), QString::number(j)));
+        return galleries;
+    }
+
+    static QString scratchDirectory(QScopedPointer<QTemporaryDir> &scratch)
+    {
+        if (!scratch) {
+            QtUtils::touchDir(QDir(Context::scratchPath()));
+            scratch.reset(new QTemporaryDir(Context::scratchPath() + "/pipe-XXXXXX"));
+            if (!scratch->isValid())
+                qFatal("Failed to create a temporary directory in %s.", qPrintable(Context::scratchPath()));
+        }
+        return scratch->path();
+    }
+
+    static bool exists(const QStringList &files)
+    {
+        foreach (const QString &file, files)
+            if (!QFileInfo(file).exists())
+                return false;
+        return true;
+    }
+
+    void storeStage(int stage, const QString &file) const
+    {
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        transforms[stage]->store(stream);
+        QtUtils::writeFile(file + ".part", data);
+        QFile::remove(file);
+        if (!QFile::rename(file + ".part", file))
+            qFatal("Failed to rename %s to %s.", qPrintable(file + ".part"), qPrintable(file));
+    }
+
+    void loadStage(int stage, const QString &file)
+    {
+        QByteArray data;
+        QtUtils::readFile(file, data);
+        QDataStream stream(&data, QFile::ReadOnly);
+        transforms[stage]->load(stream);
+    }
+
+    // The latest stage whose input was saved and that every earlier trainable stage was trained for
+    int resumableStage(const QString &directory, int lines) const
+    {
+        int stage = 0;
+        for (int i=0; i<transforms.size(); i++) {
+            // The state a time varying transform accumulates during training isn't saved
+            if (transforms[i]->timeVarying())
+                break;
+            if ((i > 0) && exists(galleries(directory, i, lines)))
+                stage = i;
+            if (transforms[i]->trainable && !QFileInfo(model(directory, i)).exists())
+                break;
+        }
+        return stage;
+    }
+
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
 
         QList<TemplateList> dataLines(data);
 
+        // Data lines are resident in memory, saved to the galleries on disk, or both
+        const qint64 budget = qint64(memoryBudget) * 1024 * 1024;
+        QStringList saved;
+        bool resident = true;
+
+        QString directory;
+        QScopedPointer<QTemporaryDir> scratch;
+        if (!checkpoint.isEmpty()) {
+            directory = checkpointDirectory(data);
+            QtUtils::touchDir(QDir(directory));
+        }
+
         int i = 0;
+        if (!directory.isEmpty() && ((i = resumableStage(directory, data.size())) > 0)) {
+            qDebug() << "Resuming training at" << transforms[i]->description() << "\n...";
+            for (int j=0; j<i; j++)
+                if (transforms[j]->trainable)
+                    loadStage(j, model(directory, j));
+            saved = galleries(directory, i, data.size());
+            dataLines.clear();
+            resident = false;
+        }
+
         while (i < transforms.size()) {
+            const QString stageModel = directory.isEmpty() ? QString() : model(directory, i);
+
             // Conditional statement covers likely case that first transform is untrainable
             if (transforms[i]->trainable) {
-                qDebug() << "Training" << transforms[i]->description() << "\n...";
-                transforms[i]->train(dataLines);
+                if (!stageModel.isEmpty() && QFileInfo(stageModel).exists()) {
+                    qDebug() << "Loading" << transforms[i]->description() << "\n...";
+                    loadStage(i, stageModel);
+                } else {
+                    QList<TemplateList> trainingLines(dataLines);
+                    if (!resident) {
+                        // Trainable transforms need all of their data at once
+                        trainingLines = QList<TemplateList>();
+                        for (int j=0; j<saved.size(); j++)
+                            trainingLines.append(TemplateList());
+                        QFutureSynchronizer<void> futures;
+                        for (int j=0; j<saved.size(); j++)
+                            futures.addFuture(QtConcurrent::run(readTrainingLine, &saved[j], &trainingLines[j]));
+                        futures.waitForFinished();
+                    }
+
+                    qDebug() << "Training" << transforms[i]->description() << "\n...";
+                    transforms[i]->train(trainingLines);
+                    if (!stageModel.isEmpty())
+                        storeStage(i, stageModel);
+                }
             }
 
             // if the transform is time varying, we can't project it in parallel
             if (transforms[i]->timeVarying()) {
+                if (!resident) {
+                    for (int j=0; j<saved.size(); j++) {
+                        dataLines.append(TemplateList());
+                        readTrainingLine(&saved[j], &dataLines.last());
+                    }
+                    resident = true;
+                }
+                removeGalleries(saved, QStringList());
+                saved.clear();
+
                 qDebug() << "Projecting" << transforms[i]->description() << "\n...";
                 for (int j=0; j < dataLines.size();j++) {
                     TemplateList junk;
@@ -98,10 +387,44 @@ class PipeTransform : public CompositeTransform
             fprintf(stderr, "\n...\n");
             fflush(stderr);
 
-            QFutureSynchronizer<void> futures;
-            for (int j=0; j < dataLines.size(); j++)
-                futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform));
-            futures.waitForFinished();
+            const int lines = data.size();
+            QStringList next;
+            if (resident && (budget > 0)) {
+                next = galleries(directory.isEmpty() ? scratchDirectory(scratch) : directory, nextTrainableTransform, lines);
+                if (_projectResident(dataLines, next, i, nextTrainableTransform, budget)) {
+                    resident = false;
+                } else if (!directory.isEmpty()) {
+                    QFutureSynchronizer<void> writes;
+                    for (int j=0; j < lines; j++)
+                        writes.addFuture(QtConcurrent::run(writeTrainingLine, &dataLines[j], &next[j]));
+                    writes.waitForFinished();
+                } else {
+                    next.clear();
+                }
+            } else if (resident) {
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j < dataLines.size(); j++)
+                    futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform));
+                futures.waitForFinished();
+
+                if (!directory.isEmpty()) {
+                    next = galleries(directory, nextTrainableTransform, lines);
+                    QFutureSynchronizer<void> writes;
+                    for (int j=0; j < lines; j++)
+                        writes.addFuture(QtConcurrent::run(writeTrainingLine, &dataLines[j], &next[j]));
+                    writes.waitForFinished();
+                }
+            } else {
+                next = galleries(directory.isEmpty() ? scratchDirectory(scratch) : directory, nextTrainableTransform, lines);
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j < lines; j++)
+                    futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectGallery, &saved[j], &next[j], i, nextTrainableTransform));
+                futures.waitForFinished();
+            }
+
+            // Only the input of the latest trainable stage is kept
+            removeGalleries(saved, next);
+            saved = next;
 
             i = nextTrainableTransform;
         }
@@ -110,9 +433,12 @@ class PipeTransform : public CompositeTransform
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
-        foreach (Transform *f, transforms) {
+        for (int i=0; i<transforms.size(); i++) {
+            Transform *f = transforms[i];
             try {
+                if (decodeHints.contains(i)) addDecodeHints(i, dst.file);
                 f->projectUpdate(dst);
+                if (decodeHints.contains(i)) removeDecodeHints(i, dst.file);
                 if (dst.file.fte)
                     break;
             } catch (...) {
@@ -130,9 +456,17 @@ class PipeTransform : public CompositeTransform
     {
         TemplateList ftes;
         dst = src;
-        foreach (Transform *f, transforms) {
+        for (int i=0; i<transforms.size(); i++) {
             TemplateList res;
-            f->projectUpdate(dst, res);
+            if (decodeHints.contains(i)) {
+                for (int j=0; j<dst.size(); j++)
+                    addDecodeHints(i, dst[j].file);
+                transforms[i]->projectUpdate(dst, res);
+                for (int j=0; j<res.size(); j++)
+                    removeDecodeHints(i, res[j].file);
+            } else {
+                transforms[i]->projectUpdate(dst, res);
+            }
             splitFTEs(res, ftes);
             dst = res;
         }
@@ -177,6 +511,75 @@ class PipeTransform : public CompositeTransform
         transforms = flattened;
 
         CompositeTransform::init();
+        findDecodeHints();
+    }
+
+    // With the global decodeHints parameter set, decoders (Open and Read) are told through template metadata the lowest
+    // resolution, and the color space, that the transforms immediately following them will use.
+    void findDecodeHints()
+    {
+        decodeHints.clear();
+        if (!Globals->file.getBool("decodeHints"))
+            return;
+
+        for (int i=0; i<transforms.size()-1; i++) {
+            if (transforms[i]->metaObject()->indexOfClassInfo("DecodeHints") == -1)
+                continue;
+
+            QVariantMap hints;
+            for (int j=i+1; j<transforms.size(); j++) {
+                QVariantMap next;
+                if (!QMetaObject::invokeMethod(transforms[j], "decodeHints", Qt::DirectConnection, Q_RETURN_ARG(QVariantMap, next)) || next.isEmpty())
+                    break;
+                foreach (const QString &key, next.keys())
+                    hints.insert(key, next[key]);
+
+                // Transforms that keep the image size, like Cvt(Gray), let the one after them add hints too
+                if (next.contains("DecodeMinShortSide") || next.contains("DecodeMinLongSide"))
+                    break;
+            }
+
+            if (!hints.isEmpty())
+                decodeHints.insert(i, hints);
+        }
+    }
+
+    void addDecodeHints(int i, File &file) const
+    {
+        const QVariantMap &hints = decodeHints[i];
+        foreach (const QString &key, hints.keys())
+            file.set(key, hints[key]);
+    }
+
+    void removeDecodeHints(int i, File &file) const
+    {
+        foreach (const QString &key, decodeHints[i].keys())
+            file.remove(key);
+    }
+
+    // Applies transform i, handing it any decode hints through metadata that is removed again afterwards
+    void projectStage(int i, const TemplateList &src, TemplateList &dst) const
+    {
+        if (!decodeHints.contains(i)) {
+            transforms[i]->project(src, dst);
+            return;
+        }
+
+        TemplateList hinted(src);
+        for (int j=0; j<hinted.size(); j++)
+            addDecodeHints(i, hinted[j].file);
+        transforms[i]->project(hinted, dst);
+        for (int j=0; j<dst.size(); j++)
+            removeDecodeHints(i, dst[j].file);
+    }
+
+    void projectStage(int i, Template &t) const
+    {
+        if (decodeHints.contains(i))
+            addDecodeHints(i, t.file);
+        t >> *transforms[i];
+        if (decodeHints.contains(i))
+            removeDecodeHints(i, t.file);
     }
 
     QByteArray likely(const QByteArray &indentation) const
@@ -203,9 +606,9 @@ protected:
     {
         TemplateList ftes;
         dst = src;
-        foreach (const Transform *f, transforms) {
+        for (int i=0; i<transforms.size(); i++) {
             TemplateList res;
-            f->project(dst, res);
+            projectStage(i, dst, res);
             splitFTEs(res, ftes);
             dst = res;
         }
@@ -216,13 +619,13 @@ protected:
    virtual void _project(const Template &src, Template &dst) const
    {
        dst = src;
-       foreach (const Transform *f, transforms) {
+       for (int i=0; i<transforms.size(); i++) {
            try {
-               dst >> *f;
+               projectStage(i, dst);
                if (dst.file.fte)
                    break;
            } catch (...) {
-               qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
+               qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transforms[i]->objectName()));
                dst = Template(src.file);
                dst.file.fte = true;
            }
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QDateTime>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
@@ -26,6 +27,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/numa.h>
 #include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
 
@@ -38,15 +40,101 @@ namespace br
 class FrameData
 {
 public:
+    FrameData() : sequenceNumber(-1), dropped(false), readTime(0) {}
+
     int sequenceNumber;
     TemplateList data;
+
+    // Dropped frames still travel through the stages to keep sequence numbers contiguous,
+    // but are not projected
+    bool dropped;
+    // Milliseconds since the epoch at which the frame was read
+    qint64 readTime;
+};
+
+// Frame dropping policy and counters shared by the stages of a live stream.
+// A frame is late if it has waited longer than the deadline, or if too many frames are in flight
+// when it is read. The policy decides which late frames may be skipped.
+class LiveControl
+{
+public:
+    enum Policy { None, Latest, EveryNth };
+
+    LiveControl() : policy(None), deadline(0), keepEvery(1), maxInFlight(1) { reset(); }
+
+    Policy policy;
+    qint64 deadline;
+    int keepEvery;
+    int maxInFlight;
+
+    void reset()
+    {
+        QMutexLocker lock(&statsGuard);
+        dropped = delivered = 0;
+        totalLatency = maxLatency = 0;
+    }
+
+    void stamp(FrameData *frame)
+    {
+        frame->readTime = QDateTime::currentMSecsSinceEpoch();
+        for (int i=0; i<frame->data.size(); i++) {
+            frame->data[i].file.set("FrameReadTime", frame->readTime);
+            frame->data[i].file.set("DroppedFrames", droppedFrames());
+        }
+    }
+
+    // Returns true if the frame is, or has now been, dropped
+    bool drop(FrameData *frame, bool behind)
+    {
+        if (frame->dropped)
+            return true;
+        if (!behind && (deadline <= 0 || QDateTime::currentMSecsSinceEpoch() - frame->readTime <= deadline))
+            return false;
+        if (policy == EveryNth && frame->sequenceNumber % keepEvery == 0)
+            return false;
+
+        frame->dropped = true;
+        QMutexLocker lock(&statsGuard);
+        dropped++;
+        return true;
+    }
+
+    // Called when a frame that was not dropped reaches the end of the stream
+    void deliver(FrameData *frame)
+    {
+        const qint64 latency = QDateTime::currentMSecsSinceEpoch() - frame->readTime;
+        for (int i=0; i<frame->data.size(); i++)
+            frame->data[i].file.set("Latency", latency);
+
+        QMutexLocker lock(&statsGuard);
+        delivered++;
+        totalLatency += latency;
+        maxLatency = std::max(maxLatency, latency);
+    }
+
+    qint64 droppedFrames()
+    {
+        QMutexLocker lock(&statsGuard);
+        return dropped;
+    }
+
+    void report()
+    {
+        QMutexLocker lock(&statsGuard);
+        qDebug("Stream delivered %lld frames and dropped %lld, mean latency %.1f ms, max latency %lld ms",
+               delivered, dropped, delivered > 0 ? double(totalLatency) / delivered : 0.0, maxLatency);
+    }
+
+private:
+    QMutex statsGuard;
+    qint64 dropped, delivered, totalLatency, maxLatency;
 };
 
 // A buffer shared between adjacent processing stages in a stream
 class SharedBuffer
 {
 public:
-    SharedBuffer() {}
+    SharedBuffer() : live(NULL) {}
     virtual ~SharedBuffer() {}
 
     virtual void addItem(FrameData *input)=0;
@@ -54,6 +142,8 @@ public:
 
     virtual FrameData *tryGetItem()=0;
     virtual int size()=0;
+
+    LiveControl *live;
 };
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
@@ -92,6 +182,11 @@ public:
 
         FrameData *output = result.value();
         buffer.erase(result);
+
+        // Frames are only dropped here once they are past the deadline, not for being overtaken
+        if (live)
+            live->drop(output, false);
+
         return output;
     }
 
@@ -268,6 +363,8 @@ class DataSource
 public:
     DataSource(int maxFrames=500)
     {
+        this->maxFrames = maxFrames;
+        live = NULL;
         // The sequence number of the last frame
         final_frame = -1;
         for (int i=0; i < maxFrames;i++)
@@ -351,6 +448,11 @@ public:
             final_frame = aFrame->sequenceNumber;
             aFrame->data().clear();
         }
+        // Skip frames read while too many earlier frames are still in flight
+        else if (live) {
+            live->stamp(aFrame);
+            live->drop(aFrame, maxFrames - allFrames.size() > live->maxInFlight);
+        }
 
         // If this is the last frame, say so
         if (aFrame->sequenceNumber == final_frame) {
@@ -369,6 +471,7 @@ public:
 
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
+        inputFrame->dropped = false;
         allFrames.addItem(inputFrame);
 
         bool rval = false;
@@ -402,6 +505,8 @@ public:
         return true;
     }
 
+    LiveControl *live;
+
 protected:
 
     bool openNextTemplate()
@@ -472,6 +577,7 @@ protected:
     // processor for the current template
     StreamGallery frameSource;
 
+    int maxFrames;
     int next_sequence_number;
     int final_frame;
     bool is_broken;
@@ -508,6 +614,8 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        pinThreads = false;
+        live = NULL;
     }
     virtual ~ProcessingStage() {}
 
@@ -517,6 +625,12 @@ public:
 
     int stage_id;
 
+    // If true, loops starting at this stage bind their pool thread to a NUMA node
+    bool pinThreads;
+
+    // Frame dropping for live streams, NULL if every frame is processed
+    LiveControl *live;
+
     virtual void reset()=0;
 
     virtual void status()=0;
@@ -545,12 +659,17 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
-        TemplateList ftes;
-        splitFTEs(input->data, ftes);
-        TemplateList res;
-        transform->project(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        if (live)
+            live->drop(input, false);
+
+        if (!input->dropped) {
+            TemplateList ftes;
+            splitFTEs(input->data, ftes);
+            TemplateList res;
+            transform->project(input->data, res);
+            input->data = res;
+            input->data.append(ftes);
+        }
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -627,12 +746,18 @@ public:
 
         next_target = input->sequenceNumber + 1;
 
-        TemplateList ftes;
-        splitFTEs(input->data, ftes);
-        TemplateList res;
-        transform->projectUpdate(input->data, res);
-        input->data = res;
-        input->data.append(ftes);
+        // Work already done on a frame is never discarded at the end stage
+        if (live && this != stages->last())
+            live->drop(input, false);
+
+        if (!input->dropped) {
+            TemplateList ftes;
+            splitFTEs(input->data, ftes);
+            TemplateList res;
+            transform->projectUpdate(input->data, res);
+            input->data = res;
+            input->data.append(ftes);
+        }
 
         should_continue = nextStage->tryAcquireNextStage(input,final);
 
@@ -727,7 +852,10 @@ public:
             else
                 input->data[i].file.set("FTE",QVariant::fromValue(false));
         }
-        
+
+        if (live && !input->dropped)
+            live->deliver(input);
+
         return SingleThreadStage::tryAcquireNextStage(input, final);
     }
 
@@ -888,6 +1016,11 @@ void BasicLoop::run()
     FrameData *target_item = startItem;
     bool should_continue = true;
     bool the_end = false;
+
+    // Pool threads are reused, so this only binds a thread the first time it runs a loop
+    if (stages->at(start_idx)->pinThreads)
+        NUMA::bindNext();
+
     forever
     {
         target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
@@ -909,6 +1042,10 @@ void BasicLoop::run()
  * \ingroup transforms
  * \brief DOCUMENT ME CHARLES
  * \author Charles Otto \cite caotto
+ * \br_property bool numa If true, pool threads running stream stages are bound round-robin to NUMA nodes. Default is false.
+ * \br_property enum dropPolicy Which late frames of a live source may be skipped. Options are [None, Latest, EveryNth]. None processes every frame, Latest skips any late frame, and EveryNth keeps every keepEvery-th frame. Default is None.
+ * \br_property int deadline Milliseconds after it was read that a frame becomes late, 0 means frames are only late when too many are in flight. Default is 0.
+ * \br_property int keepEvery Sampling interval for the EveryNth policy. Default is 5.
  */
 class DirectStreamTransform : public CompositeTransform
 {
@@ -917,8 +1054,22 @@ class DirectStreamTransform : public CompositeTransform
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa STORED false)
+    Q_PROPERTY(DropPolicy dropPolicy READ get_dropPolicy WRITE set_dropPolicy RESET reset_dropPolicy STORED false)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline STORED false)
+    Q_PROPERTY(int keepEvery READ get_keepEvery WRITE set_keepEvery RESET reset_keepEvery STORED false)
+    Q_ENUMS(DropPolicy)
+
+    enum DropPolicy { None = LiveControl::None,
+                      Latest = LiveControl::Latest,
+                      EveryNth = LiveControl::EveryNth };
+
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, numa, false)
+    BR_PROPERTY(DropPolicy, dropPolicy, None)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(int, keepEvery, 5)
 
     friend class StreamTransfrom;
 
@@ -1027,6 +1178,8 @@ public:
             return;
         }
 
+        live.reset();
+
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
         readStage->currentStatus = SingleThreadStage::STARTING;
@@ -1076,6 +1229,9 @@ public:
 
         foreach (ProcessingStage *stage, processingStages)
             stage->reset();
+
+        if (dropPolicy != None && Globals->verbose)
+            live.report();
     }
 
 
@@ -1165,6 +1321,29 @@ public:
         // And the collection stage points to the read stage, because this is
         // a ring buffer.
         collectionStage->nextStage = readStage;
+
+        configureLive();
+    }
+
+    // Hands numa and the frame dropping properties to the stages, called again when they change after init
+    void configureLive()
+    {
+        if (processingStages.isEmpty())
+            return;
+
+        live.policy = static_cast<LiveControl::Policy>(dropPolicy);
+        live.deadline = deadline;
+        live.keepEvery = std::max(keepEvery, 1);
+        live.maxInFlight = Globals->parallelism;
+        LiveControl *control = (dropPolicy == None) ? NULL : &live;
+        readStage->dataSource.live = control;
+
+        foreach (ProcessingStage *stage, processingStages) {
+            stage->pinThreads = numa;
+            stage->live = control;
+            if (SingleThreadStage *single = dynamic_cast<SingleThreadStage *>(stage))
+                single->inputBuffer->live = control;
+        }
     }
 
     ~DirectStreamTransform()
@@ -1185,6 +1364,8 @@ protected:
 
     QList<ProcessingStage *> processingStages;
 
+    LiveControl live;
+
     // This is a map from parent transforms (of Streams) to thread pools. Rather
     // than starting threads on the global thread pool, Stream uses separate thread pools
     // keyed on their parent transform. This is necessary because stream's project starts
@@ -1225,6 +1406,10 @@ BR_REGISTER(Transform, DirectStreamTransform)
  * \ingroup transforms
  * \brief DOCUMENT ME CHARLES
  * \author Charles Otto \cite caotto
+ * \br_property bool numa If true, pool threads running stream stages are bound round-robin to NUMA nodes. Default is false.
+ * \br_property enum dropPolicy Which late frames of a live source may be skipped. Options are [None, Latest, EveryNth]. None processes every frame, Latest skips any late frame, and EveryNth keeps every keepEvery-th frame. Default is None.
+ * \br_property int deadline Milliseconds after it was read that a frame becomes late, 0 means frames are only late when too many are in flight. Default is 0.
+ * \br_property int keepEvery Sampling interval for the EveryNth policy. Default is 5.
  */
 class StreamTransform : public WrapperTransform
 {
@@ -1237,9 +1422,22 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(bool numa READ get_numa WRITE set_numa RESET reset_numa STORED false)
+    Q_PROPERTY(DropPolicy dropPolicy READ get_dropPolicy WRITE set_dropPolicy RESET reset_dropPolicy STORED false)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline STORED false)
+    Q_PROPERTY(int keepEvery READ get_keepEvery WRITE set_keepEvery RESET reset_keepEvery STORED false)
+    Q_ENUMS(DropPolicy)
+
+    enum DropPolicy { None = LiveControl::None,
+                      Latest = LiveControl::Latest,
+                      EveryNth = LiveControl::EveryNth };
 
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(bool, numa, false)
+    BR_PROPERTY(DropPolicy, dropPolicy, None)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(int, keepEvery, 5)
 
     bool timeVarying() const { return true; }
 
@@ -1281,6 +1479,10 @@ public:
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
         basis->endPoint = this->endPoint;
+        basis->numa = this->numa;
+        basis->dropPolicy = static_cast<DirectStreamTransform::DropPolicy>(this->dropPolicy);
+        basis->deadline = this->deadline;
+        basis->keepEvery = this->keepEvery;
 
         // We need at least a CompositeTransform * to acess transform's children.
         CompositeTransform *downcast = dynamic_cast<CompositeTransform *> (transform);
@@ -1353,6 +1555,11 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->numa = this->numa;
+        res->dropPolicy = static_cast<DirectStreamTransform::DropPolicy>(this->dropPolicy);
+        res->deadline = this->deadline;
+        res->keepEvery = this->keepEvery;
+        res->configureLive();
         return res;
     }
 
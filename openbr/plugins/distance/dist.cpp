@@ -16,6 +16,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
@@ -25,6 +26,10 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Standard Distance metrics
+ *
+ * Single channel float matrices are compared with vectorized kernels. When comparing lists, the sums, norms
+ * and square roots needed by Correlation, Bhattacharyya and Cosine are computed once per template,
+ * leaving a single dot product per comparison.
  * \author Josh Klontz \cite jklontz
  */
 class DistDistance : public UntrainableDistance
@@ -50,12 +55,150 @@ private:
     BR_PROPERTY(Metric, metric, L2)
     BR_PROPERTY(bool, negLogPlusOne, true)
 
+    // Per-template quantities which would otherwise be recomputed for every comparison
+    struct Summary
+    {
+        bool valid;
+        double sum, squares;
+        Mat roots; // Element-wise square roots, for Bhattacharyya
+        Summary() : valid(false), sum(0), squares(0) {}
+    };
+
+    static bool vectorizable(const Mat &m)
+    {
+        return (m.type() == CV_32FC1) && m.isContinuous();
+    }
+
+    bool summarized() const
+    {
+        return (metric == Correlation) || (metric == Bhattacharyya) || (metric == Cosine);
+    }
+
+    Summary summarize(const Mat &m) const
+    {
+        Summary s;
+        if (!vectorizable(m))
+            return s;
+        const float *x = m.ptr<float>();
+        const int n = int(m.total());
+        s.valid = true;
+        s.sum = float_sum(x, n);
+        s.squares = float_dot(x, x, n);
+        if (metric == Bhattacharyya)
+            sqrt(m, s.roots);
+        return s;
+    }
+
+    QVector<Summary> summarize(const TemplateList &templates) const
+    {
+        QVector<Summary> summaries(templates.size());
+        for (int i=0; i<templates.size(); i++)
+            if (templates[i].size() == 1)
+                summaries[i] = summarize(templates[i].m());
+        return summaries;
+    }
+
+    // Same as compareHist(HISTCMP_CORREL)
+    static float correlation(double ab, const Summary &a, const Summary &b, int n)
+    {
+        const double scale = 1. / n;
+        const double numerator = ab - a.sum*b.sum*scale;
+        const double denominator = (a.squares - a.sum*a.sum*scale) * (b.squares - b.sum*b.sum*scale);
+        return fabs(denominator) > DBL_EPSILON ? numerator / sqrt(denominator) : 1.;
+    }
+
+    // Same as compareHist(HISTCMP_BHATTACHARYYA)
+    static float bhattacharyya(double coefficient, double sumA, double sumB)
+    {
+        double scale = sumA * sumB;
+        scale = fabs(scale) > FLT_EPSILON ? 1. / sqrt(scale) : 1.;
+        return sqrt(std::max(1. - coefficient*scale, 0.));
+    }
+
+    float finish(float result) const
+    {
+        if (result != result)
+            qFatal("NaN result.");
+
+        return negLogPlusOne ? -log(result+1) : result;
+    }
+
+    float compare(const Mat &a, const Summary &sa, const Mat &b, const Summary &sb) const
+    {
+        const int n = int(a.total());
+        switch (metric) {
+          case Correlation:
+            return correlation(float_dot(a.ptr<float>(), b.ptr<float>(), n), sa, sb, n);
+          case Bhattacharyya:
+            return finish(bhattacharyya(float_dot(sa.roots.ptr<float>(), sb.roots.ptr<float>(), n), sa.sum, sb.sum));
+          default:
+            return float_dot(a.ptr<float>(), b.ptr<float>(), n) / (sqrt(sa.squares) * sqrt(sb.squares));
+        }
+    }
+
+    float compare(const Template &a, const Summary &sa, const Template &b, const Summary &sb) const
+    {
+        if (a.isEmpty() || b.isEmpty())
+            return -std::numeric_limits<float>::max();
+        if (sa.valid && sb.valid && (a.m().size == b.m().size))
+            return compare(a.m(), sa, b.m(), sb);
+        return Distance::compare(a, b);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        if (!summarized())
+            return Distance::compare(targets, query);
+
+        const QVector<Summary> targetSummaries = summarize(targets);
+        const Summary querySummary = query.size() == 1 ? summarize(query.m()) : Summary();
+        QList<float> scores;
+        scores.reserve(targets.size());
+        for (int j=0; j<targets.size(); j++)
+            scores.append(compare(targets[j], targetSummaries[j], query, querySummary));
+        return scores;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        const QVector<Summary> targetSummaries = summarized() ? summarize(target) : QVector<Summary>(target.size());
+        const QVector<Summary> querySummaries = summarized() ? summarize(query) : QVector<Summary>(query.size());
+        QVector<float> row(target.size());
+        for (int i=0; i<query.size(); i++) {
+            for (int j=0; j<target.size(); j++)
+                row[j] = compare(target[j], targetSummaries[j], query[i], querySummaries[i]);
+            output->setRelativeRow(row.constData(), NULL, i+queryOffset, targetOffset, row.size());
+        }
+    }
+
     float compare(const Mat &a, const Mat &b) const
     {
         if ((a.size != b.size) ||
             (a.type() != b.type()))
                 return -std::numeric_limits<float>::max();
 
+        if (vectorizable(a) && vectorizable(b)) {
+            const float *x = a.ptr<float>(), *y = b.ptr<float>();
+            const int n = int(a.total());
+            switch (metric) {
+              case ChiSquared:
+                return finish(float_chi_squared(x, y, n));
+              case Intersection:
+                return finish(float_intersection(x, y, n));
+              case Bhattacharyya:
+                return finish(bhattacharyya(float_sqrt_dot(x, y, n), float_sum(x, n), float_sum(y, n)));
+              case Cosine: {
+                double xx, yy;
+                const double xy = float_dot_norms(x, y, n, &xx, &yy);
+                return xy / (sqrt(xx)*sqrt(yy));
+              }
+              case Dot:
+                return float_dot(x, y, n);
+              default:
+                break;
+            }
+        }
+
 // TODO: this max value is never returned based on the switch / default
         float result = std::numeric_limits<float>::max();
         switch (metric) {
@@ -87,10 +230,7 @@ private:
             qFatal("Invalid metric");
         }
 
-        if (result != result)
-            qFatal("NaN result.");
-
-        return negLogPlusOne ? -log(result+1) : result;
+        return finish(result);
     }
 
     static float cosine(const Mat &a, const Mat &b)
@@ -11,6 +11,16 @@ namespace br
  * \brief Computes Earth Mover's Distance
  * \author Scott Klum \cite sklum
  * \brief https://www.cs.duke.edu/~tomasi/papers/rubner/rubnerTr98.pdf
+ *
+ * Signatures are built once per template. Single row histograms of equal mass have the closed form
+ * sum_k |A_k - B_k| / mass over their cumulative sums A and B, which is exact for every metric since the bins lie on a line.
+ * Other histograms use OpenCV's transportation simplex, or Sinkhorn iterations when regularization is positive.
+ * \br_paper M. Cuturi.
+ *           "Sinkhorn Distances: Lightspeed Computation of Optimal Transport"
+ *           Advances in Neural Information Processing Systems 26, 2013.
+ * \br_property enum metric Ground distance between bins. Options are L1, L2, C. Default is L2.
+ * \br_property float regularization If positive, two dimensional histograms of equal mass are compared with Sinkhorn iterations using this entropic regularization, relative to the largest ground distance. Default is 0.
+ * \br_property int iterations Maximum number of Sinkhorn iterations. Default is 100.
  */
 class EMDDistance : public UntrainableDistance
 {
@@ -18,6 +28,8 @@ class EMDDistance : public UntrainableDistance
 
     Q_ENUMS(Metric)
     Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
+    Q_PROPERTY(float regularization READ get_regularization WRITE set_regularization RESET reset_regularization STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
 
 public:
     enum Metric { L1 = DIST_L1,
@@ -26,32 +38,173 @@ public:
 
 private:
     BR_PROPERTY(Metric, metric, L2)
+    BR_PROPERTY(float, regularization, 0)
+    BR_PROPERTY(int, iterations, 100)
 
-    float compare(const Template &a, const Template &b) const
+    struct Signature
+    {
+        int rows, cols;
+        double mass;
+        bool nonNegative;
+        Mat weights; // 1 x rows*cols
+        Mat signature; // Weight and bin coordinates, as expected by cv::EMD
+        QVector<double> cumulative; // Single row histograms only
+    };
+
+    // Gibbs kernel exp(-C/epsilon) of the ground distances C between the bins of a rows x cols histogram
+    struct Kernel
     {
-        const int dims_a = a.m().rows > 1 ? 3 : 2;
-        const int dims_b = b.m().rows > 1 ? 3 : 2;
+        int rows, cols;
+        Mat K, KC; // KC = K .* C
+        Kernel() : rows(-1), cols(-1) {}
+    };
 
-        Mat sig_a(a.m().cols, dims_a, CV_32FC1);
-        Mat sig_b(b.m().cols, dims_b, CV_32FC1);
+    static Signature signature(const Mat &m)
+    {
+        Signature s;
+        s.rows = m.rows;
+        s.cols = m.cols;
+        m.reshape(1, m.rows).convertTo(s.weights, CV_32F);
+        s.weights = s.weights.reshape(1, 1);
 
-        for (int i=0; i<a.m().rows; i++) {
-            for (int j=0; j<a.m().cols; j++) {
-                sig_a.at<float>(i*a.m().cols+j,0) = a.m().at<float>(i,j);
-                sig_a.at<float>(i*a.m().cols+j,1) = j;
-                if (dims_a == 3) sig_a.at<float>(i*a.m().cols+j,2) = i;
+        const int dims = m.rows > 1 ? 3 : 2;
+        s.signature.create(s.weights.cols, dims, CV_32FC1);
+        const float *weights = s.weights.ptr<float>();
+        s.mass = 0;
+        s.nonNegative = true;
+        for (int i=0; i<m.rows; i++) {
+            for (int j=0; j<m.cols; j++) {
+                float *bin = s.signature.ptr<float>(i*m.cols+j);
+                bin[0] = weights[i*m.cols+j];
+                bin[1] = j;
+                if (dims == 3) bin[2] = i;
+                s.mass += bin[0];
+                s.nonNegative = s.nonNegative && (bin[0] >= 0);
             }
         }
 
-        for (int i=0; i<b.m().rows; i++) {
-            for (int j=0; j<b.m().cols; j++) {
-                sig_b.at<float>(i*b.m().cols+j,0) = b.m().at<float>(i,j);
-                sig_b.at<float>(i*b.m().cols+j,1) = j;
-                if (dims_b == 3) sig_a.at<float>(i*b.m().cols+j,2) = i;
+        if (m.rows == 1) {
+            s.cumulative.resize(m.cols);
+            double sum = 0;
+            for (int j=0; j<m.cols; j++)
+                s.cumulative[j] = (sum += weights[j]);
+        }
+        return s;
+    }
+
+    static bool equalMass(const Signature &a, const Signature &b)
+    {
+        return a.nonNegative && b.nonNegative && (a.mass > 0) && (b.mass > 0) &&
+               (fabs(a.mass - b.mass) <= 1e-5 * std::max(a.mass, b.mass));
+    }
+
+    Kernel kernel(int rows, int cols) const
+    {
+        Kernel kernel;
+        kernel.rows = rows;
+        kernel.cols = cols;
+
+        const int n = rows * cols;
+        Mat C(n, n, CV_32FC1);
+        for (int i=0; i<n; i++)
+            for (int j=0; j<n; j++) {
+                const float dx = fabs(float(i%cols - j%cols)), dy = fabs(float(i/cols - j/cols));
+                C.at<float>(i, j) = metric == L1 ? dx + dy : (metric == L2 ? sqrt(dx*dx + dy*dy) : std::max(dx, dy));
             }
+
+        double maxCost;
+        minMaxLoc(C, NULL, &maxCost);
+        cv::exp(C * (-1 / (regularization * std::max(maxCost, 1.0))), kernel.K);
+        kernel.KC = kernel.K.mul(C);
+        return kernel;
+    }
+
+    // L1 distance between the cumulative histograms, each shorter histogram padded with empty bins
+    static float closedForm(const Signature &a, const Signature &b)
+    {
+        const int n = std::max(a.cols, b.cols);
+        double work = 0;
+        for (int k=0; k<n-1; k++)
+            work += fabs(a.cumulative[std::min(k, a.cols-1)] - b.cumulative[std::min(k, b.cols-1)]);
+        return work / a.mass;
+    }
+
+    float sinkhorn(const Signature &a, const Signature &b, const Kernel &kernel) const
+    {
+        const int n = a.weights.cols;
+        const Mat p = a.weights.t() / a.mass, q = b.weights.t() / b.mass;
+        Mat u = Mat::ones(n, 1, CV_32FC1), v = Mat::ones(n, 1, CV_32FC1), Kv, Ku;
+        for (int i=0; i<iterations; i++) {
+            gemm(kernel.K, v, 1, Mat(), 0, Kv);
+            const Mat previous = u.clone();
+            divide(p, max(Kv, FLT_MIN), u);
+            gemm(kernel.K, u, 1, Mat(), 0, Ku, GEMM_1_T);
+            divide(q, max(Ku, FLT_MIN), v);
+            if (norm(u, previous, NORM_L1) <= 1e-6 * norm(u, NORM_L1))
+                break;
         }
 
-        return EMD(sig_a,sig_b,metric);
+        Mat KCv;
+        gemm(kernel.KC, v, 1, Mat(), 0, KCv);
+        return u.dot(KCv);
+    }
+
+    float compare(const Signature &a, const Signature &b, Kernel &cache) const
+    {
+        if ((a.rows == 1) && (b.rows == 1) && equalMass(a, b))
+            return closedForm(a, b);
+
+        if ((regularization > 0) && (a.rows == b.rows) && (a.cols == b.cols) && equalMass(a, b)) {
+            if ((cache.rows != a.rows) || (cache.cols != a.cols))
+                cache = kernel(a.rows, a.cols);
+            return sinkhorn(a, b, cache);
+        }
+
+        return EMD(a.signature, b.signature, metric);
+    }
+
+    static QVector<Signature> signatures(const TemplateList &templates)
+    {
+        QVector<Signature> signatures(templates.size());
+        for (int i=0; i<templates.size(); i++)
+            if (!templates[i].isEmpty())
+                signatures[i] = signature(templates[i].m());
+        return signatures;
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        Kernel cache;
+        return compare(signature(a.m()), signature(b.m()), cache);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        const QVector<Signature> targetSignatures = signatures(targets);
+        const Signature querySignature = signature(query.m());
+        Kernel cache;
+
+        QList<float> scores;
+        scores.reserve(targets.size());
+        for (int j=0; j<targets.size(); j++)
+            scores.append(targets[j].isEmpty() ? -std::numeric_limits<float>::max() : compare(targetSignatures[j], querySignature, cache));
+        return scores;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        const QVector<Signature> targetSignatures = signatures(target);
+        Kernel cache;
+        QVector<float> row(target.size());
+        QVector<uchar> valid(target.size());
+        for (int i=0; i<query.size(); i++) {
+            const Signature querySignature = query[i].isEmpty() ? Signature() : signature(query[i].m());
+            for (int j=0; j<target.size(); j++) {
+                valid[j] = !target[j].isEmpty() && !query[i].isEmpty();
+                if (valid[j]) row[j] = compare(targetSignatures[j], querySignature, cache);
+            }
+            output->setRelativeRow(row.constData(), valid.constData(), i+queryOffset, targetOffset, row.size());
+        }
     }
 };
 
@@ -14,8 +14,6 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <numeric>
-
 #include <openbr/plugins/openbr_internal.h>
 
 #include <QtConcurrent>
@@ -26,6 +24,11 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Fuses similarity scores across multiple matrices of compared Templates
+ *
+ * When comparing against many templates, each matrix index is scored as one plane of templates by its
+ * distance and the weighted component scores are then reduced together.
+ * The planes are built for each call and released with it, so no target list outlives its comparison.
+ * Component distances are given the matrices only, without the template metadata.
  * \author Scott Klum \cite sklum
  * \br_property enum Operation Possible values are: [Mean, sum, min, max].
  */
@@ -59,37 +62,118 @@ private:
         futures.waitForFinished();
     }
 
-    float compare(const Template &a, const Template &b) const
+    float weight(int component) const
     {
-        if (a.size() != distances.size() ||
-            b.size() != distances.size())
-            return -std::numeric_limits<float>::max();
-
-        QList<float> scores;
-        for (int i=0; i<distances.size(); i++) {
-            float weight;
-            weights.isEmpty() ? weight = 1. : weight = weights[i];
-            if (weight != 0)
-                scores.append(weight*distances[i]->compare(Template(a.file, a[i]),Template(b.file, b[i])));
-        }
+        return weights.isEmpty() ? 1 : weights[component];
+    }
 
+    // Fold the weighted scores of one component into the running fused scores
+    void reduce(float *fused, const float *scores, float weight, int n) const
+    {
         switch (operation) {
           case Mean:
-            return std::accumulate(scores.begin(),scores.end(),0.0)/(float)scores.size();
-            break;
           case Sum:
-            return std::accumulate(scores.begin(),scores.end(),0.0);
+            for (int j=0; j<n; j++) fused[j] += weight*scores[j];
             break;
           case Min:
-            return *std::min_element(scores.begin(),scores.end());
+            for (int j=0; j<n; j++) fused[j] = std::min(fused[j], weight*scores[j]);
             break;
           case Max:
-            return *std::max_element(scores.begin(),scores.end());
+            for (int j=0; j<n; j++) fused[j] = std::max(fused[j], weight*scores[j]);
             break;
           default:
             qFatal("Invalid operation.");
         }
-        return 0;
+    }
+
+    float identity() const
+    {
+        switch (operation) {
+          case Min: return std::numeric_limits<float>::max();
+          case Max: return -std::numeric_limits<float>::max();
+          default:  return 0;
+        }
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        if (a.size() != distances.size() ||
+            b.size() != distances.size())
+            return -std::numeric_limits<float>::max();
+
+        float fused = identity();
+        int count = 0;
+        for (int i=0; i<distances.size(); i++) {
+            if (weight(i) == 0)
+                continue;
+            const float score = distances[i]->compare(Template(a[i]), Template(b[i]));
+            reduce(&fused, &score, weight(i), 1);
+            count++;
+        }
+
+        if (count == 0) return -std::numeric_limits<float>::max();
+        return operation == Mean ? fused / count : fused;
+    }
+
+    // Split the templates with one matrix per distance into component planes
+    void planes(const TemplateList &templates, QList<int> &valid, QList<TemplateList> &componentPlanes) const
+    {
+        for (int j=0; j<templates.size(); j++)
+            if (templates[j].size() == distances.size())
+                valid.append(j);
+        for (int i=0; i<distances.size(); i++)
+            componentPlanes.append(weight(i) == 0 ? TemplateList() : plane(templates, valid, i));
+    }
+
+    // Fused scores of query against all targets, each component scored as a batch over its plane
+    void compareRow(const QList<TemplateList> &targetPlanes, const QList<int> &valid, const Template &query, float *dst, int numTargets) const
+    {
+        std::fill(dst, dst + numTargets, -std::numeric_limits<float>::max());
+        if (query.size() != distances.size() || valid.isEmpty())
+            return;
+
+        const int n = valid.size();
+        QVector<float> fused(n, identity()), component(n);
+        int count = 0;
+        for (int i=0; i<distances.size(); i++) {
+            if (weight(i) == 0)
+                continue;
+            const QList<float> scores = distances[i]->compare(targetPlanes[i], Template(query[i]));
+            for (int j=0; j<n; j++)
+                component[j] = scores[j];
+            reduce(fused.data(), component.data(), weight(i), n);
+            count++;
+        }
+
+        if (count == 0)
+            return;
+        const float scale = operation == Mean ? 1.f / count : 1.f;
+        for (int j=0; j<n; j++)
+            dst[valid[j]] = scale * fused[j];
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QList<int> valid;
+        QList<TemplateList> targetPlanes;
+        planes(targets, valid, targetPlanes);
+
+        QVector<float> row(targets.size());
+        compareRow(targetPlanes, valid, query, row.data(), row.size());
+        return row.toList();
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        QList<int> valid;
+        QList<TemplateList> targetPlanes;
+        planes(target, valid, targetPlanes);
+
+        QVector<float> row(target.size());
+        for (int i=0; i<query.size(); i++) {
+            compareRow(targetPlanes, valid, query[i], row.data(), row.size());
+            output->setRelativeRow(row.constData(), NULL, i+queryOffset, targetOffset, row.size());
+        }
     }
 };
 
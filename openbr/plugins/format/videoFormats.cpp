@@ -112,6 +112,9 @@ BR_REGISTER(Format, webcamFormat)
 /*!
  * \ingroup formats
  * \brief Reads image files.
+ *
+ * The file metadata keys DecodeMinShortSide, DecodeMinLongSide and DecodeGrayscale, set by OpenTransform,
+ * allow images to be decoded at a reduced resolution or directly to grayscale.
  * \author Josh Klontz \cite jklontz
  */
 class DefaultFormat : public Format
@@ -130,7 +133,10 @@ class DefaultFormat : public Format
                 t = url->read();
             }
         } else {
-            Mat m = imread(file.resolved().toStdString());
+            Mat m = OpenCVUtils::read(file.resolved(),
+                                      file.getBool("DecodeGrayscale") ? IMREAD_GRAYSCALE : IMREAD_COLOR,
+                                      file.get<int>("DecodeMinShortSide", 0),
+                                      file.get<int>("DecodeMinLongSide", 0));
             if (m.data) {
                 t.append(m);
             } else {
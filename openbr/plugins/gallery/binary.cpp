@@ -163,15 +163,121 @@ protected:
  * Designed to be a literal translation of templates to disk.
  * Compatible with TemplateList::fromBuffer.
  * \author Josh Klontz \cite jklontz
+ * \br_property QStringList keys If not empty, only these metadata keys (and FTE) are decoded when reading, the rest are skipped. Default is empty.
  */
 class galGallery : public BinaryGallery
 {
     Q_OBJECT
+    Q_PROPERTY(QStringList keys READ get_keys WRITE set_keys RESET reset_keys STORED false)
+    BR_PROPERTY(QStringList, keys, QStringList())
+
+    // Advances past a serialized QVariant without constructing it, false if its layout isn't known
+    bool skipValue(quint32 type)
+    {
+        const int real = (stream.floatingPointPrecision() == QDataStream::DoublePrecision) ? 8 : 4;
+        switch (type) {
+          case QMetaType::Bool:      return skipBytes(1);
+          case QMetaType::Int:
+          case QMetaType::UInt:      return skipBytes(4);
+          case QMetaType::LongLong:
+          case QMetaType::ULongLong: return skipBytes(8);
+          case QMetaType::Double:
+          case QMetaType::Float:     return skipBytes(real);
+          case QMetaType::QPoint:
+          case QMetaType::QSize:     return skipBytes(8);
+          case QMetaType::QRect:     return skipBytes(16);
+          case QMetaType::QPointF:
+          case QMetaType::QSizeF:    return skipBytes(2*real);
+          case QMetaType::QRectF:    return skipBytes(4*real);
+          case QMetaType::QString:
+          case QMetaType::QByteArray: {
+            quint32 bytes;
+            stream >> bytes;
+            return (bytes == 0xFFFFFFFF) || skipBytes(bytes);
+          }
+          case QMetaType::QStringList: {
+            quint32 size;
+            stream >> size;
+            for (quint32 i=0; i<size; i++)
+                if (!skipValue(QMetaType::QString))
+                    return false;
+            return true;
+          }
+          case QMetaType::QVariantList: {
+            quint32 size;
+            stream >> size;
+            for (quint32 i=0; i<size; i++)
+                if (!skipVariant())
+                    return false;
+            return true;
+          }
+          case QMetaType::QVariantMap: {
+            quint32 size;
+            stream >> size;
+            for (quint32 i=0; i<size; i++)
+                if (!skipValue(QMetaType::QString) || !skipVariant())
+                    return false;
+            return true;
+          }
+          default:
+            return false;
+        }
+    }
+
+    bool skipBytes(qint64 bytes)
+    {
+        return stream.skipRawData(int(bytes)) == bytes;
+    }
+
+    // Skips a variant, decoding and discarding the types skipValue doesn't know
+    bool skipVariant()
+    {
+        const qint64 start = gallery.pos();
+        quint32 type;
+        qint8 isNull;
+        stream >> type >> isNull;
+        if ((type != QMetaType::UnknownType) && skipValue(type))
+            return true;
+        if (!gallery.seek(start))
+            return false;
+        QVariant value;
+        stream >> value;
+        return true;
+    }
+
+    // The same as stream >> t, except that metadata not in keys is skipped rather than decoded
+    void readProjected(Template &t)
+    {
+        stream >> static_cast<QList<cv::Mat>&>(t) >> t.file.name;
+
+        quint32 size;
+        stream >> size;
+        for (quint32 i=0; i<size; i++) {
+            QString key;
+            stream >> key;
+            if ((key == "FTE") || keys.contains(key)) {
+                QVariant value;
+                stream >> value;
+                t.file.set(key, value);
+            } else if (!skipVariant()) {
+                qFatal("Failed to skip metadata %s in %s.", qPrintable(key), qPrintable(file.name));
+            }
+        }
+        t.file.fte = t.file.getBool("FTE", false);
+    }
 
     Template readTemplate()
     {
         Template t;
-        stream >> t;
+        if (keys.isEmpty() || gallery.isSequential()) {
+            stream >> t;
+            if (!keys.isEmpty())
+                foreach (const QString &key, t.file.localKeys())
+                    if ((key != "FTE") && !keys.contains(key))
+                        t.file.remove(key);
+        } else {
+            readProjected(t);
+        }
         return t;
     }
 
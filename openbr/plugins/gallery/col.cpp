@@ -0,0 +1,114 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/columns.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief Template metadata stored one column per key, without matrices.
+ *
+ * Written alongside an enrolled gallery (<tt>-convert Gallery enrolled.gal enrolled.col</tt>),
+ * it lets evaluation and metadata queries scan only the keys they need instead of decoding every template.
+ * Strings are dictionary encoded and numbers are stored as flat arrays.
+ * Reading applies \c Globals->filters as a scan over the filtered columns.
+ * Evaluation and metadata queries only use a companion when \c useColumns is set and it is newer than its gallery.
+ * Writing encodes each block of templates as a segment, so only one block is held in memory.
+ * \br_related_plugin galGallery
+ */
+class colGallery : public Gallery
+{
+    Q_OBJECT
+    MetadataColumns columns;
+    QVector<int> rows;
+    FileList written;
+    bool appending;
+    int next;
+
+    ~colGallery()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        if (written.isEmpty())
+            return;
+        MetadataColumns::fromFiles(written).write(file.name, appending);
+        written.clear();
+        appending = true;
+    }
+
+    void init()
+    {
+        next = 0;
+        appending = false;
+        rows.clear();
+        if (QFileInfo(file.name).exists()) {
+            if (!columns.read(file.name))
+                qFatal("Failed to read %s.", qPrintable(file.name));
+            if (Globals->filters.isEmpty()) {
+                rows.reserve(columns.rows());
+                for (int i=0; i<columns.rows(); i++)
+                    rows.append(i);
+            } else {
+                rows = columns.select(Globals->filters);
+            }
+        }
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        TemplateList templates;
+        const int end = std::min(next + readBlockSize, rows.size());
+        templates.reserve(end - next);
+        for (; next<end; next++) {
+            templates.append(columns.file(rows[next]));
+            templates.last().file.set("progress", next);
+        }
+
+        *done = (next == rows.size());
+        if (*done)
+            next = 0;
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        written.append(t.file);
+        if (written.size() >= readBlockSize)
+            flush();
+    }
+
+    qint64 totalSize()
+    {
+        return rows.size();
+    }
+
+    qint64 position()
+    {
+        return next;
+    }
+};
+
+BR_REGISTER(Gallery, colGallery)
+
+} // namespace br
+
+#include "gallery/col.moc"
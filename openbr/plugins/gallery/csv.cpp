@@ -14,6 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 #include <openbr/core/common.h>
@@ -111,6 +116,274 @@ public:
     }
 };
 
+// A column of values, with the positions of its sub-columns resolved once from the header
+struct CSVColumn
+{
+    enum Kind { Scalar, Rects, Points, Point, Rect };
+
+    Kind kind;
+    QString key;
+    int x, y, width, height; // Value positions, Scalar/Rects/Points only use x
+
+    static QList<CSVColumn> fromHeaders(const CSVHeaderList &headers)
+    {
+        QList<CSVColumn> columns;
+        foreach (const CSVHeader &header, headers) {
+            CSVColumn column;
+            column.key = header.key;
+            column.x = column.y = column.width = column.height = -1;
+            if (header.indices.size() == 1) {
+                column.kind = (header.key == "Rects") ? Rects : ((header.key == "Points") ? Points : Scalar);
+                column.x = header.indices.first();
+            } else if (header.indices.size() == 2 || header.indices.size() == 4) {
+                column.kind = (header.indices.size() == 2) ? Point : Rect;
+                const int x = header.subKeys.indexOf("X"), y = header.subKeys.indexOf("Y");
+                const int width = header.subKeys.indexOf("Width"), height = header.subKeys.indexOf("Height");
+                if ((x == -1) || (y == -1) || ((column.kind == Rect) && ((width == -1) || (height == -1)))) {
+                    qWarning("Ignoring ill-formed csv columns for %s.", qPrintable(header.key));
+                    continue;
+                }
+                column.x = header.indices[x];
+                column.y = header.indices[y];
+                column.width = column.kind == Rect ? header.indices[width] : -1;
+                column.height = column.kind == Rect ? header.indices[height] : -1;
+            } else {
+                continue;
+            }
+            columns.append(column);
+        }
+        return columns;
+    }
+};
+
+// A field of a line, before unquoting and trimming
+struct CSVField
+{
+    const char *begin, *end;
+    bool quoted;
+};
+
+typedef QVarLengthArray<CSVField, 64> CSVFields;
+
+// Characters that make QtUtils::parse look beyond the next comma
+static inline bool structural(char c)
+{
+    switch (c) {
+      case '"': case '\'':
+      case '(': case '[': case '<': case '{':
+      case ')': case ']': case '>': case '}':
+        return true;
+      default:
+        return false;
+    }
+}
+
+static inline bool quote(char c)
+{
+    return (c == '"') || (c == '\'');
+}
+
+// Byte for byte equivalent of QtUtils::parse(line, ',') for lines with quotes or brackets
+static void splitStructured(const char *begin, const char *end, CSVFields &fields)
+{
+    fields.clear();
+    const char *start = begin;
+    bool inQuote = false, quoted = false;
+    QVarLengthArray<char, 16> subexpressions;
+    for (const char *p=begin; p<end; p++) {
+        const char c = *p;
+        if (inQuote) {
+            if (quote(c))
+                inQuote = false;
+        } else if (quote(c)) {
+            inQuote = quoted = true;
+        } else if ((c == '(') || (c == '[') || (c == '<') || (c == '{')) {
+            subexpressions.append(c);
+        } else if ((c == ')') || (c == ']') || (c == '>') || (c == '}')) {
+            const char open = (c == ')') ? '(' : ((c == ']') ? '[' : ((c == '>') ? '<' : '{'));
+            if (subexpressions.isEmpty() || (subexpressions.last() != open))
+                qFatal("Unexpected '%c'.", c);
+            subexpressions.removeLast();
+        } else if (subexpressions.isEmpty() && (c == ',')) {
+            CSVField field = { start, p, quoted };
+            fields.append(field);
+            start = p+1;
+            quoted = false;
+        }
+    }
+    CSVField field = { start, end, quoted };
+    fields.append(field);
+}
+
+// Split a line on commas, handing lines with quotes or brackets to splitStructured
+static void splitLine(const char *begin, const char *end, CSVFields &fields)
+{
+    fields.clear();
+    const char *start = begin;
+    const char *p = begin;
+#ifdef __SSE2__
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i specials[10] = { _mm_set1_epi8('"'), _mm_set1_epi8('\''),
+                                   _mm_set1_epi8('('), _mm_set1_epi8('['), _mm_set1_epi8('<'), _mm_set1_epi8('{'),
+                                   _mm_set1_epi8(')'), _mm_set1_epi8(']'), _mm_set1_epi8('>'), _mm_set1_epi8('}') };
+    for (; p+16 <= end; p += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i special = _mm_cmpeq_epi8(v, specials[0]);
+        for (int i=1; i<10; i++)
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(v, specials[i]));
+        if (_mm_movemask_epi8(special)) {
+            splitStructured(begin, end, fields);
+            return;
+        }
+
+        int commas = _mm_movemask_epi8(_mm_cmpeq_epi8(v, comma));
+        while (commas) {
+            const char *position = p + __builtin_ctz(commas);
+            CSVField field = { start, position, false };
+            fields.append(field);
+            start = position+1;
+            commas &= commas-1;
+        }
+    }
+#endif
+    for (; p<end; p++) {
+        if (structural(*p)) {
+            splitStructured(begin, end, fields);
+            return;
+        }
+        if (*p == ',') {
+            CSVField field = { start, p, false };
+            fields.append(field);
+            start = p+1;
+        }
+    }
+    CSVField field = { start, end, false };
+    fields.append(field);
+}
+
+static inline bool space(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\v') || (c == '\f');
+}
+
+static inline bool equalsIgnoreCase(const char *begin, const char *end, const char *word)
+{
+    for (; begin<end && *word; begin++, word++)
+        if ((*begin | 0x20) != *word)
+            return false;
+    return (begin == end) && !*word;
+}
+
+// Exactly representable mantissas scaled by exactly representable powers of ten round once, so
+// they give the same double, and float, as QString::toFloat
+static bool fastFloat(const char *p, const char *end, float &value)
+{
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const bool negative = (*p == '-');
+    if ((*p == '-') || (*p == '+'))
+        p++;
+
+    quint64 mantissa = 0;
+    int digits = 0, significant = 0, exponent = 0;
+    for (; p<end && *p >= '0' && *p <= '9'; p++, digits++)
+        if (significant || *p != '0') { mantissa = 10*mantissa + (*p - '0'); significant++; }
+    if (p<end && *p == '.')
+        for (p++; p<end && *p >= '0' && *p <= '9'; p++, digits++) {
+            if (significant || *p != '0') { mantissa = 10*mantissa + (*p - '0'); significant++; }
+            exponent--;
+        }
+    if (!digits || significant > 15)
+        return false;
+
+    if (p<end && (*p == 'e' || *p == 'E')) {
+        p++;
+        const bool negativeExponent = (p<end && *p == '-');
+        if (p<end && (*p == '-' || *p == '+'))
+            p++;
+        int e = 0, exponentDigits = 0;
+        for (; p<end && *p >= '0' && *p <= '9' && e < 1000; p++, exponentDigits++)
+            e = 10*e + (*p - '0');
+        if (!exponentDigits)
+            return false;
+        exponent += negativeExponent ? -e : e;
+    }
+    if ((p != end) || (exponent > 22) || (exponent < -22))
+        return false;
+
+    double d = double(mantissa);
+    d = (exponent < 0) ? d / powers[-exponent] : d * powers[exponent];
+    if ((d != 0) && ((d > std::numeric_limits<float>::max()) || (d < std::numeric_limits<float>::min())))
+        return false;
+    value = float(negative ? -d : d);
+    return true;
+}
+
+static bool fastInt(const char *p, const char *end, int &value)
+{
+    const bool negative = (*p == '-');
+    if ((*p == '-') || (*p == '+'))
+        p++;
+    if (p == end)
+        return false;
+
+    qint64 v = 0;
+    for (; p<end; p++) {
+        if (*p < '0' || *p > '9')
+            return false;
+        v = 10*v + (*p - '0');
+        if (v > qint64(std::numeric_limits<int>::max()) + 1)
+            return false;
+    }
+    v = negative ? -v : v;
+    if (v > std::numeric_limits<int>::max())
+        return false;
+    value = int(v);
+    return true;
+}
+
+// Same result as QtUtils::fromString on the word QtUtils::parse would produce, without the
+// detour through QString for the common plain numbers and strings
+static QVariant toVariant(const CSVField &field, bool stripQuotes)
+{
+    const char *begin = field.begin, *end = field.end;
+    if (field.quoted) {
+        QString word = QString::fromUtf8(begin, end-begin).trimmed();
+        if (word.contains('\'') || word.contains('\"'))
+            word = word.mid(1, word.size()-2);
+        if (stripQuotes && word.startsWith("\""))
+            word.replace("\"", "");
+        return QtUtils::fromString(word);
+    }
+
+    while (begin<end && space(*begin)) begin++;
+    while (begin<end && space(end[-1])) end--;
+    if (begin == end)
+        return QString();
+
+    const char c = *begin;
+    if ((uchar(c) >= 0x80) || (uchar(end[-1]) >= 0x80))
+        return QtUtils::fromString(QString::fromUtf8(begin, end-begin).trimmed());
+
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.') {
+        int i;
+        if (fastInt(begin, end, i))
+            return i;
+        float f;
+        if (fastFloat(begin, end, f))
+            return f;
+        return QtUtils::fromString(QString::fromUtf8(begin, end-begin));
+    }
+
+    if (c == '(' || c == '[' || ((end-begin > 12) && !strncmp(begin, "RotatedRect(", 12)) || equalsIgnoreCase(begin, end, "nan") || equalsIgnoreCase(begin, end, "inf") || equalsIgnoreCase(begin, end, "infinity"))
+        return QtUtils::fromString(QString::fromUtf8(begin, end-begin));
+    if (equalsIgnoreCase(begin, end, "true") || equalsIgnoreCase(begin, end, "t"))
+        return true;
+    if (equalsIgnoreCase(begin, end, "false") || equalsIgnoreCase(begin, end, "f"))
+        return false;
+    return QString::fromUtf8(begin, end-begin);
+}
+
 /*!
  * \ingroup galleries
  * \brief Treats each line as a file.
@@ -118,6 +391,7 @@ public:
  * \br_format Columns should be comma separated with first row containing headers.
  *            The first column in the file should be the path to the file to enroll.
  *            Other columns will be treated as file metadata.
+ *            Blocks of rows are parsed concurrently and returned in file order.
  *
  * \br_related_plugin txtGallery
  */
@@ -128,41 +402,129 @@ class csvGallery : public FileGallery
     BR_PROPERTY(bool, combineFiles, false)
 
     CSVHeaderList headers;
+    QList<CSVColumn> columns;
+
+    // Bytes read from f but not yet parsed, starting at file offset bufferOffset
+    QByteArray buffer;
+    qint64 bufferOffset;
+
+    // Lines of buffer, by the offset one past their end, parsed by one thread
+    struct Chunk
+    {
+        int first, last;
+        QList<File> files;
+    };
 
     ~csvGallery()
     {
         f.close();
     }
 
-    void setValuesFromHeaders(File &f, const CSVHeaderList &headers, const QVariantList &values)
+    static QVariant value(const CSVFields &fields, int index, bool stripQuotes)
     {
-        foreach (const CSVHeader &header, headers) {
-            if (header.indices.size() == 1) {
-                if (header.key == "Rects")
-                    foreach(const QVariant &rect, values[header.indices.first()].toList())
-                        f.appendRect(rect.toRectF());
-                else if (header.key == "Points")
-                    foreach(const QVariant &point, values[header.indices.first()].toList())
-                        f.appendPoint(point.toPointF());
-                else {
-                    const QVariant value = values[header.indices.first()];
-                    if (!value.canConvert<QString>() || !value.toString().isEmpty())
-                        f.set(header.key, values[header.indices.first()]);
-                }
-            } else if (header.indices.size() == 2) { // QPointF
-                const QPointF point(values[header.indices[header.subKeys.indexOf("X")]].toFloat(),
-                                    values[header.indices[header.subKeys.indexOf("Y")]].toFloat());
-                f.set(header.key, point);
+        // Short rows leave their trailing columns empty
+        return (index+1 < fields.size()) ? toVariant(fields[index+1], stripQuotes) : QVariant(QString());
+    }
+
+    void setValues(File &f, const CSVFields &fields, bool stripQuotes) const
+    {
+        foreach (const CSVColumn &column, columns) {
+            switch (column.kind) {
+              case CSVColumn::Scalar: {
+                const QVariant v = value(fields, column.x, stripQuotes);
+                if (!v.canConvert<QString>() || !v.toString().isEmpty())
+                    f.set(column.key, v);
+              } break;
+              case CSVColumn::Rects:
+                foreach (const QVariant &rect, value(fields, column.x, stripQuotes).toList())
+                    f.appendRect(rect.toRectF());
+                break;
+              case CSVColumn::Points:
+                foreach (const QVariant &point, value(fields, column.x, stripQuotes).toList())
+                    f.appendPoint(point.toPointF());
+                break;
+              case CSVColumn::Point: {
+                const QPointF point(value(fields, column.x, stripQuotes).toFloat(),
+                                    value(fields, column.y, stripQuotes).toFloat());
+                f.set(column.key, point);
                 f.appendPoint(point);
-            } else if (header.indices.size() == 4) { // QRectF
-                const QRectF rect(values[header.indices[header.subKeys.indexOf("X")]].toFloat(),
-                                  values[header.indices[header.subKeys.indexOf("Y")]].toFloat(),
-                                  values[header.indices[header.subKeys.indexOf("Width")]].toFloat(),
-                                  values[header.indices[header.subKeys.indexOf("Height")]].toFloat());
-                f.set(header.key, rect);
+              } break;
+              case CSVColumn::Rect: {
+                const QRectF rect(value(fields, column.x, stripQuotes).toFloat(),
+                                  value(fields, column.y, stripQuotes).toFloat(),
+                                  value(fields, column.width, stripQuotes).toFloat(),
+                                  value(fields, column.height, stripQuotes).toFloat());
+                f.set(column.key, rect);
                 f.appendRect(rect);
+              } break;
+            }
+        }
+    }
+
+    void parseChunk(const QVector<int> *ends, Chunk *chunk) const
+    {
+        const char *data = buffer.constData();
+        const bool stripQuotes = !combineFiles;
+        CSVFields fields;
+        for (int i=chunk->first; i<chunk->last; i++) {
+            const char *begin = data + (i == 0 ? 0 : (*ends)[i-1]);
+            const char *end = data + (*ends)[i];
+            splitLine(begin, end, fields);
+            File in;
+            in.name = toVariant(fields[0], stripQuotes).toString();
+            setValues(in, fields, stripQuotes);
+            if (!combineFiles)
+                in.set("progress", bufferOffset + (*ends)[i]);
+            chunk->files.append(in);
+        }
+    }
+
+    // Ends of up to limit complete lines at the front of buffer, reading more of f as needed
+    QVector<int> lineEnds(qint64 limit)
+    {
+        QVector<int> ends;
+        int pos = 0;
+        while (ends.size() < limit) {
+            const char *newline = (const char*) memchr(buffer.constData() + pos, '\n', buffer.size() - pos);
+            if (newline) {
+                pos = newline - buffer.constData() + 1;
+                ends.append(pos);
+            } else if (!f.atEnd()) {
+                buffer.append(f.read(qMax(qint64(1 << 24), qint64(buffer.size()))));
+            } else {
+                if (pos < buffer.size())
+                    ends.append(buffer.size());
+                break;
             }
         }
+        return ends;
+    }
+
+    // Parse up to limit lines in byte range chunks, one per thread, keeping their order
+    QList<File> readLines(qint64 limit)
+    {
+        const QVector<int> ends = lineEnds(limit);
+        if (ends.isEmpty())
+            return QList<File>();
+
+        const int chunks = std::max(1, std::min(Globals->parallelism, ends.size() / 1024));
+        QVector<Chunk> work(chunks);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++) {
+            work[i].first = qint64(ends.size()) * i / chunks;
+            work[i].last = qint64(ends.size()) * (i+1) / chunks;
+            if (chunks > 1) futures.addFuture(QtConcurrent::run(this, &csvGallery::parseChunk, &ends, &work[i]));
+            else            parseChunk(&ends, &work[i]);
+        }
+        futures.waitForFinished();
+
+        QList<File> files;
+        foreach (const Chunk &chunk, work)
+            files.append(chunk.files);
+
+        buffer.remove(0, ends.last());
+        bufferOffset += ends.last();
+        return files;
     }
 
     TemplateList readBlock(bool *done)
@@ -181,42 +543,35 @@ class csvGallery : public FileGallery
             QString line = QString::fromLocal8Bit(lineBytes).trimmed();
             QRegExp regexp("\\s*,\\s*");
             headers = CSVHeaderList::fromHeaders(line.split(regexp).mid(1));
+            columns = CSVColumn::fromHeaders(headers);
+            buffer.clear();
+            bufferOffset = f.pos();
         }
 
         if (combineFiles) {
             *done = true;
             QMap<QString, File> combinedFiles;
 
-            while (!f.atEnd()) {
-                QVariantList values;
-                foreach (const QString &value, QtUtils::parse(f.readLine(), ','))
-                    values.append(QtUtils::fromString(value));
-
-                const QString name = values.first().toString();
-                File &in = combinedFiles[name];
-                in.name = name;
-                setValuesFromHeaders(in, headers, values.mid(1));
-            }
+            QList<File> files;
+            do {
+                files = readLines(this->readBlockSize);
+                foreach (const File &row, files) {
+                    File &in = combinedFiles[row.name];
+                    in.name = row.name;
+                    foreach (const QString &key, row.localKeys()) {
+                        if      (key == "Rects")  in.appendRects(row.rects());
+                        else if (key == "Points") in.appendPoints(row.points());
+                        else                      in.set(key, row.value(key));
+                    }
+                }
+            } while (!files.isEmpty());
 
             foreach (const File &in, combinedFiles.values())
                 templates.append(in);
         } else {
-            for (qint64 i = 0; i < this->readBlockSize && !f.atEnd(); i++) {
-                QVariantList values;
-                foreach (const QString &value, QtUtils::parse(f.readLine(), ',')) {
-                    QString s = value;
-                    if (s.startsWith("\""))
-                        s.replace("\"", "");
-                    values.append(QtUtils::fromString(s));
-                }
-
-                File in;
-                in.name = values.first().toString();
-                setValuesFromHeaders(in, headers, values.mid(1));
-                in.set("progress", f.pos());
+            foreach (const File &in, readLines(this->readBlockSize))
                 templates.append(in);
-            }
-            *done = f.atEnd();
+            *done = buffer.isEmpty() && f.atEnd();
         }
         return templates;
     }
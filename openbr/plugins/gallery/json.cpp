@@ -14,17 +14,25 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
 
 /*!
  * \ingroup galleries
- * \brief Treats the file as a JSON document.
+ * \brief Treats the file as JSON, either one object per line or a single array of objects.
+ *
+ * Line-delimited files are read readBlockSize lines at a time, with each block
+ * parsed concurrently, and are what this gallery writes.
+ * A document that is a single array is read in one block.
+ * Only metadata is written, with the template name under filePath; points are stored as {"x","y"} objects and rects as {"x","y","width","height"} objects.
+ *
  * \author Josh Klontz \cite jklontz
  */
 class jsonGallery : public FileGallery
@@ -35,15 +43,119 @@ class jsonGallery : public FileGallery
     BR_PROPERTY(QString, label, "PersonID")
     BR_PROPERTY(QString, filePath, "Path")
 
-    TemplateList readBlock(bool *done)
+    // Bytes read from f but not yet parsed
+    QByteArray buffer;
+    bool warned;
+
+    // A contiguous range of lines, by the offset one past their end, parsed by one thread
+    struct Chunk
+    {
+        int first, last;
+        QList<File> files;
+    };
+
+    void init()
+    {
+        FileGallery::init();
+        warned = false;
+    }
+
+    static QJsonValue toJson(const QVariant &variant)
+    {
+        if (variant.type() == QVariant::PointF) {
+            const QPointF point = variant.toPointF();
+            QJsonObject object;
+            object.insert("x", point.x());
+            object.insert("y", point.y());
+            return object;
+        }
+
+        if (variant.type() == QVariant::RectF) {
+            const QRectF rect = variant.toRectF();
+            QJsonObject object;
+            object.insert("x", rect.x());
+            object.insert("y", rect.y());
+            object.insert("width", rect.width());
+            object.insert("height", rect.height());
+            return object;
+        }
+
+        if (variant.type() == QVariant::List) {
+            QJsonArray array;
+            foreach (const QVariant &value, variant.toList())
+                array.append(toJson(value));
+            return array;
+        }
+
+        if (variant.type() == QVariant::Map) {
+            QJsonObject object;
+            const QVariantMap map = variant.toMap();
+            for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it)
+                object.insert(it.key(), toJson(it.value()));
+            return object;
+        }
+
+        return QtUtils::fromVariant(variant);
+    }
+
+    static QVariant fromJson(const QJsonValue &value)
+    {
+        if (value.isArray()) {
+            QVariantList list;
+            foreach (const QJsonValue &element, value.toArray())
+                list.append(fromJson(element));
+            return list;
+        }
+
+        if (value.isObject()) {
+            const QJsonObject object = value.toObject();
+            const QStringList keys = object.keys();
+            if (keys == (QStringList() << "x" << "y"))
+                return QPointF(object.value("x").toDouble(), object.value("y").toDouble());
+            if (keys == (QStringList() << "height" << "width" << "x" << "y"))
+                return QRectF(object.value("x").toDouble(), object.value("y").toDouble(),
+                              object.value("width").toDouble(), object.value("height").toDouble());
+
+            QVariantMap map;
+            for (QJsonObject::const_iterator it = object.constBegin(); it != object.constEnd(); ++it)
+                map.insert(it.key(), fromJson(it.value()));
+            return map;
+        }
+
+        return value.toVariant();
+    }
+
+    File fromObject(const QJsonObject &object) const
     {
-        *done = true;
+        File file(fromJson(object).toMap());
+        if (!label.isEmpty() && file.contains(label))
+            file.set("Label", file.get<QString>(label));
+        if (!filePath.isEmpty() && file.contains(filePath))
+            file.name = file.get<QString>(filePath);
+        return file;
+    }
 
-        if (!readOpen())
-            qFatal("Failed to open JSON file!");
+    void parseChunk(const QVector<int> *ends, Chunk *chunk) const
+    {
+        for (int i=chunk->first; i<chunk->last; i++) {
+            const int begin = (i == 0 ? 0 : (*ends)[i-1]);
+            const QByteArray line = QByteArray::fromRawData(buffer.constData() + begin, (*ends)[i] - begin).trimmed();
+            if (line.isEmpty())
+                continue;
 
+            QJsonParseError error;
+            const QJsonDocument document = QJsonDocument::fromJson(line, &error);
+            if (error.error != QJsonParseError::NoError)
+                qFatal("Couldn't parse line %s of %s: %s", line.constData(), qPrintable(file.name), qPrintable(error.errorString()));
+            chunk->files.append(fromObject(document.object()));
+        }
+    }
+
+    TemplateList readArray()
+    {
         QJsonParseError jsonParseError;
-        const QJsonDocument jsonDocument = QJsonDocument::fromJson(f.readAll(), &jsonParseError);
+        const QJsonDocument jsonDocument = QJsonDocument::fromJson(buffer + f.readAll(), &jsonParseError);
+        buffer.clear();
         if (jsonParseError.error != QJsonParseError::NoError)
             qFatal("%s", qPrintable(jsonParseError.errorString()));
 
@@ -51,21 +163,77 @@ class jsonGallery : public FileGallery
             qFatal("Expected JSON document to be an array!");
 
         TemplateList result;
-        foreach (const QJsonValue &value, jsonDocument.array()) {
-            File file(value.toObject().toVariantMap());
-            if (!label.isEmpty() && file.contains(label))
-                file.set("Label", file.get<QString>(label));
-            if (!filePath.isEmpty() && file.contains(filePath))
-                file.name = file.get<QString>(filePath);
-            result.append(file);
+        foreach (const QJsonValue &value, jsonDocument.array())
+            result.append(fromObject(value.toObject()));
+        return result;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (readOpen()) {
+            buffer = f.read(1 << 24);
+            if (buffer.trimmed().startsWith('[')) {
+                *done = true;
+                return readArray();
+            }
+        }
+
+        // Ends of up to readBlockSize complete lines at the front of buffer
+        QVector<int> ends;
+        int pos = 0;
+        while (ends.size() < readBlockSize) {
+            const char *newline = (const char*) memchr(buffer.constData() + pos, '\n', buffer.size() - pos);
+            if (newline) {
+                pos = newline - buffer.constData() + 1;
+                ends.append(pos);
+            } else if (!f.atEnd()) {
+                buffer.append(f.read(qMax(qint64(1 << 24), qint64(buffer.size()))));
+            } else {
+                if (pos < buffer.size())
+                    ends.append(buffer.size());
+                break;
+            }
         }
 
+        const int chunks = std::max(1, std::min(Globals->parallelism, ends.size() / 1024));
+        QVector<Chunk> work(chunks);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++) {
+            work[i].first = qint64(ends.size()) * i / chunks;
+            work[i].last = qint64(ends.size()) * (i+1) / chunks;
+            if (chunks > 1) futures.addFuture(QtConcurrent::run(this, &jsonGallery::parseChunk, &ends, &work[i]));
+            else            parseChunk(&ends, &work[i]);
+        }
+        futures.waitForFinished();
+
+        TemplateList result;
+        foreach (const Chunk &chunk, work)
+            foreach (const File &file, chunk.files)
+                result.append(file);
+
+        if (!ends.isEmpty())
+            buffer.remove(0, ends.last());
+        *done = buffer.isEmpty() && f.atEnd();
         return result;
     }
 
-    void write(const Template &)
+    void write(const Template &t)
     {
-        qFatal("Not implemented!");
+        writeOpen();
+        if (!warned) {
+            foreach (const cv::Mat &m, t)
+                if (!m.empty()) {
+                    qWarning("JSON gallery %s only stores metadata, discarding template matrices.", qPrintable(file.name));
+                    warned = true;
+                    break;
+                }
+        }
+        // The name is stored under filePath, where reading looks for it
+        QVariantMap metadata = t.file.localMetadata();
+        if (!filePath.isEmpty())
+            metadata.insert(filePath, t.file.name);
+        f.write(QJsonDocument(toJson(metadata).toObject()).toJson(QJsonDocument::Compact));
+        f.write("\n");
     }
 };
 
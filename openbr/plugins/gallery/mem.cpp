@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/columns.h>
 
 namespace br
 {
@@ -112,6 +113,21 @@ FileList FileList::fromGallery(const File &rFile, bool cache)
         return MemoryGalleries::galleries[targetMeta].files();
     }
 
+    // A columnar companion holds the same metadata without any matrices to skip
+    const QString companion = MetadataColumns::companion(file.flat());
+    MetadataColumns columns;
+    if (!companion.isEmpty() && (companion != file.name) && columns.read(companion)) {
+        QVector<int> rows(columns.rows());
+        for (int i=0; i<rows.size(); i++)
+            rows[i] = i;
+        fileData = columns.files(rows);
+        if (cache) {
+            QScopedPointer<Gallery> memOutput(Gallery::make(targetMeta));
+            memOutput->writeBlock(TemplateList(fileData));
+        }
+        return fileData;
+    }
+
     TemplateList templates;
     // OK we read the data in some form, does the gallery type containing matrices?
     if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
@@ -16,6 +16,7 @@
 
 #include <QApplication>
 #include <QLabel>
+#include <QDateTime>
 #include <QElapsedTimer>
 #include <QInputDialog>
 #include <QWaitCondition>
@@ -1003,6 +1004,9 @@ BR_REGISTER(Transform, FilterTransform)
 /*!
  * \ingroup transforms
  * \brief Limits the frequency of projects going through this transform to the input targetFPS
+ *
+ * Frames from a live stream (see DirectStreamTransform's dropPolicy) that were read more than one
+ * frame interval ago are passed through without waiting, so throttling never adds to their latency.
  * \author Charles Otto \cite caotto
  */
 class FPSLimit : public TimeVaryingTransform
@@ -1026,9 +1030,13 @@ public:
         qint64 target_time = last_time + target_wait;
         qint64 wait_time = target_time - current_time;
 
-        last_time = current_time;
+        // A live frame that is already a frame interval old isn't delayed any further
+        bool late = false;
+        if (!src.empty() && src.first().file.contains("FrameReadTime"))
+            late = QDateTime::currentMSecsSinceEpoch() - src.first().file.get<qint64>("FrameReadTime") >= target_wait;
 
-        if (wait_time < 0) {
+        if (wait_time < 0 || late) {
+            last_time = current_time;
             return;
         }
 
@@ -1059,6 +1067,8 @@ BR_REGISTER(Transform, FPSLimit)
  * \ingroup transforms
  * \brief Calculates the average FPS of projects going through this transform, stores the result in AvgFPS
  * Reports an average FPS from the initialization of this transform onwards.
+ * For live streams (see DirectStreamTransform's dropPolicy) it also stores the milliseconds since the frame was read
+ * in FrameLatency and the fraction of frames read so far that were dropped in DropRate.
  * \author Charles Otto \cite caotto
  */
 class FPSCalc : public TimeVaryingTransform
@@ -1094,6 +1104,13 @@ public:
             double fps = 1000 * framesSeen / elapsed;
             dst.first().file.set("AvgFPS", fps);
         }
+
+        File &file = dst.first().file;
+        if (file.contains("FrameReadTime")) {
+            file.set("FrameLatency", QDateTime::currentMSecsSinceEpoch() - file.get<qint64>("FrameReadTime"));
+            const qint64 dropped = file.get<qint64>("DroppedFrames", 0);
+            file.set("DropRate", double(dropped) / (dropped + framesSeen));
+        }
     }
 
     void finalize(TemplateList &output)
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -27,8 +28,17 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Performs a two or three point registration.
+ *
+ * A list of templates is warped as one batch into a shared, preallocated output buffer, so a crop kept after
+ * the batch keeps the whole buffer allocated; clone crops that are retained individually.
+ * Every crop is remapped through the fixed point coordinate map warpAffine would compute, so the pixels are
+ * the same as warpAffine's whatever else is in the batch. Templates with identical registrations, such as
+ * crops with fixed Affine points, share one map.
+ * Since the registration points are relative to the output size, a following Resize is best expressed through width and height.
+ *
  * \author Josh Klontz \cite jklontz
  * \note Method: Area should be used for shrinking an image, Cubic for slow but accurate enlargment, Bilin for fast enlargement.
+ * \br_property bool gray If true, convert each warped crop to a single channel, which is cheaper than converting the whole source image first. Default is false.
  */
 class AffineTransform : public UntrainableTransform
 {
@@ -64,6 +74,7 @@ private:
     Q_PROPERTY(BorderMode borderMode READ get_borderMode WRITE set_borderMode RESET reset_borderMode STORED false)
     Q_PROPERTY(bool storeAffine READ get_storeAffine WRITE set_storeAffine RESET reset_storeAffine STORED false)
     Q_PROPERTY(bool warpPoints READ get_warpPoints WRITE set_warpPoints RESET reset_warpPoints STORED false)
+    Q_PROPERTY(bool gray READ get_gray WRITE set_gray RESET reset_gray STORED false)
     BR_PROPERTY(int, width, 64)
     BR_PROPERTY(int, height, 64)
     BR_PROPERTY(float, x1, 0)
@@ -76,6 +87,30 @@ private:
     BR_PROPERTY(BorderMode, borderMode, Constant)
     BR_PROPERTY(bool, storeAffine, false)
     BR_PROPERTY(bool, warpPoints, false)
+    BR_PROPERTY(bool, gray, false)
+
+    bool twoPoints;
+    Point2f dstPoints[3];
+
+    // The registration of one template, or an empty affine to fall back on resizing
+    struct Warp
+    {
+        Mat affine;
+        const Mat *map1, *map2;
+    };
+
+    // Coordinate maps shared by every template of a batch with the same registration
+    struct Maps
+    {
+        Mat map1, map2;
+    };
+
+    struct Batch
+    {
+        const TemplateList *src;
+        QVector<Template*> dst;
+        QVector<Warp> warps;
+    };
 
     static Point2f getThirdAffinePoint(const Point2f &a, const Point2f &b)
     {
@@ -84,51 +119,214 @@ private:
         return Point2f(a.x - dy, a.y + dx);
     }
 
-    void project(const Template &src, Template &dst) const
+    void init()
     {
-        const bool twoPoints = ((x3 == -1) || (y3 == -1));
-
-        Point2f dstPoints[3];
+        twoPoints = ((x3 == -1) || (y3 == -1));
         dstPoints[0] = Point2f(x1*width, y1*height);
         dstPoints[1] = Point2f((x2 == -1 ? 1 - x1 : x2)*width, (y2 == -1 ? y1 : y2)*height);
         if (twoPoints) dstPoints[2] = getThirdAffinePoint(dstPoints[0], dstPoints[1]);
         else           dstPoints[2] = Point2f(x3*width, y3*height);
+    }
 
+    Mat registration(const File &file) const
+    {
         Point2f srcPoints[3];
-        if (src.file.contains("Affine_0") &&
-            src.file.contains("Affine_1") &&
-            (src.file.contains("Affine_2") || twoPoints)) {
-            srcPoints[0] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_0"));
-            srcPoints[1] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_1"));
-            if (!twoPoints) srcPoints[2] = OpenCVUtils::toPoint(src.file.get<QPointF>("Affine_2"));
+        const QVariant affine0 = file.value("Affine_0");
+        const QVariant affine1 = file.value("Affine_1");
+        const QVariant affine2 = twoPoints ? QVariant() : file.value("Affine_2");
+        if (affine0.isValid() && affine1.isValid() && (affine2.isValid() || twoPoints)) {
+            srcPoints[0] = OpenCVUtils::toPoint(affine0.toPointF());
+            srcPoints[1] = OpenCVUtils::toPoint(affine1.toPointF());
+            if (!twoPoints) srcPoints[2] = OpenCVUtils::toPoint(affine2.toPointF());
         } else {
-            const QList<Point2f> landmarks = OpenCVUtils::toPoints(src.file.points());
+            const QList<QPointF> landmarks = file.points();
+            if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3)))
+                return Mat();
+            srcPoints[0] = OpenCVUtils::toPoint(landmarks[0]);
+            srcPoints[1] = OpenCVUtils::toPoint(landmarks[1]);
+            if (!twoPoints) srcPoints[2] = OpenCVUtils::toPoint(landmarks[2]);
+        }
+        if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
+        return getAffineTransform(srcPoints, dstPoints);
+    }
 
-            if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3))) {
-                resize(src, dst, Size(width, height));
-                return;
+    int outputType(const Mat &m) const
+    {
+        return gray ? CV_MAKETYPE(m.depth(), 1) : m.type();
+    }
+
+    // The same fixed point maps warpAffine builds from the inverted affine, one block at a time, before remapping
+    void warpMaps(const Mat &affine, Maps &maps) const
+    {
+        const double *A = affine.ptr<double>();
+        double D = A[0]*A[4] - A[1]*A[3];
+        D = D != 0 ? 1./D : 0;
+        double M[6] = { A[4]*D, -A[1]*D, 0, -A[3]*D, A[0]*D, 0 };
+        M[2] = -M[0]*A[2] - M[1]*A[5];
+        M[5] = -M[3]*A[2] - M[4]*A[5];
+
+        const int bits = 10, scale = 1 << bits; // AB_BITS and AB_SCALE in warpAffine
+        const bool nearest = (method == Near);
+        const int roundDelta = nearest ? scale/2 : scale/INTER_TAB_SIZE/2;
+        maps.map1.create(height, width, CV_16SC2);
+        if (nearest) maps.map2.release();
+        else         maps.map2.create(height, width, CV_16UC1);
+
+        QVector<int> adelta(width), bdelta(width);
+        for (int x=0; x<width; x++) {
+            adelta[x] = saturate_cast<int>(M[0]*x*scale);
+            bdelta[x] = saturate_cast<int>(M[3]*x*scale);
+        }
+
+        for (int y=0; y<height; y++) {
+            const int X0 = saturate_cast<int>((M[1]*y + M[2])*scale) + roundDelta;
+            const int Y0 = saturate_cast<int>((M[4]*y + M[5])*scale) + roundDelta;
+            short *xy = maps.map1.ptr<short>(y);
+            if (nearest) {
+                for (int x=0; x<width; x++) {
+                    xy[2*x]   = saturate_cast<short>((X0 + adelta[x]) >> bits);
+                    xy[2*x+1] = saturate_cast<short>((Y0 + bdelta[x]) >> bits);
+                }
             } else {
-                srcPoints[0] = landmarks[0];
-                srcPoints[1] = landmarks[1];
-                if (!twoPoints) srcPoints[2] = landmarks[2];
+                ushort *alpha = maps.map2.ptr<ushort>(y);
+                for (int x=0; x<width; x++) {
+                    const int X = (X0 + adelta[x]) >> (bits - INTER_BITS);
+                    const int Y = (Y0 + bdelta[x]) >> (bits - INTER_BITS);
+                    xy[2*x]   = saturate_cast<short>(X >> INTER_BITS);
+                    xy[2*x+1] = saturate_cast<short>(Y >> INTER_BITS);
+                    alpha[x] = ushort((Y & (INTER_TAB_SIZE-1))*INTER_TAB_SIZE + (X & (INTER_TAB_SIZE-1)));
+                }
             }
         }
-        if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
+    }
+
+    // Writes into dst in place when it is already allocated with the output size and type
+    void warp(const Mat &src, const Warp &warp, Mat &dst) const
+    {
+        const bool convert = gray && (src.channels() > 1);
+        Mat warped = convert ? Mat() : dst;
+        if (warp.affine.empty())
+            resize(src, warped, Size(width, height));
+        else
+            remap(src, warped, *warp.map1, *warp.map2, method == Area ? INTER_LINEAR : int(method), borderMode);
+
+        if (convert) cvtColor(warped, dst, src.channels() == 4 ? COLOR_BGRA2GRAY : COLOR_BGR2GRAY);
+        else         dst = warped;
+    }
 
-        Mat affineTransform = getAffineTransform(srcPoints, dstPoints);
-        warpAffine(src, dst, affineTransform, Size(width, height), method, borderMode);
+    void setMetadata(const File &src, const Mat &affine, File &dst) const
+    {
+        if (affine.empty())
+            return;
 
         if (warpPoints)
-            dst.file.setPoints(OpenCVUtils::rotatePoints(src.file.points(), affineTransform));
+            dst.setPoints(OpenCVUtils::rotatePoints(src.points(), affine));
 
         if (storeAffine) {
             QList<float> affineParams;
             for (int i = 0 ; i < 2; i++)
                 for (int j = 0; j < 3; j++)
-                    affineParams.append(affineTransform.at<double>(i, j));
-            dst.file.setList("affineParameters", affineParams);
+                    affineParams.append(affine.at<double>(i, j));
+            dst.setList("affineParameters", affineParams);
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Warp w;
+        Maps maps;
+        w.affine = registration(src.file);
+        w.map1 = &maps.map1;
+        w.map2 = &maps.map2;
+        if (!w.affine.empty())
+            warpMaps(w.affine, maps);
+
+        dst.file = src.file;
+        foreach (const Mat &m, src) {
+            Mat warped;
+            warp(m, w, warped);
+            dst.append(warped);
         }
+        setMetadata(src.file, w.affine, dst.file);
     }
+
+    static void projectRange(const AffineTransform *transform, Batch *batch, int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            const Template &src = (*batch->src)[i];
+            Template &dst = *batch->dst[i];
+            try {
+                for (int j=0; j<src.size(); j++)
+                    transform->warp(src[j], batch->warps[i], dst[j]);
+                transform->setMetadata(src.file, batch->warps[i].affine, dst.file);
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(transform->objectName()));
+                dst = Template(src.file);
+                dst.file.fte = true;
+            }
+        }
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        Batch batch;
+        batch.src = &src;
+        batch.warps.resize(src.size());
+
+        // Register every template, counting the crops of each output type
+        QHash<QByteArray, Maps> maps;
+        QHash<int, int> crops;
+        for (int i=0; i<src.size(); i++) {
+            Warp &w = batch.warps[i];
+            w.affine = registration(src[i].file);
+            w.map1 = w.map2 = NULL;
+            if (!w.affine.empty())
+                maps.insert(QByteArray((const char*) w.affine.data, int(w.affine.total() * w.affine.elemSize())), Maps());
+            foreach (const Mat &m, src[i])
+                crops[outputType(m)]++;
+        }
+
+        // Build the coordinate maps once for each distinct registration
+        for (QHash<QByteArray, Maps>::iterator it = maps.begin(); it != maps.end(); ++it)
+            warpMaps(Mat(2, 3, CV_64FC1, (void*) it.key().constData()), it.value());
+        for (int i=0; i<src.size(); i++) {
+            Warp &w = batch.warps[i];
+            if (w.affine.empty())
+                continue;
+            const Maps &m = maps[QByteArray((const char*) w.affine.data, int(w.affine.total() * w.affine.elemSize()))];
+            w.map1 = &m.map1;
+            w.map2 = &m.map2;
+        }
+
+        // One buffer per output type, with each crop a contiguous slice of it
+        QHash<int, Mat> buffers;
+        for (QHash<int, int>::const_iterator it = crops.constBegin(); it != crops.constEnd(); ++it)
+            buffers.insert(it.key(), Mat(it.value()*height, width, it.key()));
+        QHash<int, int> next;
+        dst.reserve(dst.size() + src.size());
+        for (int i=0; i<src.size(); i++) {
+            Template t(src[i].file);
+            foreach (const Mat &m, src[i]) {
+                const int type = outputType(m);
+                const int slice = next[type]++;
+                t.append(buffers[type].rowRange(slice*height, (slice+1)*height));
+            }
+            dst.append(t);
+            batch.dst.append(&dst.last());
+        }
+
+        const int threads = std::max(1, std::min(Globals->parallelism, src.size()));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<threads; i++) {
+            const int begin = src.size() * i / threads, end = src.size() * (i+1) / threads;
+            if (threads > 1) futures.addFuture(QtConcurrent::run(projectRange, this, &batch, begin, end));
+            else             projectRange(this, &batch, begin, end);
+        }
+        futures.waitForFinished();
+    }
+
+public:
+    AffineTransform() : UntrainableTransform(false) {}
 };
 
 BR_REGISTER(Transform, AffineTransform)
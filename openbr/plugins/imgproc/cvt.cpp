@@ -51,6 +51,15 @@ private:
     BR_PROPERTY(ColorSpace, colorSpace, Gray)
     BR_PROPERTY(int, channel, -1)
 
+    // Lets a decoder right before this transform produce grayscale directly, see PipeTransform
+    Q_INVOKABLE QVariantMap decodeHints() const
+    {
+        QVariantMap hints;
+        if ((colorSpace == Gray) && (channel == -1))
+            hints.insert("DecodeGrayscale", true);
+        return hints;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         if (src.m().channels() > 1 || colorSpace == Color) cvtColor(src, dst, colorSpace);
@@ -34,6 +34,15 @@ class LimitSizeTransform : public UntrainableTransform
     Q_PROPERTY(int max READ get_max WRITE set_max RESET reset_max STORED false)
     BR_PROPERTY(int, max, -1)
 
+    // Lets a decoder right before this transform reduce the resolution, see PipeTransform
+    Q_INVOKABLE QVariantMap decodeHints() const
+    {
+        QVariantMap hints;
+        if (max > 0)
+            hints.insert("DecodeMinLongSide", max);
+        return hints;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const Mat &m = src;
@@ -73,14 +73,26 @@ BR_REGISTER(Distance, ProductQuantizationDistance)
 /*!
  * \ingroup transforms
  * \brief Product quantization
+ *
+ * When batchSize is positive and smaller than the training set, each codebook is learned with mini-batch
+ * k-means instead of full k-means. When pairs is positive, bayesian score distributions are estimated from at most
+ * pairs genuine and pairs impostor comparisons. Lists of templates are encoded with one distance matrix per subspace.
+ *
  * \br_paper Jegou, Herve, Matthijs Douze, and Cordelia Schmid.
  *           "Product quantization for nearest neighbor search."
  *           Pattern Analysis and Machine Intelligence, IEEE Transactions on 33.1 (2011): 117-128
+ * \br_paper Sculley, D.
+ *           "Web-scale k-means clustering."
+ *           Proceedings of the 19th International Conference on World Wide Web (2010): 1177-1178
  * \author Josh Klontz \cite jklontz
+ * \br_property int batchSize Rows sampled per mini-batch k-means iteration, or 0 for full k-means. Default is 0.
+ * \br_property int iterations Number of mini-batch k-means iterations. Default is 100.
+ * \br_property int pairs Maximum number of genuine and of impostor pairs sampled for bayesian training, or 0 to score every pair. Default is 0.
  */
 class ProductQuantizationTransform : public Transform
 {
     Q_OBJECT
+    Q_CLASSINFO("BatchProject", "true")
     Q_PROPERTY(int n READ get_n WRITE set_n RESET reset_n STORED false)
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
@@ -88,10 +100,17 @@ class ProductQuantizationTransform : public Transform
     BR_PROPERTY(int, n, 2)
     BR_PROPERTY(br::Distance*, distance, Distance::make("L2", this))
     BR_PROPERTY(bool, bayesian, false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(int pairs READ get_pairs WRITE set_pairs RESET reset_pairs STORED false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
+    BR_PROPERTY(int, pairs, 0)
 
     quint16 index;
     QList<Mat> centers;
+    QList<Mat> centerNorms; // Squared L2 norm of each row of centers, derived on train and load
 
 public:
     ProductQuantizationTransform()
@@ -144,10 +163,140 @@ private:
 //        return y / (n*h);
 //    }
 
-    void _train(const Mat &data, const QList<int> &labels, Mat *lut, Mat *center)
+    static Mat squaredNorms(const Mat &center)
     {
-        Mat clusterLabels;
-        kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
+        Mat norms(1, center.rows, CV_32FC1);
+        for (int i=0; i<center.rows; i++)
+            norms.at<float>(0, i) = center.row(i).dot(center.row(i));
+        return norms;
+    }
+
+    // Nearest center of each row of data, from |c|^2 - 2x.c which orders centers the same as |x-c|^2
+    static void assign(const Mat &data, const Mat &center, const Mat &norms, int *labels)
+    {
+        Mat x;
+        if (data.type() == CV_32FC1) x = data;
+        else                         data.convertTo(x, CV_32F);
+
+        const int chunk = 4096;
+        Mat products;
+        for (int begin=0; begin<x.rows; begin+=chunk) {
+            const int end = std::min(x.rows, begin+chunk);
+            gemm(x.rowRange(begin, end), center, -2, repeat(norms, end-begin, 1), 1, products, GEMM_2_T);
+            for (int i=0; i<products.rows; i++) {
+                const float *row = products.ptr<float>(i);
+                labels[begin+i] = int(std::min_element(row, row + products.cols) - row);
+            }
+        }
+    }
+
+    static void sampleRows(const Mat &data, RNG &rng, Mat &batch)
+    {
+        for (int i=0; i<batch.rows; i++)
+            data.row(rng.uniform(0, data.rows)).copyTo(batch.row(i));
+    }
+
+    // Sculley's mini-batch k-means, with per-center learning rates decaying as 1/count
+    void miniBatchKMeans(const Mat &data, RNG &rng, Mat &center) const
+    {
+        Mat batch(std::max(batchSize, 256), data.cols, CV_32FC1), batchLabels;
+        sampleRows(data, rng, batch);
+        kmeans(batch, 256, batchLabels, TermCriteria(TermCriteria::MAX_ITER, 1, 0), 1, KMEANS_PP_CENTERS, center);
+
+        QVector<int> counts(256, 0), labels(batch.rows);
+        for (int iteration=0; iteration<iterations; iteration++) {
+            sampleRows(data, rng, batch);
+            assign(batch, center, squaredNorms(center), labels.data());
+            for (int i=0; i<batch.rows; i++) {
+                const float eta = 1.f / ++counts[labels[i]];
+                float *c = center.ptr<float>(labels[i]);
+                const float *x = batch.ptr<float>(i);
+                for (int j=0; j<batch.cols; j++)
+                    c[j] += eta * (x[j] - c[j]);
+            }
+        }
+    }
+
+    // Scores of every pair when pairs is 0 or there are at most pairs of them, otherwise a uniform sample of each kind
+    void pairScores(const QVector<int> &clusters, const QList<int> &labels, const Mat &fullLUT, RNG &rng,
+                    QVector<float> &genuineScores, QVector<float> &impostorScores) const
+    {
+        const int n = clusters.size();
+        if ((pairs <= 0) || (qint64(n)*(n-1)/2 <= pairs)) {
+            for (int i=0; i<n; i++)
+                for (int j=i+1; j<n; j++) {
+                    const float score = fullLUT.at<float>(0, clusters[i]*256+clusters[j]);
+                    if (labels[i] == labels[j]) genuineScores.append(score);
+                    else                        impostorScores.append(score);
+                }
+            return;
+        }
+
+        QHash<int, QVector<int> > groups;
+        for (int i=0; i<n; i++)
+            groups[labels[i]].append(i);
+
+        // Choose genuine pairs by label with probability proportional to its pair count
+        QList<QVector<int> > members;
+        QVector<qint64> cumulativePairs;
+        qint64 genuinePairs = 0;
+        foreach (const QVector<int> &group, groups) {
+            if (group.size() < 2)
+                continue;
+            genuinePairs += qint64(group.size())*(group.size()-1)/2;
+            members.append(group);
+            cumulativePairs.append(genuinePairs);
+        }
+
+        if (genuinePairs <= pairs) {
+            foreach (const QVector<int> &group, members)
+                for (int i=0; i<group.size(); i++)
+                    for (int j=i+1; j<group.size(); j++)
+                        genuineScores.append(fullLUT.at<float>(0, clusters[group[i]]*256+clusters[group[j]]));
+        } else {
+            for (int k=0; k<pairs; k++) {
+                const qint64 pair = qint64(rng.uniform(0., 1.) * genuinePairs);
+                const QVector<int> &group = members[int(std::upper_bound(cumulativePairs.begin(), cumulativePairs.end(), pair) - cumulativePairs.begin())];
+                const int i = rng.uniform(0, group.size());
+                int j = rng.uniform(0, group.size()-1);
+                if (j >= i) j++;
+                genuineScores.append(fullLUT.at<float>(0, clusters[group[i]]*256+clusters[group[j]]));
+            }
+        }
+
+        const qint64 impostorPairs = qint64(n)*(n-1)/2 - genuinePairs;
+        if (impostorPairs <= pairs) {
+            for (int i=0; i<n; i++)
+                for (int j=i+1; j<n; j++)
+                    if (labels[i] != labels[j])
+                        impostorScores.append(fullLUT.at<float>(0, clusters[i]*256+clusters[j]));
+            return;
+        }
+
+        // Nearly every random pair is an impostor, rejecting the rest
+        while (impostorScores.size() < pairs) {
+            const int i = rng.uniform(0, n);
+            int j = rng.uniform(0, n-1);
+            if (j >= i) j++;
+            if (labels[i] != labels[j])
+                impostorScores.append(fullLUT.at<float>(0, clusters[i]*256+clusters[j]));
+        }
+    }
+
+    void _train(const Mat &data, const QList<int> &labels, Mat *lut, Mat *center, int seed)
+    {
+        RNG rng(seed);
+        QVector<int> clusters(data.rows);
+        if ((batchSize > 0) && (data.rows > batchSize)) {
+            miniBatchKMeans(data, rng, *center);
+            if (bayesian)
+                assign(data, *center, squaredNorms(*center), clusters.data());
+        } else {
+            Mat clusterLabels;
+            kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
+            for (int i=0; i<data.rows; i++)
+                clusters[i] = clusterLabels.at<int>(i);
+        }
 
         Mat fullLUT(1, 256*256, CV_32FC1);
         for (int i=0; i<256; i++)
@@ -155,16 +304,8 @@ private:
                 fullLUT.at<float>(0,i*256+j) = distance->compare(center->row(i), center->row(j));
 
         if (bayesian) {
-            QList<int> indicies = OpenCVUtils::matrixToVector<int>(clusterLabels);
             QVector<float> genuineScores, impostorScores;
-            genuineScores.reserve(indicies.size());
-            impostorScores.reserve(indicies.size()*indicies.size()/2);
-            for (int i=0; i<indicies.size(); i++)
-                for (int j=i+1; j<indicies.size(); j++) {
-                    const float score = fullLUT.at<float>(0, indicies[i]*256+indicies[j]);
-                    if (labels[i] == labels[j]) genuineScores.append(score);
-                    else                        impostorScores.append(score);
-                }
+            pairScores(clusters, labels, fullLUT, rng, genuineScores, impostorScores);
 
             genuineScores = Common::Downsample(genuineScores, 256);
             impostorScores = Common::Downsample(impostorScores, 256);
@@ -232,36 +373,60 @@ private:
 
         QFutureSynchronizer<void> futures;
         for (int i=0; i<lut.rows; i++) {
-            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i]));
-            else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &ProductQuantizationTransform::_train, subdata[i], labels, &subluts[i], &centers[i], i));
+            else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i], i);
         }
         futures.waitForFinished();
+
+        centerNorms.clear();
+        foreach (const Mat &center, centers)
+            centerNorms.append(squaredNorms(center));
     }
 
-    int getIndex(const Mat &m, const Mat &center) const
+    // Codes of each row of data, one subspace at a time
+    void encode(const Mat &data, Mat &codes) const
     {
-        int bestIndex = 0;
-        double bestDistance = std::numeric_limits<double>::max();
-        for (int j=0; j<256; j++) {
-            double distance = norm(m, center.row(j), NORM_L2);
-            if (distance < bestDistance) {
-                bestDistance = distance;
-                bestIndex = j;
-            }
+        const int step = getStep(data.cols);
+        const int offset = getOffset(data.cols);
+        const int dims = getDims(data.cols);
+        codes = Mat(data.rows, sizeof(quint16)+dims, CV_8UC1);
+        QVector<int> labels(data.rows);
+        for (int i=0; i<dims; i++) {
+            assign(data.colRange(max(0, i*step-offset), (i+1)*step-offset), centers[i], centerNorms[i], labels.data());
+            for (int j=0; j<data.rows; j++)
+                codes.at<uchar>(j, sizeof(quint16)+i) = labels[j];
         }
-        return bestIndex;
+        for (int j=0; j<data.rows; j++)
+            memcpy(codes.ptr(j), &index, sizeof(quint16));
     }
 
     void project(const Template &src, Template &dst) const
     {
-        Mat m = src.m().reshape(1, 1);
-        const int step = getStep(m.cols);
-        const int offset = getOffset(m.cols);
-        const int dims = getDims(m.cols);
-        dst = Mat(1, sizeof(quint16)+dims, CV_8UC1);
-        memcpy(dst.m().data, &index, sizeof(quint16));
-        for (int i=0; i<dims; i++)
-            dst.m().at<uchar>(0,sizeof(quint16)+i) = getIndex(m.colRange(max(0, i*step-offset), (i+1)*step-offset), centers[i]);
+        Mat codes;
+        encode(src.m().reshape(1, 1), codes);
+        dst = codes;
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        for (int i=0; i<src.size(); i++)
+            if (src[i].isEmpty() || (src[i].m().total() != src.first().m().total()) || (src[i].m().type() != src.first().m().type())) {
+                // Templates can't be stacked, encode them one at a time
+                Transform::project(src, dst);
+                return;
+            }
+        if (src.isEmpty())
+            return;
+
+        Mat data(src.size(), int(src.first().m().total()*src.first().m().channels()), src.first().m().depth());
+        for (int i=0; i<src.size(); i++)
+            src[i].m().reshape(1, 1).copyTo(data.row(i));
+
+        Mat codes;
+        encode(data, codes);
+        dst.reserve(dst.size() + src.size());
+        for (int i=0; i<src.size(); i++)
+            dst.append(Template(src[i].file, codes.row(i)));
     }
 
     void store(QDataStream &stream) const
@@ -275,6 +440,10 @@ private:
         while (ProductQuantizationLUTs.size() <= index)
             ProductQuantizationLUTs.append(Mat());
         stream >> ProductQuantizationLUTs[index];
+
+        centerNorms.clear();
+        foreach (const Mat &center, centers)
+            centerNorms.append(squaredNorms(center));
     }
 };
 
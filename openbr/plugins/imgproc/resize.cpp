@@ -55,6 +55,16 @@ private:
     BR_PROPERTY(bool, preserveAspect, false)
     BR_PROPERTY(bool, pad, true)
 
+    // Lets a decoder right before this transform reduce the resolution, see PipeTransform
+    Q_INVOKABLE QVariantMap decodeHints() const
+    {
+        QVariantMap hints;
+        // Either side of the image may end up as rows or columns once EXIF orientation is applied
+        if (std::max(rows, columns) > 0)
+            hints.insert("DecodeMinShortSide", std::max(rows, columns));
+        return hints;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         if ((rows == -1) && (columns == -1)) {
@@ -39,12 +39,16 @@ namespace br
  * \br_property float eps Parameter for non-maximum supression
  * \br_property int minNeighbors Parameter for non-maximum supression
  * \br_property bool group If false, non-maxima supression will not be performed
+ * \br_property enum suppression How detections are suppressed when grouping. Options are [Group, Greedy, Soft]. Group merges similar windows, Greedy keeps the most confident of overlapping windows and Soft decays the confidence of overlapping windows instead of discarding them. Default is Group.
+ * \br_property float overlap Intersection over union above which Greedy and Soft suppression treat two windows as the same detection
  * \br_property int shrinkingFactor Step value for sliding window
  * \br_property bool clone If false, window will not be cloned (i.e. the representation used by the classifier does not need continuous matrix data)
+ * \br_property bool batch If true, each row of windows is classified in one call so the classifier can evaluate them together. Detections are unchanged, but windows skipped after a rejection are still evaluated. Default is false.
  */
 class SlidingWindowTransform : public MetaTransform
 {
     Q_OBJECT
+    Q_ENUMS(Suppression)
 
     Q_PROPERTY(br::Classifier* classifier READ get_classifier WRITE set_classifier RESET reset_classifier STORED false)
 
@@ -55,11 +59,21 @@ class SlidingWindowTransform : public MetaTransform
     Q_PROPERTY(float eps READ get_eps WRITE set_eps RESET reset_eps STORED false)
     Q_PROPERTY(float minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
     Q_PROPERTY(bool group READ get_group WRITE set_group RESET reset_group STORED false)
+    Q_PROPERTY(Suppression suppression READ get_suppression WRITE set_suppression RESET reset_suppression STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
     Q_PROPERTY(int shrinkingFactor READ get_shrinkingFactor WRITE set_shrinkingFactor RESET reset_shrinkingFactor STORED false)
     Q_PROPERTY(bool clone READ get_clone WRITE set_clone RESET reset_clone STORED false)
+    Q_PROPERTY(bool batch READ get_batch WRITE set_batch RESET reset_batch STORED false)
     Q_PROPERTY(float minConfidence READ get_minConfidence WRITE set_minConfidence RESET reset_minConfidence STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
     Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
+
+public:
+    enum Suppression { Group = OpenCVUtils::Group,
+                       Greedy = OpenCVUtils::Greedy,
+                       Soft = OpenCVUtils::Soft };
+
+private:
     BR_PROPERTY(br::Classifier*, classifier, NULL)
     BR_PROPERTY(int, minSize, 20)
     BR_PROPERTY(int, maxSize, -1)
@@ -68,8 +82,11 @@ class SlidingWindowTransform : public MetaTransform
     BR_PROPERTY(float, eps, 0.2)
     BR_PROPERTY(int, minNeighbors, 3)
     BR_PROPERTY(bool, group, true)
+    BR_PROPERTY(Suppression, suppression, Group)
+    BR_PROPERTY(float, overlap, 0.3)
     BR_PROPERTY(int, shrinkingFactor, 1)
     BR_PROPERTY(bool, clone, true)
+    BR_PROPERTY(bool, batch, false)
     BR_PROPERTY(float, minConfidence, 0)
     BR_PROPERTY(bool, ROCMode, false)
     BR_PROPERTY(QString, outputVariable, "Face")
@@ -143,35 +160,65 @@ class SlidingWindowTransform : public MetaTransform
                 }
                 rep = classifier->preprocess(rep);
 		
-                // Pre-allocate the window to avoid constructing this every iteration
-                Template window(t.file);
-                for (int i=0; i<rep.size(); i++)
-                    window.append(Mat());
-
                 const int step = factor > 2.0 ? shrinkingFactor : shrinkingFactor*2;
+                if (!batch) {
+                    // Pre-allocate the window to avoid constructing this every iteration
+                    Template window(t.file);
+                    for (int i=0; i<rep.size(); i++)
+                        window.append(Mat());
+
+                    for (int y = 0; y < scaledImageSize.height-classifierSize.height; y += step) {
+                        for (int x = 0; x < scaledImageSize.width-classifierSize.width; x += step) {
+                            for (int i=0; i<rep.size(); i++) {
+                                if (clone)
+                                    window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))).clone();
+                                else
+                                    window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy)));
+                            }
+
+                            float confidence = 0;
+                            int result = classifier->classify(window, false, &confidence);
+
+                            if (result == 1) {
+                                rects.append(Rect(cvRound(x/widthScale), cvRound(y/heightScale), detectionSize.width, detectionSize.height));
+                                confidences.append(confidence);
+                            } else
+                                x += step;
+                        }
+                    }
+                    continue;
+                }
+
+                // Classify every window in a row as one batch so the classifier can evaluate them together
                 for (int y = 0; y < scaledImageSize.height-classifierSize.height; y += step) {
+                    TemplateList windows;
                     for (int x = 0; x < scaledImageSize.width-classifierSize.width; x += step) {
+                        Template window(t.file);
                         for (int i=0; i<rep.size(); i++) {
                             if (clone)
-                                window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))).clone();
+                                window.append(rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))).clone());
                             else
-                                window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy)));
+                                window.append(rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))));
                         }
+                        windows.append(window);
+                    }
 
-                        float confidence = 0;
-                        int result = classifier->classify(window, false, &confidence);
-
-                        if (result == 1) {
-                            rects.append(Rect(cvRound(x/widthScale), cvRound(y/heightScale), detectionSize.width, detectionSize.height));
-                            confidences.append(confidence);
-                        } else
-                            x += step;
+                    QList<float> windowConfidences;
+                    const QList<float> results = classifier->classify(windows, false, &windowConfidences);
+                    for (int j=0; j<results.size(); j++) {
+                        if (results[j] == 1) {
+                            rects.append(Rect(cvRound(j*step/widthScale), cvRound(y/heightScale), detectionSize.width, detectionSize.height));
+                            confidences.append(windowConfidences[j]);
+                        } else {
+                            // The window after a rejected one is skipped, as when classifying them one at a time
+                            j++;
+                        }
                     }
                 }
             }
 
             if (group)
-                OpenCVUtils::group(rects, confidences, minGroupingConfidence, minNeighbors, eps);
+                OpenCVUtils::suppress(rects, confidences, static_cast<OpenCVUtils::Suppression>(suppression), minGroupingConfidence, minNeighbors, eps, overlap);
 
             if (!ROCMode && findMostConfident && !rects.isEmpty()) {
                 Rect rect = rects.first();
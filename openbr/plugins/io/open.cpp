@@ -17,6 +17,7 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -26,21 +27,38 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Applies Format to Template filename and appends results.
+ *
+ * The template metadata keys DecodeMinShortSide, DecodeMinLongSide and DecodeGrayscale are decode hints,
+ * usually handed over by PipeTransform from the transforms that follow.
+ * Templates with points or rects are always decoded at full resolution so their coordinates remain valid.
  * \author Josh Klontz \cite jklontz
  */
 class OpenTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_CLASSINFO("DecodeHints", "true")
 
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
+
+        // Reducing the resolution would invalidate existing landmarks
+        const bool reduce = src.file.points().isEmpty() && src.file.rects().isEmpty();
+        const int shortSide = reduce ? src.file.get<int>("DecodeMinShortSide", 0) : 0;
+        const int longSide = reduce ? src.file.get<int>("DecodeMinLongSide", 0) : 0;
+        const bool grayscale = src.file.getBool("DecodeGrayscale");
+
         if (src.empty()) {
             if (Globals->verbose)
                 qDebug("Opening %s", qPrintable(src.file.flat()));
 
             // Read from disk otherwise
-            foreach (const File &file, src.file.split()) {
+            foreach (File file, src.file.split()) {
+                file.remove("DecodeMinShortSide");
+                file.remove("DecodeMinLongSide");
+                if (shortSide > 0) file.set("DecodeMinShortSide", shortSide);
+                if (longSide > 0)  file.set("DecodeMinLongSide", longSide);
+                if (grayscale)     file.set("DecodeGrayscale", true);
                 QScopedPointer<Format> format(Factory<Format>::make(file));
                 Template t = format->read();
                 if (t.isEmpty())
@@ -56,7 +74,8 @@ class OpenTransform : public UntrainableMetaTransform
                 if (((m.rows > 1) && (m.cols > 1)) || (m.type() != CV_8UC1))
                     dst += m;
                 else {
-                    Mat dec = imdecode(src.m(), IMREAD_UNCHANGED);
+                    Mat dec = grayscale ? OpenCVUtils::decode(m, IMREAD_GRAYSCALE, shortSide, longSide)
+                                        : imdecode(src.m(), IMREAD_UNCHANGED);
                     if (dec.empty()) qWarning("Can't decode %s", qPrintable(src.file.flat()));
                     else dst += dec;
                 }
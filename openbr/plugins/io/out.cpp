@@ -16,6 +16,8 @@
 
 #include <openbr/plugins/openbr_internal.h>
 
+using namespace cv;
+
 namespace br
 {
 
@@ -49,23 +51,19 @@ class OutputTransform : public TimeVaryingTransform
         foreach (const Template &t, dst) {
             bool fte = t.file.getBool("FTE") || t.file.fte;
 
-            for (int i=0; i < scoresPerMat; i++) {
-                output->setRelative(fte ? -std::numeric_limits<float>::max() : t.m().at<float>(0, i), currentRow, currentCol);
-
-                // row-major input
-                if (!transposeMode)
-                    currentCol++;
-                // col-major input
-                else
-                    currentRow++;
-            }
-            // filled in a row, advance to the next, reset column position
+            // row-major input, hand the whole row to the output
             if (!transposeMode) {
+                output->setRelativeRow(fte ? invalidScores.ptr<float>() : t.m().ptr<float>(0), fte ? invalidMask.ptr<uchar>() : NULL,
+                                       currentRow, currentCol, scoresPerMat);
+                // filled in a row, advance to the next, reset column position
                 currentRow++;
                 currentCol = 0;
             }
-            // filled in a column, advance, reset row
+            // col-major input, hand the whole column to the output
             else {
+                output->setRelativeTile(fte ? invalidScores : Mat(scoresPerMat, 1, CV_32FC1, (void*) t.m().ptr<float>(0)), fte ? invalidMask : Mat(),
+                                        currentRow, currentCol);
+                // filled in a column, advance, reset row
                 currentCol++;
                 currentRow = 0;
             }
@@ -81,7 +79,7 @@ class OutputTransform : public TimeVaryingTransform
                 currentBlockCol++;
                 blockDone = true;
             }
-            else return;
+            else continue;
 
             if (blockDone) {
                 // set the next block, only necessary if we haven't buffered the current item
@@ -134,9 +132,14 @@ class OutputTransform : public TimeVaryingTransform
         output->initialize(targetFiles, queryFiles);
 
         output->setBlock(currentBlockRow, currentBlockCol);
+
+        // Stand-ins for the scores of templates that failed to enroll
+        invalidScores = Mat::zeros(scoresPerMat, 1, CV_32FC1);
+        invalidMask = Mat::zeros(scoresPerMat, 1, CV_8UC1);
     }
 
     QSharedPointer<Output> output;
+    Mat invalidScores, invalidMask;
 
     int bufferedSize;
 
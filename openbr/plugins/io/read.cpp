@@ -26,12 +26,19 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Read images
+ *
+ * The template metadata keys DecodeMinShortSide and DecodeMinLongSide are lower bounds on the resolution the rest of the
+ * algorithm needs, and DecodeGrayscale turns Color mode into Grayscale. They are usually handed over by PipeTransform
+ * from the transforms that follow, and let JPEG images be decoded at a reduced scale.
+ * Templates with points or rects are always decoded at full resolution so their coordinates remain valid.
  * \author Josh Klontz \cite jklontz
+ * \br_property enum mode Decode mode, options are [Unchanged, Grayscale, Color, AnyDepth, AnyColor]. Default is Color.
  */
 class ReadTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
     Q_ENUMS(Mode)
+    Q_CLASSINFO("DecodeHints", "true")
     Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode)
 
 public:
@@ -53,8 +60,14 @@ private:
         if (Globals->verbose)
             qDebug("Opening %s", qPrintable(src.file.flat()));
 
+        // Reducing the resolution would invalidate existing landmarks
+        const bool reduce = src.file.points().isEmpty() && src.file.rects().isEmpty();
+        const int shortSide = reduce ? src.file.get<int>("DecodeMinShortSide", 0) : 0;
+        const int longSide = reduce ? src.file.get<int>("DecodeMinLongSide", 0) : 0;
+        const int flags = ((mode == Color) && src.file.getBool("DecodeGrayscale")) ? int(Grayscale) : int(mode);
+
         if (src.empty()) {
-            const Mat img = imread(src.file.resolved().toStdString(), mode);
+            const Mat img = OpenCVUtils::read(src.file.resolved(), flags, shortSide, longSide);
             if (img.data) dst.append(img);
             else          dst.file.fte = true;
         } else {
@@ -62,7 +75,7 @@ private:
                 if (((m.rows > 1) && (m.cols > 1)) || (m.type() != CV_8UC1))
                     dst += m;
                 else {
-                    const Mat img = imdecode(m, mode);
+                    const Mat img = OpenCVUtils::decode(m, flags, shortSide, longSide);
                     if (img.data) dst.append(img);
                     else          dst.file.fte = true;
                 }
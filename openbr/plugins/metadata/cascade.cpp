@@ -194,15 +194,20 @@ private:
  * \br_link http://docs.opencv.org/modules/objdetect/doc/cascade_classification.html
  * \author Josh Klontz \cite jklontz
  * \author David Crouse \cite dgcrouse
+ * \br_property enum suppression How raw windows are grouped in ROCMode. Options are [Group, Greedy, Soft], see SlidingWindowTransform. Group uses OpenCV's own grouping and confidences. Default is Group.
+ * \br_property float overlap Intersection over union of windows suppressed by Greedy and Soft suppression in ROCMode
  */
 class CascadeTransform : public MetaTransform
 {
     Q_OBJECT
+    Q_ENUMS(Suppression)
     Q_PROPERTY(QString model READ get_model WRITE set_model RESET reset_model STORED false)
     Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
     Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
     Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(Suppression suppression READ get_suppression WRITE set_suppression RESET reset_suppression STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
 
     // Training parameters 
     Q_PROPERTY(int numStages READ get_numStages WRITE set_numStages RESET reset_numStages STORED false) 
@@ -224,11 +229,19 @@ class CascadeTransform : public MetaTransform
     Q_PROPERTY(bool show READ get_show WRITE set_show RESET reset_show STORED false)    
     Q_PROPERTY(bool baseFormatSave READ get_baseFormatSave WRITE set_baseFormatSave RESET reset_baseFormatSave STORED false)
 
+public:
+    enum Suppression { Group = OpenCVUtils::Group,
+                       Greedy = OpenCVUtils::Greedy,
+                       Soft = OpenCVUtils::Soft };
+
+private:
     BR_PROPERTY(QString, model, "FrontalFace")
     BR_PROPERTY(int, minSize, 64)
     BR_PROPERTY(int, minNeighbors, 5)
     BR_PROPERTY(bool, ROCMode, false)
     BR_PROPERTY(float, scaleFactor, 1.2)
+    BR_PROPERTY(Suppression, suppression, Group)
+    BR_PROPERTY(float, overlap, 0.3)
 
     // Training parameters - Default values provided trigger OpenCV defaults
     BR_PROPERTY(int, numStages, -1)
@@ -412,8 +425,23 @@ class CascadeTransform : public MetaTransform
                 std::vector<Rect> rects;
                 std::vector<int> rejectLevels;
                 std::vector<double> levelWeights;
-                if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, scaleFactor, minNeighbors, flags | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
-                else         cascade->detectMultiScale(m, rects, scaleFactor, minNeighbors, flags, Size(minSize, minSize));
+                QList<float> confidences;
+                if (ROCMode && (suppression == Group)) {
+                    // OpenCV's own grouping, which gives each group the reject level and weight it reports
+                    cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, scaleFactor, minNeighbors, flags | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
+                } else if (ROCMode) {
+                    // Ask for the raw windows, every one of which has a confidence, and suppress them
+                    // with the same engine as the other detection transforms
+                    cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, scaleFactor, 0, flags | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
+
+                    QList<Rect> candidates = QList<Rect>::fromVector(QVector<Rect>::fromStdVector(rects));
+                    for (size_t j=0; j<rects.size(); j++)
+                        confidences.append(rejectLevels[j]*levelWeights[j]);
+                    OpenCVUtils::suppress(candidates, confidences, static_cast<OpenCVUtils::Suppression>(suppression), -std::numeric_limits<float>::max(), minNeighbors, 0, overlap);
+                    rects = candidates.toVector().toStdVector();
+                } else {
+                    cascade->detectMultiScale(m, rects, scaleFactor, minNeighbors, flags, Size(minSize, minSize));
+                }
 
                 // It appears that flags is ignored for new model files:
                 // http://docs.opencv.org/modules/objdetect/doc/cascade_classification.html#cascadeclassifier-detectmultiscale
@@ -437,7 +465,9 @@ class CascadeTransform : public MetaTransform
                     Template u(t.file, m);
                     if (empty) {
                         u.file.set("Confidence",-std::numeric_limits<float>::max());
-                    } else if (rejectLevels.size() > j)
+                    } else if (size_t(confidences.size()) > j)
+                        u.file.set("Confidence", confidences[j]);
+                    else if (rejectLevels.size() > j)
                         u.file.set("Confidence", rejectLevels[j]*levelWeights[j]);
                     else
                         u.file.set("Confidence", rects[j].area());
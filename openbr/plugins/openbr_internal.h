@@ -421,6 +421,55 @@ public:
 
 };
 
+/*!
+ * \brief A br::Output that writes one line of text per query as soon as all of its scores are set,
+ *        instead of holding the whole score matrix until it is destroyed.
+ *
+ * Rows are written in query order, so memory is bounded by the rows that complete out of order.
+ * Subclasses call finish() from their destructor to write any rows still outstanding.
+ * Set gzip to compress the text as it is written, appending .gz to the file name.
+ */
+class BR_EXPORT RowOutput : public Output
+{
+    Q_OBJECT
+
+public:
+    Q_PROPERTY(bool gzip READ get_gzip WRITE set_gzip RESET reset_gzip STORED false)
+    BR_PROPERTY(bool, gzip, false)
+
+    ~RowOutput();
+    void initialize(const FileList &targetFiles, const FileList &queryFiles);
+
+protected:
+    RowOutput(bool scores = true) : scores(scores), rows(NULL) {}
+
+    void finish();
+    virtual QByteArray header() const { return QByteArray(); }
+    virtual void appendRow(QByteArray &text, int row, const float *scores) const = 0;
+
+private:
+    struct Row
+    {
+        QVector<float> scores;
+        QAtomicInt filled;
+        QByteArray text;
+        bool ready;
+    };
+
+    const bool scores;
+    QAtomicPointer<Row> *rows;
+    QMutex rowsLock, writeLock;
+    int nextRow;
+    bool started;
+    QFile f;
+    QByteArray pending;
+
+    Row *row(int i);
+    void complete(int i, Row *row);
+    void write(const QByteArray &text, bool flush = false);
+    void set(float value, int i, int j);
+    void setRow(const float *values, const uchar *valid, int i, int j, int size);
+};
 
 void applyAdditionalProperties(const File &temp, Transform *target);
 
@@ -472,6 +521,18 @@ public:
                 return true;
         return false;
     }
+
+protected:
+    // Matrix 'component' of each template in 'indices', sharing the matrix data but not the metadata, so that
+    // distances[component] can score a whole plane of templates in one call
+    static TemplateList plane(const TemplateList &templates, const QList<int> &indices, int component)
+    {
+        TemplateList result;
+        result.reserve(indices.size());
+        foreach (int index, indices)
+            result.append(Template(templates[index][component]));
+        return result;
+    }
 };
 
 }
@@ -23,24 +23,33 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Comma separated values output.
+ *
+ * Each query row is written as soon as all of its scores are set.
+ *
  * \author Josh Klontz \cite jklontz
  */
-class csvOutput : public MatrixOutput
+class csvOutput : public RowOutput
 {
     Q_OBJECT
 
     ~csvOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        lines.append("File," + targetFiles.names().join(","));
-        for (int i=0; i<queryFiles.size(); i++) {
-            QStringList words;
-            for (int j=0; j<targetFiles.size(); j++)
-                words.append(toString(i,j));  // The toString idiom is used to output match scores - see MatrixOutput
-            lines.append(queryFiles[i].name+","+words.join(","));
+        finish();
+    }
+
+    QByteArray header() const
+    {
+        return QString("File," + targetFiles.names().join(",") + "\n").toLocal8Bit();
+    }
+
+    void appendRow(QByteArray &text, int row, const float *scores) const
+    {
+        text.append(queryFiles[row].name.toLocal8Bit());
+        for (int j=0; j<targetFiles.size(); j++) {
+            text.append(',');
+            QtUtils::appendNumber(text, scores[j]);
         }
-        QtUtils::writeFile(file, lines);
+        text.append('\n');
     }
 };
 
@@ -86,6 +86,13 @@ class mtxOutput : public Output
         blockScores.at<float>(i,j) = value;
     }
 
+    void setRelativeRow(const float *values, const uchar *valid, int i, int j, int size)
+    {
+        float *dst = blockScores.ptr<float>(i) + j;
+        for (int k=0; k<size; k++)
+            dst[k] = (!valid || valid[k]) ? values[k] : -std::numeric_limits<float>::max();
+    }
+
     void set(float value, int i, int j)
     {
         (void) value; (void) i; (void) j;
@@ -32,6 +32,11 @@ class nullOutput : public Output
     {
         (void) value; (void) i; (void) j;
     }
+
+    void setRow(const float *values, const uchar *valid, int i, int j, int size)
+    {
+        (void) values; (void) valid; (void) i; (void) j; (void) size;
+    }
 };
 
 BR_REGISTER(Output, nullOutput)
@@ -0,0 +1,157 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+RowOutput::~RowOutput()
+{
+    if (rows) {
+        for (int i=0; i<queryFiles.size(); i++)
+            delete rows[i].load();
+        delete[] rows;
+    }
+}
+
+void RowOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
+{
+    if (rows) {
+        for (int i=0; i<this->queryFiles.size(); i++)
+            delete rows[i].load();
+        delete[] rows;
+    }
+
+    Output::initialize(targetFiles, queryFiles);
+    rows = new QAtomicPointer<Row>[queryFiles.size()];
+    nextRow = 0;
+    started = false;
+}
+
+RowOutput::Row *RowOutput::row(int i)
+{
+    Row *row = rows[i].loadAcquire();
+    if (row)
+        return row;
+
+    QMutexLocker locker(&rowsLock);
+    row = rows[i].loadAcquire();
+    if (!row) {
+        row = new Row();
+        if (scores)
+            row->scores = QVector<float>(targetFiles.size(), -std::numeric_limits<float>::max());
+        row->ready = false;
+        rows[i].storeRelease(row);
+    }
+    return row;
+}
+
+void RowOutput::set(float value, int i, int j)
+{
+    if (!scores)
+        return;
+
+    Row *row = this->row(i);
+    row->scores[j] = value;
+    if (row->filled.fetchAndAddOrdered(1) + 1 == targetFiles.size())
+        complete(i, row);
+}
+
+void RowOutput::setRow(const float *values, const uchar *valid, int i, int j, int size)
+{
+    if (!scores || (size == 0))
+        return;
+
+    Row *row = this->row(i);
+    float *dst = row->scores.data() + j;
+    if (valid) {
+        for (int k=0; k<size; k++)
+            dst[k] = valid[k] ? values[k] : -std::numeric_limits<float>::max();
+    } else {
+        memcpy(dst, values, size * sizeof(float));
+    }
+    if (row->filled.fetchAndAddOrdered(size) + size == targetFiles.size())
+        complete(i, row);
+}
+
+void RowOutput::complete(int i, Row *row)
+{
+    // Format outside the lock so that rows finished by different threads are formatted concurrently
+    appendRow(row->text, i, scores ? row->scores.constData() : NULL);
+    row->scores = QVector<float>();
+
+    QMutexLocker locker(&writeLock);
+    row->ready = true;
+    while (nextRow < queryFiles.size()) {
+        Row *next = rows[nextRow].loadAcquire();
+        if (!next || !next->ready)
+            break;
+        write(next->text);
+        next->text = QByteArray();
+        nextRow++;
+    }
+}
+
+void RowOutput::finish()
+{
+    if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty() || !rows) return;
+
+    // Rows missing scores are written with the default score
+    for (int i=0; i<queryFiles.size(); i++) {
+        Row *row = this->row(i);
+        if (!row->ready)
+            complete(i, row);
+    }
+    write(QByteArray(), true);
+}
+
+void RowOutput::write(const QByteArray &text, bool flush)
+{
+    const QString baseName = QFileInfo(file.name).baseName();
+    if (!started) {
+        started = true;
+        pending = header();
+        if ((baseName != "terminal") && (baseName != "buffer")) {
+            f.setFileName((gzip && !file.name.endsWith(".gz")) ? file.name + ".gz" : file.name);
+            QtUtils::touchDir(f);
+            if (!f.open(QFile::WriteOnly))
+                qFatal("Failed to open %s for writing.", qPrintable(f.fileName()));
+        }
+        if (baseName == "buffer")
+            Globals->buffer.clear();
+    }
+
+    pending.append(text);
+    if (!flush && (pending.size() < (1 << 20)))
+        return;
+
+    if (baseName == "terminal") {
+        fwrite(pending.constData(), 1, pending.size(), stdout);
+    } else if (baseName == "buffer") {
+        Globals->buffer.append(pending);
+        if (flush && Globals->buffer.endsWith('\n'))
+            Globals->buffer.chop(1);
+    } else {
+        f.write(gzip ? QtUtils::gzip(pending) : pending);
+        if (flush)
+            f.close();
+    }
+    pending.clear();
+}
+
+} // namespace br
@@ -23,19 +23,27 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Text file output.
+ *
+ * Writes the name and label of each query, one per line, without storing any scores.
+ *
  * \author Josh Klontz \cite jklontz
  */
-class txtOutput : public MatrixOutput
+class txtOutput : public RowOutput
 {
     Q_OBJECT
 
+public:
+    txtOutput() : RowOutput(false) {}
+
+private:
     ~txtOutput()
     {
-        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
-        QStringList lines;
-        foreach (const File &file, queryFiles)
-            lines.append(file.name + " " + file.get<QString>("Label"));
-        QtUtils::writeFile(file, lines);
+        finish();
+    }
+
+    void appendRow(QByteArray &text, int row, const float *) const
+    {
+        text.append(QString(queryFiles[row].name + " " + queryFiles[row].get<QString>("Label") + "\n").toLocal8Bit());
     }
 };
 
@@ -0,0 +1,122 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup representations
+ * \brief Normalized Pixel Difference features.
+ *
+ * Each feature compares a pair of pixels x and y in the window as (x-y)/(x+y), which is scale
+ * invariant, bounded in [-1,1] and cheap enough to evaluate for every pixel pair.
+ *
+ * \br_paper Shengcai Liao, Anil K. Jain, and Stan Z. Li
+ *           "A Fast and Accurate Unconstrained Face Detector"
+ *           IEEE Transactions on Pattern Analysis and Machine Intelligence, 2016
+ * \br_property int winWidth Width of the detection window
+ * \br_property int winHeight Height of the detection window
+ */
+class NPDRepresentation : public Representation
+{
+    Q_OBJECT
+
+    Q_PROPERTY(int winWidth READ get_winWidth WRITE set_winWidth RESET reset_winWidth STORED false)
+    Q_PROPERTY(int winHeight READ get_winHeight WRITE set_winHeight RESET reset_winHeight STORED false)
+    BR_PROPERTY(int, winWidth, 24)
+    BR_PROPERTY(int, winHeight, 24)
+
+    // Pixel index pairs, in row-major window coordinates, for each feature
+    QVector<int> first, second;
+
+    void init()
+    {
+        const int pixels = winWidth * winHeight;
+        first.clear(); second.clear();
+        first.reserve(pixels * (pixels-1) / 2);
+        second.reserve(pixels * (pixels-1) / 2);
+        for (int i=0; i<pixels; i++)
+            for (int j=i+1; j<pixels; j++) {
+                first.append(i);
+                second.append(j);
+            }
+    }
+
+    Template preprocess(const Template &src) const
+    {
+        Template dst(src.file);
+        foreach (const Mat &m, src) {
+            Mat gray;
+            if (m.channels() == 3) cvtColor(m, gray, COLOR_BGR2GRAY);
+            else                   gray = m;
+            if (gray.depth() != CV_8U) gray.convertTo(gray, CV_8U);
+            dst.append(gray);
+        }
+        return dst;
+    }
+
+    inline float npd(const Mat &m, int index) const
+    {
+        const int a = m.ptr<uchar>(first[index] / winWidth)[first[index] % winWidth];
+        const int b = m.ptr<uchar>(second[index] / winWidth)[second[index] % winWidth];
+        return (a + b) == 0 ? 0 : float(a - b) / (a + b);
+    }
+
+    float evaluate(const Template &src, int idx) const
+    {
+        return npd(src.m(), idx);
+    }
+
+    Mat evaluate(const Template &src, const QList<int> &indices) const
+    {
+        const Mat &m = src.m();
+        const int size = indices.empty() ? numFeatures() : indices.size();
+        Mat result(1, size, CV_32FC1);
+        float *data = result.ptr<float>();
+        for (int i=0; i<size; i++)
+            data[i] = npd(m, indices.empty() ? i : indices[i]);
+        return result;
+    }
+
+    Size windowSize(int *dx, int *dy) const
+    {
+        if (dx && dy)
+            *dx = *dy = 0;
+        return Size(winWidth, winHeight);
+    }
+
+    int numFeatures() const
+    {
+        return first.size();
+    }
+
+    int maxCatCount() const
+    {
+        return 0;
+    }
+};
+
+BR_REGISTER(Representation, NPDRepresentation)
+
+} // namespace br
+
+#include "representation/npd.moc"
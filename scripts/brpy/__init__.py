@@ -192,6 +192,9 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_load_img.argtypes = [c_char_p, c_int]
     br.br_load_img.restype = c_void_p
 
+    br.br_load_raw_img.argtypes = [c_void_p, c_int, c_int, c_int, c_int]
+    br.br_load_raw_img.restype = c_void_p
+
     br.br_unload_img.argtypes = [c_void_p]
     br.br_unload_img.restype = POINTER(c_ubyte)
 
@@ -232,12 +235,28 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_enroll_template_list.argtypes = [c_void_p]
     br.br_enroll_template_list.restype = c_void_p
 
+    # the callback receives a new template list that must be freed with br_free_template_list
+    br.br_enroll_callback = CFUNCTYPE(None, c_void_p, c_void_p)
+    br.br_enroll_template_list_async.argtypes = [c_void_p, br.br_enroll_callback, c_void_p]
+
     br.br_compare_template_lists.argtypes = [c_void_p, c_void_p]
     br.br_compare_template_lists.restype = c_void_p
 
     br.br_get_matrix_output_at.argtypes = [c_void_p, c_int, c_int]
     br.br_get_matrix_output_at.restype = c_float
 
+    br.br_get_matrix_output_rows.argtypes = [c_void_p]
+    br.br_get_matrix_output_rows.restype = c_int
+
+    br.br_get_matrix_output_cols.argtypes = [c_void_p]
+    br.br_get_matrix_output_cols.restype = c_int
+
+    br.br_get_matrix_output.argtypes = [c_void_p, POINTER(c_float), c_int]
+    br.br_get_matrix_output.restype = c_int
+
+    br.br_get_matrix_output_top_k.argtypes = [c_void_p, c_int, POINTER(c_int), POINTER(c_float)]
+    br.br_get_matrix_output_top_k.restype = c_int
+
     br.br_get_template.argtypes = [c_void_p, c_int]
     br.br_get_template.restype = c_void_p
 